@@ -0,0 +1,128 @@
+/* Request parsing microbenchmark for Proxylab, CMU 15-213/513, Fall 2015
+ * Author: Aleksander Bapst (abapst)
+ *
+ * Measures what the proxy spends on a client's request head before it
+ * touches the cache or the network: tokenizing the head in place, building
+ * the cache id and host strings, and composing the rewritten request, both
+ * as the iovec array the worker pool writes with writev and as the flat
+ * buffer the event engine sends. A typical browser request is used, plus
+ * one padded with many small headers to show the cost grows linearly.
+ *
+ * Usage: make bench && ./bench [iterations]
+ */
+
+#include <time.h>
+#include "csapp.h"
+#include "http.h"
+
+#define DEF_ITERATIONS 1000000
+
+static const char *browser_request =
+    "GET http://www.example.com:8080/path/to/resource.html?q=1&r=2 HTTP/1.1\r\n"
+    "Host: www.example.com:8080\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 "
+    "Firefox/115.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+    "image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Referer: http://www.example.com/index.html\r\n"
+    "Cookie: session=0123456789abcdef0123456789abcdef; theme=dark\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Proxy-Connection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "\r\n";
+
+static double bench_request(char *request, size_t len, long iterations,
+                            int flatten);
+static size_t padded_request(char *buf, size_t size, int nheaders);
+static double elapsed_ns(struct timespec *start, struct timespec *end);
+
+int main(int argc, char **argv) {
+    long iterations = (argc > 1) ? atol(argv[1]) : DEF_ITERATIONS;
+    char buf[MAXBUF];
+    size_t len;
+
+    if (iterations < 1)
+        iterations = DEF_ITERATIONS;
+    printf("%ld iterations\n", iterations);
+
+    len = strlen(browser_request);
+    memcpy(buf, browser_request, len + 1);
+    printf("browser request (%zu bytes, 14 headers)\n", len);
+    printf("   iovec:     %7.1f ns/request\n",
+           bench_request(buf, len, iterations, 0));
+    printf("   flattened: %7.1f ns/request\n",
+           bench_request(buf, len, iterations, 1));
+
+    len = padded_request(buf, sizeof(buf), MAX_HEADERS - 1);
+    printf("padded request (%zu bytes, %d headers)\n", len, MAX_HEADERS - 1);
+    printf("   iovec:     %7.1f ns/request\n",
+           bench_request(buf, len, iterations, 0));
+    printf("   flattened: %7.1f ns/request\n",
+           bench_request(buf, len, iterations, 1));
+    return 0;
+}
+
+/*
+ * bench_request - Time the full treatment of the request head in buf, as
+ *                 forward_request gives it, and return the mean cost.
+ */
+static double bench_request(char *request, size_t len, long iterations,
+                            int flatten) {
+    char hostname[MAXLINE], host_port[MAXLINE], cache_id[MAXLINE];
+    char fwd[MAXLINE];
+    struct iovec iov[HEAD_IOV_MAX];
+    request_head head;
+    struct timespec start, end;
+    char *p, *nl, *stop = request + len;
+    long i, sink = 0;
+    int rc;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < iterations; i++) {
+        head_init(&head);
+        rc = 0;
+        for (p = request; rc == 0 && (nl = memchr(p, '\n', stop - p)) != NULL;
+             p = nl + 1)
+            rc = head_line(&head, p, nl - p + 1);
+        if (rc != 1 || head_host(&head, hostname, host_port) < 0 ||
+            head_cache_id(&head, cache_id) < 0) {
+            fprintf(stderr, "bench: request was rejected\n");
+            exit(1);
+        }
+        if (flatten)
+            sink += head_compose(&head, 0, fwd, MAXLINE);
+        else
+            sink += head_iov(&head, iov, 1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    /* Keep the work from being optimized away */
+    if (sink == 0)
+        printf("\n");
+    return elapsed_ns(&start, &end) / iterations;
+}
+
+/* padded_request - Write a request with nheaders short headers into buf. */
+static size_t padded_request(char *buf, size_t size, int nheaders) {
+    size_t len;
+    int i;
+
+    len = snprintf(buf, size, "GET http://localhost:8080/index.html "
+                   "HTTP/1.1\r\n");
+    for (i = 0; i < nheaders && len < size; i++)
+        len += snprintf(buf + len, size - len, "X-Header-%02d: value %d\r\n",
+                        i, i);
+    len += snprintf(buf + len, size - len, "\r\n");
+    return len;
+}
+
+/* elapsed_ns - Nanoseconds from start to end. */
+static double elapsed_ns(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1e9 +
+        (end->tv_nsec - start->tv_nsec);
+}
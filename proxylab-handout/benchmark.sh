@@ -0,0 +1,55 @@
+#!/bin/bash
+#
+# benchmark.sh - Runs the closed-loop load generator (loadgen.c) through
+#     the proxy in a few configurations, with tiny as the origin, and
+#     prints throughput, latency percentiles and hit ratio for each.
+#
+#     usage: ./benchmark.sh [loadgen options]
+#
+#     The options are passed on to every run, e.g. -c 64 -t 10 -k. The
+#     default is 16 clients with keep-alive making 20000 requests.
+#
+
+# Proxy configurations to compare
+CONFIGS=("-t 16"
+         "-t 16 -s 16 -e clock"
+         "-t 16 -e gdsf -a tinylfu"
+         "-t 16 -z"
+         "-m event")
+
+LOADGEN_ARGS=${@:-"-c 16 -n 20000 -k"}
+PORT_START=20000
+MAX_RAND=20000
+
+cd `dirname $0`
+make -s proxy loadgen || exit 1
+if [ ! -x ./tiny/tiny ]
+then
+    (cd ./tiny; make)
+fi
+
+# Kill any stray proxies or tiny servers owned by this user
+killall -q proxy tiny 2> /dev/null
+
+tiny_port=$((( RANDOM % ${MAX_RAND}) + ${PORT_START}))
+proxy_port=`expr ${tiny_port} + 1`
+
+cd ./tiny
+./tiny ${tiny_port} &> /dev/null &
+tiny_pid=$!
+cd ..
+
+for config in "${CONFIGS[@]}"
+do
+    echo "=== ./proxy ${config}"
+    ./proxy ${config} ${proxy_port} &> /dev/null &
+    proxy_pid=$!
+    sleep 1
+    ./loadgen ${LOADGEN_ARGS} ${proxy_port} ${tiny_port}
+    kill ${proxy_pid} 2> /dev/null
+    wait ${proxy_pid} 2> /dev/null
+    echo ""
+done
+
+kill ${tiny_pid} 2> /dev/null
+exit 0
@@ -1,230 +1,668 @@
 /* Cache for Proxylab, CMU 15-213/513, Fall 2015
  * Author: Aleksander Bapst (abapst)
  *
- * Implements a linked-list cache for the proxy server using a LRU
- * cache eviction policy. LRU is approximated by moving recently read objects
- * to the end of the list, and evicting objects from the front of list.
- * Thread safety is implemented using semaphores to block writing to the cache
- * until no readers are present.
+ * Implements a hash-indexed cache for the proxy server using a LRU
+ * cache eviction policy. Objects are found through a chained hash table
+ * keyed by the request id, and are also kept on an intrusive doubly linked
+ * list in LRU order. Recently read objects are moved to the end of the list
+ * and objects are evicted from the front of the list, so lookup, promotion
+ * and eviction are all constant time.
+ *
+ * The cache is split into independent shards, each with its own hash table,
+ * LRU list, byte budget and locks. An object always lives in the shard
+ * selected by the hash of its id, so threads working on different shards
+ * never contend. With a single shard this is a plain global LRU cache.
+ * Each shard has a reader-writer lock (a pthread rwlock): lookups share it,
+ * and only changes to the shard's table and list take it exclusively.
+ * Readers of a shard never wait for each other, only for a writer.
+ *
+ * Eviction is delegated to a policy, a table of hooks called as objects are
+ * inserted, hit, removed and chosen as victims (see policy.c). CACHE_LRU
+ * keeps exact LRU order, so every hit takes the shard's lock exclusively to
+ * relink the object. CACHE_CLOCK treats each shard's list as a ring: a hit
+ * only sets the object's access bit under the shared lock, and eviction
+ * sweeps a hand around the ring, clearing set bits and evicting the first
+ * object whose bit is already clear. Hits are then write-free.
+ * CACHE_GDSF weighs recency, hit count, size and fetch cost.
+ *
+ * Optionally a TinyLFU admission filter guards the cache. Every lookup is
+ * counted in a per-shard frequency sketch (see sketch.c), and a new object
+ * that would have to evict something is only admitted if it has been asked
+ * for more often than the policy's victim. A scan of objects that are never
+ * asked for again then can't flush the popular ones.
+ *
+ * Cached objects are immutable and reference counted. A hit pins the object
+ * and hands it to the caller, who writes the data straight to the client
+ * and then releases it. Evicting an object only drops the cache's own
+ * reference, so the memory is freed by whoever lets go of it last.
+ *
+ * An object, its id and its data share one chunk from a slab allocator (see
+ * slab.c), so adding an object is a single allocation and evicting it a
+ * single free, neither of which takes the malloc lock once the slab pages
+ * exist. All caches share one allocator.
+ *
+ * A disk tier (see disk.c) can be attached behind the shards. Evicted
+ * objects are then demoted to it instead of being dropped, a miss in memory
+ * is looked up on disk and promoted back, and every object still in memory
+ * is written out when the proxy shuts down. Disk writes are made after
+ * the shard's writer lock is released, so they never hold up readers.
+ *
+ * Each request, batch of events or background refresh that uses the cache
+ * holds the cache's users lock shared for as long as it does. Shutting down
+ * closes the cache by taking that lock exclusively, so the cache is saved
+ * and freed only once nothing is using it any more.
+ *
+ * If the cache compresses, text responses are gzipped as they are added
+ * (see gzip.c) and stay gzipped in memory and on disk. Their size in the
+ * byte budget is the compressed size.
  */
 
 #include "cache.h"
+#include "disk.h"
+#include "gzip.h"
+#include "stats.h"
+
+/* Slab classes holding every cache object */
+static slab_allocator *object_slabs = NULL;
 
-/* init_cache - Initialize global cache list, shared by all threads, and
- *              return a pointer to the cache.
+static void hash_insert(cache_shard *shard, cache_object *object);
+static void hash_remove(cache_shard *shard, cache_object *object);
+static void hash_grow(cache_shard *shard);
+static void remove_object(cache_shard *shard, cache_object *object,
+                          int evicted);
+static int store_object(cache_list *cache, cache_shard *shard,
+                        cache_object *new_object);
+
+/* init_cache - Initialize global cache, shared by all threads, and
+ *              return a pointer to the cache. The byte budget, capacity, is
+ *              divided evenly between nshards shards. Objects larger than
+ *              max_object are never cached. The shard count is clamped so
+ *              that every shard can still hold the largest object.
+ *              policy selects CACHE_LRU, CACHE_CLOCK or CACHE_GDSF
+ *              eviction, and admission ADMIT_ALL or ADMIT_TINYLFU.
  */
-cache_list *init_cache() {
-    cache_list *cache = (cache_list *)Malloc(sizeof(cache_list));  
+cache_list *init_cache(unsigned int nshards, int policy, int admission,
+                       size_t capacity, size_t max_object) {
+    cache_list *cache = (cache_list *)Malloc(sizeof(cache_list));
+    cache_shard *shard;
+    unsigned int i;
+
+    if (object_slabs == NULL)
+        object_slabs = init_slabs();
+    if (nshards < 1)
+        nshards = 1;
+    if (nshards > MAX_CACHE_SHARDS)
+        nshards = MAX_CACHE_SHARDS;
+    if (max_object > capacity)
+        max_object = capacity;
+    if (max_object > 0 && nshards > capacity / max_object)
+        nshards = capacity / max_object;
+    if (nshards < 1)
+        nshards = 1;
 
-    Sem_init(&cache->r, 0, 1); // reader semaphore
-    Sem_init(&cache->w, 0, 1); // writer semaphore
+    if (policy < 0 || policy >= CACHE_NPOLICIES)
+        policy = CACHE_LRU;
 
-    cache->first = NULL;
-    cache->last = NULL;
-    cache->space_left = MAX_CACHE_SIZE;
-    cache->readcnt = 0; // number of people trying to read the cache
+    cache->nshards = nshards;
+    cache->policy = policy;
+    cache->admission = admission;
+    cache->capacity = capacity;
+    cache->max_object = max_object;
+    cache->disk = NULL;
+    cache->compress = 0;
+    if (pthread_rwlock_init(&cache->users, NULL) != 0)
+        app_error("pthread_rwlock_init error");
+    cache->closing = 0;
+    Sem_init(&cache->closed, 0, 0);
+    cache->shards = (cache_shard *)Malloc(nshards * sizeof(cache_shard));
+    for (i = 0; i < nshards; i++) {
+        shard = &cache->shards[i];
+        if (pthread_rwlock_init(&shard->lock, NULL) != 0)
+            app_error("pthread_rwlock_init error");
+
+        shard->first = NULL;
+        shard->last = NULL;
+        shard->hand = NULL;
+        shard->heap = NULL;
+        shard->heap_size = shard->heap_cap = 0;
+        shard->inflation = 0;
+        /* About one counter per average sized object the shard can hold */
+        shard->admit = (admission == ADMIT_TINYLFU) ?
+            init_sketch(capacity / nshards / 1024) : NULL;
+        shard->nbuckets = CACHE_INIT_BUCKETS;
+        shard->buckets = (cache_object **)Calloc(shard->nbuckets,
+                                                 sizeof(cache_object *));
+        shard->count = 0;
+        shard->space_left = capacity / nshards;
+        shard->policy = cache_policies[policy];
+    }
     return cache;
 }
 
-/* init_object - Create a new cache object using malloc and return a pointer
- *               to the object.
- */
-cache_object *init_object(char *id, unsigned int length) {
+/* object_size - Bytes of slab memory holding an object, its id and data. */
+static size_t object_size(size_t id_length, size_t length) {
+    return sizeof(cache_object) + id_length + 1 + length;
+}
 
-    cache_object *new_object = (cache_object *)Malloc(sizeof(cache_object));
+/* init_object - Create a new cache object in a single slab chunk and return
+ *               a pointer to the object. The id and then the data follow
+ *               the struct in the chunk.
+ */
+cache_object *init_object(char *id, size_t length) {
+    size_t id_length = strlen(id);
+    cache_object *new_object =
+        (cache_object *)slab_alloc(object_slabs,
+                                   object_size(id_length, length));
 
-    new_object->id = (char *)Malloc(strlen(id)+1);
-    strcpy(new_object->id, id);
+    new_object->id = (char *)(new_object + 1);
+    memcpy(new_object->id, id, id_length + 1);
+    new_object->hash = hash_id(id);
 
+    new_object->refcnt = 1; // the creator's reference
+    new_object->referenced = 0;
+    new_object->freq = 1;
+    new_object->heap_index = 0;
+    new_object->priority = 0;
     new_object->length = length;
-    new_object->data = Malloc(length);
+    new_object->hdr_length = 0;
+    new_object->expires = 0;
+    new_object->identity_length = 0;
+    new_object->data = new_object->id + id_length + 1;
+    new_object->prev = NULL;
     new_object->next = NULL;
+    new_object->hnext = NULL;
     return new_object;
 }
 
-/* open_reader - Add a symbolic 'reader' using semaphores to block writing
- *               until close_reader is called.
+/* free_object - Return a cache object's chunk to its slab class. */
+void free_object(cache_object *object) {
+    slab_free(object_slabs, object,
+              object_size(strlen(object->id), object->length));
+}
+
+/* pin_object - Take an extra reference to an object so that it stays valid
+ *              after it is evicted. Safe to call under a reader lock.
+ */
+void pin_object(cache_object *object) {
+    __sync_fetch_and_add(&object->refcnt, 1);
+}
+
+/* release_object - Drop a reference to an object, freeing it when the last
+ *                  reference goes away.
+ */
+void release_object(cache_object *object) {
+    if (__sync_sub_and_fetch(&object->refcnt, 1) == 0)
+        free_object(object);
+}
+
+/* hash_id - FNV-1a hash of a request id string. */
+unsigned int hash_id(char *id) {
+    unsigned int hash = 2166136261u;
+
+    while (*id) {
+        hash ^= (unsigned char)*id++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* get_shard - Return the shard that owns ids with the given hash. The low
+ *             hash bits index the buckets inside a shard, so the shard is
+ *             picked from the high bits to keep the two independent.
  */
-void open_reader(cache_list *cache) {
-    P(&cache->r);
-    cache->readcnt++;   
-    if (cache->readcnt == 1)
-        P(&cache->w); // Decrement the writing semaphore
-    V(&cache->r);
+cache_shard *get_shard(cache_list *cache, unsigned int hash) {
+    return &cache->shards[(hash >> 16) % cache->nshards];
 }
 
-/* close_reader - Signify that a reader has left by decrementing the reader
- *                count. If no readers are left, increment (unblock) the
- *                writer semaphore.
+/* open_reader - Take the shard's lock shared, blocking writers until
+ *               close_reader is called. Any number of readers hold it at
+ *               once, and taking it is a single atomic update of the lock,
+ *               so hits on a shard never wait for each other.
  */
-void close_reader(cache_list *cache) {
-    P(&cache->r);
-    cache->readcnt--;
-    if (cache->readcnt == 0)
-        V(&cache->w); // Increment the writing semaphore
-    V(&cache->r);
+void open_reader(cache_shard *shard) {
+    pthread_rwlock_rdlock(&shard->lock);
+}
+
+/* close_reader - Release a reader's hold on the shard's lock. */
+void close_reader(cache_shard *shard) {
+    pthread_rwlock_unlock(&shard->lock);
 }
 
-/* search_cache - Traverse the cache list of objects and search for a match.
- *                If a match is found, the object contents  and length are 
- *                read into the query_object buffer and query_length. The
- *                object is then moved to the end of the linked list to mark
- *                it as recently read, and 0 is returned. Otherwise -1 is
- *                returned. This function also uses a simple solution to the
- *                reader-writer problem for thread safety and efficiency.
+/* open_writer - Take the shard's lock exclusively, once every reader and
+ *               any other writer have left, until close_writer is called.
  */
-int search_cache(cache_list *cache, char *query_id, void *query_object,
-                 unsigned int *query_length) {
+void open_writer(cache_shard *shard) {
+    pthread_rwlock_wrlock(&shard->lock);
+}
 
-    open_reader(cache);
+/* close_writer - Release the writer's hold on the shard's lock. */
+void close_writer(cache_shard *shard) {
+    pthread_rwlock_unlock(&shard->lock);
+}
 
-    /* Traverse cache list to find object that matches query */
-    cache_object *match = cache->first; 
-    while (match != NULL) {
-        if (!strcmp(match->id, query_id))
-            break;            
-        match = match->next;
+/* enter_cache - Start using the cache, for one request or batch of events.
+ *               Once the cache is closing, this never returns: the proxy is
+ *               shutting down, and the caller must not touch the cache.
+ */
+void enter_cache(cache_list *cache) {
+    if (__atomic_load_n(&cache->closing, __ATOMIC_ACQUIRE))
+        P(&cache->closed);
+    pthread_rwlock_rdlock(&cache->users);
+}
+
+/* leave_cache - Stop using the cache, after enter_cache. */
+void leave_cache(cache_list *cache) {
+    pthread_rwlock_unlock(&cache->users);
+}
+
+/* close_cache - Keep new users out of the cache and wait up to timeout
+ *               seconds for those in it to leave. Returns 0 once the cache
+ *               is unused, or -1 if a user is still in it.
+ */
+int close_cache(cache_list *cache, int timeout) {
+    struct timespec deadline;
+
+    __atomic_store_n(&cache->closing, 1, __ATOMIC_RELEASE);
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout;
+    return pthread_rwlock_timedwrlock(&cache->users, &deadline) ? -1 : 0;
+}
+
+/* find_object - Look up an object by id in a shard's hash table. The caller
+ *               must hold the shard's lock, shared or exclusively.
+ */
+cache_object *find_object(cache_shard *shard, char *query_id,
+                          unsigned int hash) {
+    cache_object *object = shard->buckets[hash & (shard->nbuckets - 1)];
+
+    while (object != NULL) {
+        if (object->hash == hash && !strcmp(object->id, query_id))
+            return object;
+        object = object->hnext;
     }
+    return NULL;
+}
+
+/* search_cache - Look up the requested object in its shard. If a match
+ *                is found, it is pinned and returned to the caller, who must
+ *                call release_object when done writing it out. The policy
+ *                then records the hit, e.g. LRU moves the object to the end
+ *                of the list and CLOCK sets its access bit. A miss is
+ *                looked up in the disk tier, if there is one, and an
+ *                object found there is promoted back into its shard. NULL is
+ *                returned on a miss in both. Hits and misses alike are
+ *                counted by the admission filter. Lookups share the shard's
+ *                lock, so with CLOCK a hit takes no exclusive lock at all.
+ */
+cache_object *search_cache(cache_list *cache, char *query_id) {
+    unsigned int hash = hash_id(query_id);
+    cache_shard *shard = get_shard(cache, hash);
+    cache_object *match, *pinned;
+
+    if (shard->admit != NULL)
+        sketch_add(shard->admit, hash);
+
+    open_reader(shard);
+    match = find_object(shard, query_id, hash);
 
-    /* Cache hit, read from the cache */
+    /* Cache hit, pin the object so it outlives a concurrent eviction */
     if (match != NULL) {
-        *query_length = match->length;
-        memcpy(query_object, match->data, *query_length);
-    /* Cache miss */
+        pin_object(match);
+        pinned = match;
+        if (!shard->policy->hit_writes)
+            shard->policy->hit(shard, match);
+    /* Cache miss, try the disk tier */
     } else {
-        close_reader(cache);
-        return -1;
-    } 
-    close_reader(cache);
-    
-    /* Move read node to end of list to enforce LRU policy */
-    P(&cache->w);
-    if ((match = delete_object(cache, query_id)) == NULL) {
-        V(&cache->w); // Make sure to close the writer
-        return -1;
+        close_reader(shard);
+        if (cache->disk == NULL ||
+            (match = disk_get(cache->disk, query_id)) == NULL)
+            return NULL;
+        /* Served even if admission keeps it out of memory */
+        pin_object(match);
+        store_object(cache, shard, match);
+        return match;
     }
-    add_to_end(cache, match);
-    V(&cache->w); 
-    return 0;
+    close_reader(shard);
+    if (!shard->policy->hit_writes)
+        return pinned;
+
+    /* The policy needs the writer to record the hit. The object may
+     * have been evicted since we closed the reader, so look it up again.
+     */
+    open_writer(shard);
+    if ((match = find_object(shard, query_id, hash)) != NULL)
+        shard->policy->hit(shard, match);
+    close_writer(shard);
+    return pinned;
 }
 
-/* add_to_end - Add an object to the end of the linked list. This is the most
- *              recently used object.
+/* insert_object - Hand a new object to the shard's policy, which links it
+ *                 into the list, and enter it in the hash table.
  */
-void add_to_end(cache_list *cache, cache_object *object) {
-    if (cache->first == NULL) {
-        cache->first = object;
-        cache->last = object;
-        cache->space_left -= object->length;
-    } else {
-        cache->last->next = object;
-        cache->last = object;
-        cache->space_left -= object->length;
-    }
+void insert_object(cache_shard *shard, cache_object *object) {
+    shard->policy->insert(shard, object);
+    shard->space_left -= object->length;
+    hash_insert(shard, object);
 }
 
-/* delete_object - Delete an object from the cache by rearranging the linked
- *                 list pointers, and return a pointer to the object.
- */
-cache_object *delete_object(cache_list *cache, char *query_id) {
-    cache_object *prev = NULL;
-    cache_object *current = cache->first;
-
-    /* Traverse list and delete requested object */
-    while (current != NULL) {
-        if (!strcmp(current->id, query_id)) {
-            /* Case 1: deleted node is first node */
-            if (current == cache->first)
-                cache->first = current->next;
-            /* Case 2: deleted node is last node */
-            if (current == cache->last)
-                cache->last = prev;
-            /* Case 3: deleted node is not first */
-            if (prev != NULL)
-                prev->next = current->next;
-            current->next = NULL;
-            cache->space_left += current->length;
-            return current;
-        }
-        prev = current;
-        current = current->next;
-    }
-    return NULL;
+/* link_before - Link an object into the list just before another object, or
+ *               at the end of the list if before is NULL.
+ */
+void link_before(cache_shard *shard, cache_object *object,
+                 cache_object *before) {
+    object->next = before;
+    object->prev = (before != NULL) ? before->prev : shard->last;
+    if (object->prev != NULL)
+        object->prev->next = object;
+    else
+        shard->first = object;
+    if (before != NULL)
+        before->prev = object;
+    else
+        shard->last = object;
+}
+
+/* unlink_object - Remove an object from the list only. */
+void unlink_object(cache_shard *shard, cache_object *object) {
+    if (shard->hand == object)
+        shard->hand = object->next;
+    if (object->prev != NULL)
+        object->prev->next = object->next;
+    else
+        shard->first = object->next;
+    if (object->next != NULL)
+        object->next->prev = object->prev;
+    else
+        shard->last = object->prev;
+    object->prev = NULL;
+    object->next = NULL;
 }
 
-/* evict_object - Remove the least recently used (LRU) object from the cache
- *                by removing the first object in the list, and freeing the
- *                object structure.
+/* delete_object - Delete an object from a shard by unlinking it from the
+ *                 hash table and the policy's list, and return a pointer to
+ *                 the object.
  */
-int evict_object(cache_list *cache) {
+cache_object *delete_object(cache_shard *shard, char *query_id) {
+    cache_object *object = find_object(shard, query_id, hash_id(query_id));
 
-    cache_object *object = cache->first;
     if (object == NULL)
-        return -1;
+        return NULL;
 
-    if (object == cache->last)
-        cache->last = NULL;
-    cache->first = object->next;
-    cache->space_left += object->length;
+    remove_object(shard, object, 0);
+    return object;
+}
 
-    /* Free the cached object from memory */
-    Free(object->id);
-    Free(object->data);
-    Free(object);
-    return 0;
+/* evict_object - Remove the object picked by the shard's policy, e.g. the
+ *                least recently used (LRU) one at the front of the list, and
+ *                return it with the cache's reference, or NULL if the shard
+ *                is empty. The caller demotes or releases it.
+ */
+cache_object *evict_object(cache_shard *shard) {
+    cache_object *object;
+
+    if (shard->first == NULL)
+        return NULL;
+    object = shard->policy->victim(shard);
+    remove_object(shard, object, 1);
+    stats_add(STAT_EVICTIONS, 1);
+    return object;
+}
+
+/* remove_object - Take an object out of the hash table and the policy. */
+static void remove_object(cache_shard *shard, cache_object *object,
+                          int evicted) {
+    hash_remove(shard, object);
+    shard->policy->remove(shard, object, evicted);
+    shard->space_left += object->length;
 }
 
-/* add_to_cache - Add an object to the cache, if the size is smaller than
- *                MAX_OBJECT_SIZE. If not enough space is available, objects
- *                are evicted from the front of the linked list until enough
- *                space is made.
+/* add_to_cache - Add an object to its shard, if the size is no larger than
+ *                the cache's max_object. An older object with the same id is
+ *                replaced, also on disk. If not enough space is available,
+ *                objects are evicted until enough space is made. With TinyLFU
+ *                admission a new object that would push out a victim must
+ *                have been asked for more often than that victim, or it is
+ *                not cached and 1 is returned; a new copy of an object that
+ *                is already cached is always admitted. hdr_length records
+ *                where the response headers end, so that per-connection
+ *                headers can be added on a hit, and expires when it goes
+ *                stale. If the cache compresses, text responses are packed
+ *                first and take up only their compressed size.
  */
 int add_to_cache(cache_list *cache, char *new_id, void *new_data,
-                 unsigned int length) {
+                 size_t length, size_t hdr_length, time_t expires) {
+    cache_object *new_object;
+    char *packed = NULL;
+    size_t identity_length = 0;
+    int rc;
+
+    if (length > cache->max_object)
+        return -1;
 
-    cache_object *new_object = init_object(new_id, length);
+    if (cache->compress &&
+        (packed = gzip_response(new_data, &length, &hdr_length,
+                                &identity_length)) != NULL)
+        new_data = packed;
+    new_object = init_object(new_id, length);
     memcpy(new_object->data, new_data, length);
+    new_object->hdr_length = (hdr_length < length) ? hdr_length : 0;
+    new_object->expires = expires;
+    new_object->identity_length = identity_length;
+    if (packed != NULL)
+        Free(packed);
+    rc = store_object(cache, get_shard(cache, new_object->hash), new_object);
 
-    P(&cache->w);
-    while (cache->space_left < new_object->length) {
-        if (evict_object(cache) == -1) {
-            V(&cache->w); // Make sure to close the writer
-            return -1;
+    /* A copy demoted earlier is out of date now */
+    if (cache->disk != NULL)
+        disk_remove(cache->disk, new_id);
+    return rc;
+}
+
+/* object_fresh - Check whether an object can be served at time now without
+ *                asking the host whether it is still valid.
+ */
+int object_fresh(cache_object *object, time_t now) {
+    return __atomic_load_n(&object->expires, __ATOMIC_RELAXED) > now;
+}
+
+/* refresh_object - Move an object's expiry after the host confirmed it is
+ *                  still valid. This is the only change made to an object
+ *                  once it is cached, so it is a single atomic store that
+ *                  readers may race with.
+ */
+void refresh_object(cache_object *object, time_t expires) {
+    __atomic_store_n(&object->expires, expires, __ATOMIC_RELAXED);
+}
+
+/* store_object - Insert a new object into its shard, replacing an object
+ *                with the same id and evicting others as needed. The
+ *                creator's reference passes to the cache, or is released
+ *                if the object is not cached. Evicted objects are demoted to
+ *                the disk tier once the writer lock is released.
+ *                Returns as add_to_cache.
+ */
+static int store_object(cache_list *cache, cache_shard *shard,
+                        cache_object *new_object) {
+    cache_object *old_object, *victim, *evicted = NULL;
+    int rc = 0;
+
+    open_writer(shard);
+    old_object = find_object(shard, new_object->id, new_object->hash);
+
+    /* A one-hit wonder must not push out an object that is asked for more.
+     * A new copy of a cached object is always admitted, so the check comes
+     * before the old copy is deleted and a rejection never drops the id.
+     */
+    if (old_object == NULL && shard->admit != NULL &&
+        shard->space_left < new_object->length && shard->first != NULL &&
+        sketch_estimate(shard->admit, new_object->hash) <=
+        sketch_estimate(shard->admit, shard->policy->peek(shard)->hash)) {
+        rc = 1;
+    } else {
+        /* A refreshed object keeps the standing of the copy it replaces,
+         * so that a refresh never makes a hot object the next victim
+         */
+        if (old_object != NULL) {
+            new_object->freq = old_object->freq;
+            new_object->referenced =
+                __atomic_load_n(&old_object->referenced, __ATOMIC_RELAXED);
+            release_object(delete_object(shard, new_object->id));
+        }
+
+        /* Victims are chained through hnext, unused once out of the table */
+        while (shard->space_left < new_object->length) {
+            if ((victim = evict_object(shard)) == NULL) {
+                rc = -1;
+                break;
+            }
+            victim->hnext = evicted;
+            evicted = victim;
         }
     }
-    add_to_end(cache, new_object);
-    V(&cache->w);
+    if (rc == 0)
+        insert_object(shard, new_object);
+    close_writer(shard); // Make sure to close the writer
 
-    return 0;
-} 
+    if (rc != 0)
+        release_object(new_object);
+    while ((victim = evicted) != NULL) {
+        evicted = victim->hnext;
+        victim->hnext = NULL;
+        if (cache->disk != NULL)
+            disk_put(cache->disk, victim);
+        /* Drop the cache's reference, readers may still hold the object */
+        release_object(victim);
+    }
+    return rc;
+}
+
+/* hash_insert - Enter an object at the head of its hash bucket, growing the
+ *               table when the load factor gets too high.
+ */
+static void hash_insert(cache_shard *shard, cache_object *object) {
+    unsigned int index;
+
+    if (shard->count >= 2 * shard->nbuckets)
+        hash_grow(shard);
+
+    index = object->hash & (shard->nbuckets - 1);
+    object->hnext = shard->buckets[index];
+    shard->buckets[index] = object;
+    shard->count++;
+}
+
+/* hash_remove - Unlink an object from its hash bucket chain. */
+static void hash_remove(cache_shard *shard, cache_object *object) {
+    cache_object **link = &shard->buckets[object->hash & (shard->nbuckets-1)];
+
+    while (*link != NULL) {
+        if (*link == object) {
+            *link = object->hnext;
+            object->hnext = NULL;
+            shard->count--;
+            return;
+        }
+        link = &(*link)->hnext;
+    }
+}
+
+/* hash_grow - Double the number of hash buckets and rehash every object
+ *             using its saved hash value.
+ */
+static void hash_grow(cache_shard *shard) {
+    unsigned int i, index;
+    unsigned int nbuckets = shard->nbuckets * 2;
+    cache_object **buckets = (cache_object **)Calloc(nbuckets,
+                                                     sizeof(cache_object *));
+    cache_object *object, *next;
+
+    for (i = 0; i < shard->nbuckets; i++) {
+        for (object = shard->buckets[i]; object != NULL; object = next) {
+            next = object->hnext;
+            index = object->hash & (nbuckets - 1);
+            object->hnext = buckets[index];
+            buckets[index] = object;
+        }
+    }
+    Free(shard->buckets);
+    shard->buckets = buckets;
+    shard->nbuckets = nbuckets;
+}
 
-/* destroy_cache - Free the cache from memory if a SIGINT is caught. This may
- *                 not be necessary if the kernel frees memory on exiting a
- *                 process, but it helps with portability.
+/* save_cache - Write every object in memory to the disk tier, if there is
+ *              one, and flush the tier to its file. Each shard is walked
+ *              under its writer lock, so this is safe even while requests
+ *              still use the cache.
+ */
+void save_cache(cache_list *cache) {
+    cache_shard *shard;
+    cache_object *object;
+    unsigned int i;
+
+    if (cache->disk == NULL)
+        return;
+    for (i = 0; i < cache->nshards; i++) {
+        shard = &cache->shards[i];
+        open_writer(shard);
+        for (object = shard->first; object != NULL; object = object->next)
+            disk_put(cache->disk, object);
+        close_writer(shard);
+    }
+    disk_sync(cache->disk);
+}
+
+/* destroy_cache - Save the cache to the disk tier and free it from memory
+ *                 when the proxy shuts down. This may not be necessary if
+ *                 the kernel frees memory on exiting a process, but it
+ *                 helps with portability. The cache must have been closed
+ *                 with close_cache, so that no other thread is using it.
  */
 void destroy_cache(cache_list *cache) {
+    cache_object *current, *prev;
+    unsigned int i;
+
+    printf("Deleting cache...\n");
+    cache_slab_report(stdout);
+    save_cache(cache);
 
-    printf("SIGINT caught, deleting cache...\n");
-    cache_object *current = cache->first;
-    cache_object *prev = NULL;
-
-    /* Walk through list and free objects */
-    while (current != NULL) {
-        prev = current;
-        Free(current->data);
-        Free(current->id);
-        current = current->next;    
-        Free(prev);
+    /* Walk through each shard's list, freeing the objects */
+    for (i = 0; i < cache->nshards; i++) {
+        current = cache->shards[i].first;
+        while (current != NULL) {
+            prev = current;
+            current = current->next;
+            release_object(prev);
+        }
+        Free(cache->shards[i].buckets);
+        if (cache->shards[i].heap != NULL)
+            Free(cache->shards[i].heap);
+        if (cache->shards[i].admit != NULL)
+            free_sketch(cache->shards[i].admit);
     }
+    if (cache->disk != NULL)
+        close_disk(cache->disk);
+    Free(cache->shards);
     Free(cache); /* Finally, delete the cache */
 }
 
-/* check_cache - check that there are no cycles in the cache linked
- *               list with tortoise and hare algorithm. Used for debugging.
+/* cache_slab_report - Print how well the slab classes holding cache objects
+ *                     are used. The slabs themselves are kept on exit, since
+ *                     other threads may still hold pinned objects.
  */
-void check_cache(cache_list *cache) {
-    cache_object *tortoise = cache->first; 
-    cache_object *hare = cache->first;
+void cache_slab_report(FILE *out) {
+    if (object_slabs != NULL)
+        slab_report(object_slabs, out);
+}
+
+/* check_shard - check that there are no cycles in a shard's linked
+ *               list with tortoise and hare algorithm, and that the list
+ *               and the hash table agree. Returns 0 if the shard is OK.
+ */
+static int check_shard(cache_shard *shard) {
+    cache_object *tortoise = shard->first;
+    cache_object *hare = shard->first;
+    cache_object *object;
+    unsigned int listed = 0;
     int cycle = 0;
 
     while (hare != NULL) {
@@ -232,8 +670,8 @@ void check_cache(cache_list *cache) {
         if (cycle == 0) {
             hare = hare->next;
             if (tortoise == hare) {
-                printf("Cycle detected in cache list!\n");            
-                return; 
+                printf("Cycle detected in cache list!\n");
+                return -1;
             }
             cycle = 1;
         /* Move hare 1, tortoise 1 */
@@ -241,12 +679,40 @@ void check_cache(cache_list *cache) {
             hare = hare->next;
             tortoise = tortoise->next;
             if (tortoise == hare) {
-                printf("Cycle detected in cache list!\n");            
-                return; 
+                printf("Cycle detected in cache list!\n");
+                return -1;
             }
             cycle = 0;
         }
     }
+
+    /* Every listed object must be reachable through the hash table */
+    for (object = shard->first; object != NULL; object = object->next) {
+        if (object->next != NULL && object->next->prev != object) {
+            printf("Broken back link in cache list!\n");
+            return -1;
+        }
+        if (find_object(shard, object->id, object->hash) != object) {
+            printf("Object %s missing from hash table!\n", object->id);
+            return -1;
+        }
+        listed++;
+    }
+    if (listed != shard->count) {
+        printf("Hash table holds %u objects, list holds %u!\n",
+               shard->count, listed);
+        return -1;
+    }
+    return 0;
+}
+
+/* check_cache - check every shard of the cache. Used for debugging. */
+void check_cache(cache_list *cache) {
+    unsigned int i;
+
+    for (i = 0; i < cache->nshards; i++)
+        if (check_shard(&cache->shards[i]) < 0)
+            return;
     printf("Cache list check OK\n");
     return;
 }
@@ -2,41 +2,150 @@
  * Author: Aleksander Bapst (abapst)
  */
 
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
 #include "csapp.h"
+#include "slab.h"
+#include "sketch.h"
 
-/* Recommended max cache and object sizes */
+/* Recommended max cache and object sizes, the defaults for -c and -o */
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
 
+/* Initial number of hash buckets, must be a power of two */
+#define CACHE_INIT_BUCKETS 256
+/* Upper bound on shards; each shard must still fit a largest object */
+#define MAX_CACHE_SHARDS 64
+
+/* Eviction policies, selected when the cache is created */
+#define CACHE_LRU   0 // exact LRU, hits relink the object under the writer
+#define CACHE_CLOCK 1 // CLOCK approximation, hits only set an access bit
+#define CACHE_GDSF  2 // GreedyDual-Size-Frequency, a heap keyed by priority
+#define CACHE_NPOLICIES 3
+
+/* Admission filters, selected when the cache is created */
+#define ADMIT_ALL     0 // every object that fits is cached
+#define ADMIT_TINYLFU 1 // only objects more popular than their victim
+
+/* Cost of fetching an object for GDSF, in packets, as in GD-Size(packets) */
+#define GDSF_PACKET 536
+
 typedef struct cache_object {
 
+    struct cache_object *prev; // LRU list links, least recent at the front
     struct cache_object *next;
-    char *id;
-    void *data;
-    unsigned int length;
+    struct cache_object *hnext; // next object in the same hash bucket
+    unsigned int hash; // hash of id, saved for rehashing
+    int refcnt; // one reference held by the cache plus one per reader
+    int referenced; // CLOCK access bit, set by hits without any lock
+    unsigned int freq; // GDSF hit count since the object was cached
+    unsigned int heap_index; // GDSF position in the shard's heap
+    double priority; // GDSF priority, the lowest is evicted first
+    char *id; // stored right after the struct, in the same slab chunk
+    void *data; // follows the id; immutable once the object is in the cache
+    size_t length;
+    size_t hdr_length; // offset of the blank line ending the headers,
+                       // 0 if the response must be served as is
+    time_t expires; // when the object goes stale, moved on by a 304
+    size_t identity_length; // body length before gzip if the object is
+                            // packed (see gzip.c), 0 if stored as received
 
 } cache_object;
 
-typedef struct cache_list {
+struct cache_shard;
+struct disk_tier;
+
+/*
+ * An eviction policy. Every object is on the shard's list and in its hash
+ * table whatever the policy; the policy decides where on the list a new
+ * object goes and keeps any state of its own. All hooks but hit are called
+ * with the shard's writer lock held. hit is called under a reader lock
+ * unless hit_writes is set, in which case the writer lock is taken for it.
+ * peek returns the object victim would, without changing anything, so that
+ * the admission filter can look at the victim without evicting it.
+ */
+typedef struct cache_policy {
+
+    const char *name;
+    int hit_writes; // hit changes shared state
+    void (*insert)(struct cache_shard *shard, cache_object *object);
+    void (*remove)(struct cache_shard *shard, cache_object *object,
+                   int evicted);
+    void (*hit)(struct cache_shard *shard, cache_object *object);
+    cache_object *(*victim)(struct cache_shard *shard); // shard not empty
+    cache_object *(*peek)(struct cache_shard *shard); // shard not empty
+
+} cache_policy;
+
+extern const cache_policy *cache_policies[CACHE_NPOLICIES];
+
+typedef struct cache_shard {
 
     cache_object *first;
     cache_object *last;
-    unsigned int space_left;
-    unsigned int readcnt; // number of current readers
-    sem_t r,w; // reader-writer semaphores
+    cache_object *hand; // next object the CLOCK sweep will examine
+    cache_object **heap; // GDSF min-heap of objects by priority
+    unsigned int heap_size, heap_cap;
+    double inflation; // GDSF clock, the priority of the last victim
+    sketch *admit; // TinyLFU request frequencies, NULL to admit all
+    cache_object **buckets; // hash table of objects keyed by id
+    unsigned int nbuckets;
+    unsigned int count; // number of objects in the shard
+    size_t space_left; // bytes left in this shard's budget
+    const cache_policy *policy;
+    pthread_rwlock_t lock; // shared by readers, exclusive for writers
+
+} cache_shard;
+
+typedef struct cache_list {
+
+    cache_shard *shards; // independent shards selected by hash of id
+    unsigned int nshards;
+    int policy; // CACHE_LRU, CACHE_CLOCK or CACHE_GDSF
+    int admission; // ADMIT_ALL or ADMIT_TINYLFU
+    size_t capacity; // byte budget, divided evenly between the shards
+    size_t max_object; // largest object that is cached
+    struct disk_tier *disk; // where evicted objects go, or NULL (see disk.c)
+    int compress; // store text responses gzipped (see gzip.c)
+    pthread_rwlock_t users; // held shared while a request uses the cache,
+                            // exclusively once it is closed
+    int closing; // set by close_cache, keeps new users out
+    sem_t closed; // never posted, users arriving after close wait on it
 
 } cache_list;
 
-cache_list *init_cache();
-cache_object *init_object(char *id, unsigned int length);
-void open_reader(cache_list *cache);
-void close_reader(cache_list *cache);
-cache_object *delete_object(cache_list *cache, char *query_id);
-void add_to_end(cache_list *cache, cache_object *object);
-int evict_object(cache_list *cache);
-int search_cache(cache_list *cache, char *query_id, void *cache_object,
-                 unsigned int *cache_length);
+cache_list *init_cache(unsigned int nshards, int policy, int admission,
+                       size_t capacity, size_t max_object);
+cache_object *init_object(char *id, size_t length);
+void free_object(cache_object *object);
+void pin_object(cache_object *object);
+void release_object(cache_object *object);
+unsigned int hash_id(char *id);
+cache_shard *get_shard(cache_list *cache, unsigned int hash);
+void open_reader(cache_shard *shard);
+void close_reader(cache_shard *shard);
+void open_writer(cache_shard *shard);
+void close_writer(cache_shard *shard);
+cache_object *find_object(cache_shard *shard, char *query_id,
+                          unsigned int hash);
+cache_object *delete_object(cache_shard *shard, char *query_id);
+void insert_object(cache_shard *shard, cache_object *object);
+void link_before(cache_shard *shard, cache_object *object,
+                 cache_object *before);
+void unlink_object(cache_shard *shard, cache_object *object);
+cache_object *evict_object(cache_shard *shard);
+void enter_cache(cache_list *cache);
+void leave_cache(cache_list *cache);
+int close_cache(cache_list *cache, int timeout);
+cache_object *search_cache(cache_list *cache, char *query_id);
 int add_to_cache(cache_list *cache, char *new_id, void *new_data,
-                 unsigned int length);
+                 size_t length, size_t hdr_length, time_t expires);
+int object_fresh(cache_object *object, time_t now);
+void refresh_object(cache_object *object, time_t expires);
+void save_cache(cache_list *cache);
 void destroy_cache(cache_list *cache);
+void cache_slab_report(FILE *out);
 void check_cache(cache_list *cache);
+
+#endif /* __CACHE_H__ */
@@ -0,0 +1,162 @@
+/* Upstream connection pool for Proxylab, CMU 15-213/513, Fall 2015
+ * Author: Aleksander Bapst (abapst)
+ *
+ * Keeps idle persistent connections to origin servers so that repeat
+ * requests to the same host:port skip DNS and the TCP handshake. Origins are
+ * found through a small chained hash table keyed by "host:port", and each
+ * origin keeps a stack of idle descriptors so that the warmest connection is
+ * reused first. A connection that has been idle longer than
+ * POOL_IDLE_TIMEOUT, or that the server has closed meanwhile, is dropped
+ * instead of being handed out. The pool is protected by a single semaphore;
+ * it is only held for list manipulation, never across I/O to a host.
+ */
+
+#include "connpool.h"
+
+static pool_origin *find_origin(conn_pool *pool, char *key, int create);
+static int conn_alive(int fd);
+
+/* init_pool - Create an empty pool keeping up to max_idle connections per
+ *             origin. A max_idle of 0 turns pooling off. New connections
+ *             look their host up in dns.
+ */
+conn_pool *init_pool(unsigned int max_idle, dns_cache *dns) {
+    conn_pool *pool = (conn_pool *)Calloc(1, sizeof(conn_pool));
+
+    pool->max_idle = max_idle;
+    pool->dns = dns;
+    Sem_init(&pool->mutex, 0, 1);
+    return pool;
+}
+
+/*
+ * pool_get - Return a connection to hostname:port, reusing an idle one when
+ *            possible. *reused tells the caller whether the connection came
+ *            from the pool, since a reused connection may still turn out to
+ *            be closed by the server and the request must then be retried on
+ *            a fresh one. Returns -1 if no connection can be opened.
+ */
+int pool_get(conn_pool *pool, char *hostname, char *port, int *reused) {
+    char key[MAXLINE];
+    pool_origin *origin;
+    idle_conn *conn;
+    time_t now = time(NULL);
+    int fd;
+
+    *reused = 0;
+    if (pool->max_idle > 0 && strlen(hostname) + strlen(port) + 2 < MAXLINE) {
+        sprintf(key, "%s:%s", hostname, port);
+        P(&pool->mutex);
+        origin = find_origin(pool, key, 0);
+        while (origin != NULL && (conn = origin->idle) != NULL) {
+            origin->idle = conn->next;
+            origin->nidle--;
+            V(&pool->mutex);
+
+            fd = conn->fd;
+            if (now - conn->since < POOL_IDLE_TIMEOUT && conn_alive(fd)) {
+                Free(conn);
+                *reused = 1;
+                return fd;
+            }
+            Close(fd); /* Expired or closed by the server */
+            Free(conn);
+            P(&pool->mutex);
+        }
+        V(&pool->mutex);
+    }
+    return dns_connect(pool->dns, hostname, port);
+}
+
+/*
+ * pool_put - Give a connection back to the pool once a response on it has
+ *            been read completely. If the origin already has max_idle idle
+ *            connections the descriptor is closed instead.
+ */
+void pool_put(conn_pool *pool, char *hostname, char *port, int fd) {
+    char key[MAXLINE];
+    pool_origin *origin;
+    idle_conn *conn;
+
+    if (pool->max_idle == 0 || strlen(hostname) + strlen(port) + 2 >= MAXLINE) {
+        Close(fd);
+        return;
+    }
+    sprintf(key, "%s:%s", hostname, port);
+
+    conn = (idle_conn *)Malloc(sizeof(idle_conn));
+    conn->fd = fd;
+    conn->since = time(NULL);
+
+    P(&pool->mutex);
+    origin = find_origin(pool, key, 1);
+    if (origin->nidle >= pool->max_idle) {
+        V(&pool->mutex);
+        Close(fd);
+        Free(conn);
+        return;
+    }
+    conn->next = origin->idle;
+    origin->idle = conn;
+    origin->nidle++;
+    V(&pool->mutex);
+}
+
+/* destroy_pool - Close every idle connection and free the pool. */
+void destroy_pool(conn_pool *pool) {
+    pool_origin *origin, *next_origin;
+    idle_conn *conn, *next_conn;
+    int i;
+
+    for (i = 0; i < POOL_BUCKETS; i++) {
+        for (origin = pool->buckets[i]; origin != NULL; origin = next_origin) {
+            next_origin = origin->next;
+            for (conn = origin->idle; conn != NULL; conn = next_conn) {
+                next_conn = conn->next;
+                Close(conn->fd);
+                Free(conn);
+            }
+            Free(origin->key);
+            Free(origin);
+        }
+    }
+    Free(pool);
+}
+
+/* find_origin - Look up an origin by key, creating it if asked to. Called
+ *               with the pool mutex held.
+ */
+static pool_origin *find_origin(conn_pool *pool, char *key, int create) {
+    unsigned int hash = 5381;
+    char *p;
+    pool_origin *origin;
+
+    for (p = key; *p; p++)
+        hash = hash * 33 + (unsigned char)*p;
+    hash &= POOL_BUCKETS - 1;
+
+    for (origin = pool->buckets[hash]; origin != NULL; origin = origin->next)
+        if (!strcmp(origin->key, key))
+            return origin;
+    if (!create)
+        return NULL;
+
+    origin = (pool_origin *)Calloc(1, sizeof(pool_origin));
+    origin->key = (char *)Malloc(strlen(key) + 1);
+    strcpy(origin->key, key);
+    origin->next = pool->buckets[hash];
+    pool->buckets[hash] = origin;
+    return origin;
+}
+
+/*
+ * conn_alive - Check that an idle connection hasn't been closed by the
+ *              server. An idle connection should have nothing to read, so
+ *              EOF or stray data both mean it can't be reused.
+ */
+static int conn_alive(int fd) {
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+
+    return (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
@@ -0,0 +1,45 @@
+/* Connection pool header file for connpool.c
+ * Author: Aleksander Bapst (abapst)
+ */
+
+#ifndef __CONNPOOL_H__
+#define __CONNPOOL_H__
+
+#include "csapp.h"
+#include "dnscache.h"
+
+#define POOL_BUCKETS 64       // hash buckets for origins, a power of two
+#define POOL_IDLE_TIMEOUT 30  // seconds an idle connection is kept
+
+typedef struct idle_conn {
+
+    int fd;
+    time_t since; // when the connection went idle
+    struct idle_conn *next;
+
+} idle_conn;
+
+typedef struct pool_origin {
+
+    char *key; // "host:port"
+    idle_conn *idle; // most recently used connection first
+    unsigned int nidle;
+    struct pool_origin *next; // next origin in the same hash bucket
+
+} pool_origin;
+
+typedef struct conn_pool {
+
+    pool_origin *buckets[POOL_BUCKETS];
+    unsigned int max_idle; // idle connections kept per origin, 0 disables
+    dns_cache *dns; // resolves hosts for new connections
+    sem_t mutex; // protects the whole pool
+
+} conn_pool;
+
+conn_pool *init_pool(unsigned int max_idle, dns_cache *dns);
+int pool_get(conn_pool *pool, char *hostname, char *port, int *reused);
+void pool_put(conn_pool *pool, char *hostname, char *port, int fd);
+void destroy_pool(conn_pool *pool);
+
+#endif /* __CONNPOOL_H__ */
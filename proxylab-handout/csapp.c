@@ -816,6 +816,20 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
 }
 /* $end rio_read */
 
+/*
+ * rio_fill - Refill the internal buffer if it is empty, without taking any
+ *    bytes out of it, so that callers can work on rio_bufptr in place.
+ *    Returns the number of unread bytes in the buffer, 0 on EOF.
+ */
+ssize_t rio_fill(rio_t *rp)
+{
+    char c;
+
+    if (rp->rio_cnt <= 0 && rio_read(rp, &c, 0) < 0)
+	return -1;
+    return rp->rio_cnt;
+}
+
 /*
  * rio_readinitb - Associate a descriptor with a read buffer and reset buffer
  */
@@ -887,7 +901,7 @@ ssize_t Rio_readn(int fd, void *ptr, size_t nbytes)
     ssize_t n;
   
     if ((n = rio_readn(fd, ptr, nbytes)) < 0) {
-        if (errno != ECONNRESET)
+        if (errno != ECONNRESET && errno != EAGAIN)
 	    unix_error("Rio_readn error");
     }
     return n;
@@ -897,7 +911,7 @@ ssize_t Rio_writen(int fd, void *usrbuf, size_t n)
 {
     ssize_t rn;
     if ((rn = rio_writen(fd, usrbuf, n)) != n) {
-        if (errno != EPIPE)
+        if (errno != EPIPE && errno != ECONNRESET)
 	    unix_error("Rio_writen error");
     }
     return rn; 
@@ -913,18 +927,29 @@ ssize_t Rio_readnb(rio_t *rp, void *usrbuf, size_t n)
     ssize_t rc;
 
     if ((rc = rio_readnb(rp, usrbuf, n)) < 0) {
-        if (errno != ECONNRESET)
+        if (errno != ECONNRESET && errno != EAGAIN)
 	    unix_error("Rio_readnb error");
     }
     return rc;
 }
 
+ssize_t Rio_fill(rio_t *rp)
+{
+    ssize_t rc;
+
+    if ((rc = rio_fill(rp)) < 0) {
+        if (errno != ECONNRESET && errno != EAGAIN)
+	    unix_error("Rio_fill error");
+    }
+    return rc;
+}
+
 ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
 {
     ssize_t rc;
 
     if ((rc = rio_readlineb(rp, usrbuf, maxlen)) < 0) {
-        if (errno != ECONNRESET)
+        if (errno != ECONNRESET && errno != EAGAIN)
 	    unix_error("Rio_readlineb error");
     }
     return rc;
@@ -981,6 +1006,20 @@ int open_clientfd(char *hostname, char *port) {
  */
 /* $begin open_listenfd */
 int open_listenfd(char *port) 
+{
+    return open_listenfd_reuse(port, 0);
+}
+/* $end open_listenfd */
+
+/*
+ * open_listenfd_reuse - Like open_listenfd, but if reuseport is set the
+ *     socket is opened with SO_REUSEPORT, so that several sockets can
+ *     listen on the same port and the kernel spreads new connections
+ *     across them.
+ *
+ *     On error, returns -1 and sets errno.
+ */
+int open_listenfd_reuse(char *port, int reuseport)
 {
     struct addrinfo hints, *listp, *p;
     int listenfd, optval=1;
@@ -1001,6 +1040,9 @@ int open_listenfd(char *port)
         /* Eliminates "Address already in use" error from bind */
         Setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,    //line:netp:csapp:setsockopt
                    (const void *)&optval , sizeof(int));
+        if (reuseport)
+            Setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                       (const void *)&optval , sizeof(int));
 
         /* Bind the descriptor to the address */
         if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
@@ -1020,7 +1062,6 @@ int open_listenfd(char *port)
     }
     return listenfd;
 }
-/* $end open_listenfd */
 
 /****************************************************
  * Wrappers for reentrant protocol-independent helpers
@@ -1042,6 +1083,15 @@ int Open_listenfd(char *port)
     return rc;
 }
 
+int Open_listenfd_reuse(char *port, int reuseport)
+{
+    int rc;
+
+    if ((rc = open_listenfd_reuse(port, reuseport)) < 0)
+	unix_error("Open_listenfd_reuse error");
+    return rc;
+}
+
 /* $end csapp.c */
 
 
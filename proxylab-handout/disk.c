@@ -0,0 +1,429 @@
+/* Disk cache tier for Proxylab, CMU 15-213/513, Fall 2015
+ * Author: Aleksander Bapst (abapst)
+ *
+ * A second, larger cache level behind the in-memory cache. Objects evicted
+ * from memory are demoted here, and a memory miss that finds its object on
+ * disk promotes it back, which is much cheaper than another trip to the
+ * origin server. The store lives in one file that is mapped into memory, so
+ * reads and writes are plain memcpys and the kernel decides what stays in
+ * RAM. Because the file survives the process, a restarted proxy comes back
+ * with a warm cache.
+ *
+ * The file is a header page followed by a circular log. Every object is
+ * appended as a record holding its id, its data and a checksum. When the
+ * log runs out of room at the end of the file it wraps to the start and
+ * overwrites the oldest records, so the disk tier is FIFO: an object lives
+ * until the log has gone once around the file. A record that replaces or
+ * drops an id (a tombstone) just supersedes the older records for the id.
+ *
+ * Only an index from id to record offset is kept in memory. It is rebuilt
+ * at startup by scanning the log from the oldest record to the newest and
+ * stops at the first record with a bad magic number or checksum, so a
+ * record torn by a crash costs only itself and what came after it.
+ *
+ *     0            tail               head                      end  size
+ *     | header |...| oldest ... newest |     free              |     |
+ *
+ * Once wrapped, head is at or below tail and the live records are
+ * [tail, end) followed by [DISK_DATA_START, head).
+ *
+ * A single semaphore protects the index, the log and the header. Lookups
+ * copy the record into a new cache object while holding it, since the
+ * record may be overwritten as soon as it is released.
+ */
+
+#include "disk.h"
+
+#define DISK_ALIGN 8
+
+static disk_entry **find_entry(disk_tier *disk, char *id);
+static void unlink_entry(disk_tier *disk, disk_entry **link);
+static void index_record(disk_tier *disk, uint64_t offset);
+static void drop_record(disk_tier *disk, uint64_t offset);
+static void write_record(disk_tier *disk, char *id, cache_object *object);
+static int valid_record(disk_tier *disk, uint64_t offset, uint64_t limit);
+static void load_log(disk_tier *disk);
+static void reset_log(disk_tier *disk, uint64_t size);
+static uint32_t checksum(char *id, size_t id_length, void *data,
+                         size_t length);
+static uint64_t record_size(size_t id_length, size_t length);
+
+/* open_disk - Map the store at path and rebuild the index from the records
+ *             already in it. Only a new, empty file is sized to size bytes.
+ *             An existing store keeps its own size, and one of another
+ *             version, or whose header doesn't match the file, is started
+ *             over. A file that isn't a store at all is left alone, in case
+ *             it was named by mistake. Returns NULL if the file is refused
+ *             or can't be opened or mapped.
+ */
+disk_tier *open_disk(char *path, size_t size) {
+    disk_header header;
+    disk_tier *disk;
+    struct stat st;
+    int fd, fresh;
+    char *map;
+
+    size &= ~(size_t)(DISK_ALIGN - 1);
+    if (size < 2 * DISK_DATA_START)
+        return NULL;
+    if ((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        Close(fd);
+        return NULL;
+    }
+
+    /* Check the header before anything is written to the file */
+    fresh = (st.st_size == 0);
+    if (!fresh) {
+        if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+            header.magic != DISK_MAGIC) {
+            fprintf(stderr, "%s is not a disk cache, not overwriting it\n",
+                    path);
+            Close(fd);
+            return NULL;
+        }
+        if (header.version == DISK_VERSION &&
+            header.size == (uint64_t)st.st_size) {
+            if (header.size != size)
+                fprintf(stderr, "Disk cache %s keeps its size of %llu "
+                        "bytes\n", path, (unsigned long long)header.size);
+            size = header.size;
+        } else {
+            fprintf(stderr, "Disk cache %s is of another version or "
+                    "damaged, starting it over\n", path);
+            fresh = 1;
+        }
+    }
+    if (fresh && ftruncate(fd, size) < 0) {
+        Close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        Close(fd);
+        return NULL;
+    }
+
+    disk = (disk_tier *)Calloc(1, sizeof(disk_tier));
+    disk->fd = fd;
+    disk->map = map;
+    disk->header = (disk_header *)map;
+    Sem_init(&disk->mutex, 0, 1);
+
+    if (fresh)
+        reset_log(disk, size);
+    else
+        load_log(disk);
+    return disk;
+}
+
+/* disk_put - Append an object to the log unless the store already has it.
+ *            Returns 0 if the object is on disk afterwards, or -1 if it can
+ *            never fit.
+ */
+int disk_put(disk_tier *disk, cache_object *object) {
+    uint64_t rsize = record_size(strlen(object->id), object->length);
+
+    if (rsize > disk->header->size - DISK_DATA_START)
+        return -1;
+
+    P(&disk->mutex);
+    /* Objects are immutable, so a record for the id is still good. Only
+     * its expiry may be out of date, which at worst costs a revalidation.
+     */
+    if (*find_entry(disk, object->id) == NULL)
+        write_record(disk, object->id, object);
+    V(&disk->mutex);
+    return 0;
+}
+
+/* disk_get - Look up an object on disk and return a copy of it as a new
+ *            cache object that the caller owns, or NULL on a miss.
+ */
+cache_object *disk_get(disk_tier *disk, char *id) {
+    disk_entry *entry;
+    disk_record *record;
+    cache_object *object = NULL;
+
+    P(&disk->mutex);
+    if ((entry = *find_entry(disk, id)) != NULL) {
+        record = (disk_record *)(disk->map + entry->offset);
+        object = init_object(id, record->length);
+        memcpy(object->data, (char *)(record + 1) + record->id_length + 1,
+               record->length);
+        object->hdr_length = record->hdr_length;
+        object->expires = record->expires;
+        object->identity_length = record->identity_length;
+    }
+    V(&disk->mutex);
+    return object;
+}
+
+/* disk_remove - Drop an id from the store, e.g. when a newer version of the
+ *               object is cached. A tombstone record keeps it dropped across
+ *               a restart.
+ */
+void disk_remove(disk_tier *disk, char *id) {
+    disk_entry **link;
+
+    P(&disk->mutex);
+    if (*(link = find_entry(disk, id)) != NULL) {
+        unlink_entry(disk, link);
+        write_record(disk, id, NULL);
+    }
+    V(&disk->mutex);
+}
+
+/* disk_sync - Flush the store to the file. */
+void disk_sync(disk_tier *disk) {
+    P(&disk->mutex);
+    msync(disk->map, disk->header->size, MS_SYNC);
+    V(&disk->mutex);
+}
+
+/* close_disk - Flush the store to the file, unmap it and free it. No other
+ *              thread may use the store any more.
+ */
+void close_disk(disk_tier *disk) {
+    disk_entry *entry, *next;
+    unsigned int i;
+
+    P(&disk->mutex);
+    msync(disk->map, disk->header->size, MS_SYNC);
+    munmap(disk->map, disk->header->size);
+    Close(disk->fd);
+    V(&disk->mutex);
+    sem_destroy(&disk->mutex);
+    for (i = 0; i < DISK_BUCKETS; i++) {
+        for (entry = disk->buckets[i]; entry != NULL; entry = next) {
+            next = entry->next;
+            Free(entry->id);
+            Free(entry);
+        }
+    }
+    Free(disk);
+}
+
+/* find_entry - Return the link that points at the index entry for id, which
+ *              is NULL if the id is not on disk. The caller must hold the
+ *              mutex.
+ */
+static disk_entry **find_entry(disk_tier *disk, char *id) {
+    disk_entry **link = &disk->buckets[hash_id(id) & (DISK_BUCKETS - 1)];
+
+    while (*link != NULL && strcmp((*link)->id, id))
+        link = &(*link)->next;
+    return link;
+}
+
+/* unlink_entry - Remove the index entry that link points at. */
+static void unlink_entry(disk_tier *disk, disk_entry **link) {
+    disk_entry *entry = *link;
+
+    *link = entry->next;
+    Free(entry->id);
+    Free(entry);
+    disk->count--;
+}
+
+/* index_record - Point the index at the record at offset, which is newer
+ *                than any record already indexed for its id. A tombstone
+ *                removes the id instead.
+ */
+static void index_record(disk_tier *disk, uint64_t offset) {
+    disk_record *record = (disk_record *)(disk->map + offset);
+    char *id = (char *)(record + 1);
+    disk_entry **link = find_entry(disk, id);
+    disk_entry *entry = *link;
+
+    if (record->flags & DISK_TOMBSTONE) {
+        if (entry != NULL)
+            unlink_entry(disk, link);
+        return;
+    }
+    if (entry == NULL) {
+        entry = (disk_entry *)Malloc(sizeof(disk_entry));
+        entry->id = strdup(id);
+        entry->next = disk->buckets[hash_id(id) & (DISK_BUCKETS - 1)];
+        disk->buckets[hash_id(id) & (DISK_BUCKETS - 1)] = entry;
+        disk->count++;
+    }
+    entry->offset = offset;
+}
+
+/* drop_record - Forget the record at offset before it is overwritten. The
+ *               index entry for its id is removed only if it still points
+ *               at this record and not at a newer one.
+ */
+static void drop_record(disk_tier *disk, uint64_t offset) {
+    disk_record *record = (disk_record *)(disk->map + offset);
+    disk_entry **link = find_entry(disk, (char *)(record + 1));
+    disk_entry *entry = *link;
+
+    if (entry != NULL && entry->offset == offset)
+        unlink_entry(disk, link);
+}
+
+/* write_record - Append a record for object, or a tombstone for id if object
+ *                is NULL, at the head of the log, wrapping to the start of
+ *                the file and dropping the oldest records as needed. The
+ *                caller must hold the mutex and have checked that the record
+ *                fits in the file.
+ */
+static void write_record(disk_tier *disk, char *id, cache_object *object) {
+    disk_header *header = disk->header;
+    size_t id_length = strlen(id);
+    size_t length = (object != NULL) ? object->length : 0;
+    void *data = (object != NULL) ? object->data : NULL;
+    uint64_t rsize = record_size(id_length, length);
+    disk_record *record;
+
+    while (1) {
+        if (!header->wrapped) {
+            if (header->head + rsize <= header->size)
+                break;
+            if (header->tail == header->head) {
+                /* Empty log, start over at the front */
+                header->head = header->tail = DISK_DATA_START;
+                continue;
+            }
+            /* No room before the end of the file, start the next lap */
+            header->end = header->head;
+            header->head = DISK_DATA_START;
+            header->wrapped = 1;
+        } else {
+            if (header->head + rsize <= header->tail)
+                break;
+            /* Make room by dropping the oldest record of the older lap */
+            record = (disk_record *)(disk->map + header->tail);
+            drop_record(disk, header->tail);
+            header->tail += record_size(record->id_length, record->length);
+            if (header->tail >= header->end) {
+                header->tail = DISK_DATA_START;
+                header->wrapped = 0;
+            }
+        }
+    }
+
+    record = (disk_record *)(disk->map + header->head);
+    record->magic = DISK_MAGIC;
+    record->seq = ++header->seq;
+    record->length = length;
+    record->hdr_length = (object != NULL) ? object->hdr_length : 0;
+    record->expires = (object != NULL) ? object->expires : 0;
+    record->identity_length = (object != NULL) ? object->identity_length : 0;
+    record->id_length = id_length;
+    record->flags = (object != NULL) ? 0 : DISK_TOMBSTONE;
+    memcpy(record + 1, id, id_length + 1);
+    if (length > 0)
+        memcpy((char *)(record + 1) + id_length + 1, data, length);
+    record->checksum = checksum(id, id_length, data, length);
+
+    /* Publish the record only once it is complete */
+    index_record(disk, header->head);
+    header->head += rsize;
+}
+
+/* valid_record - Check that a whole record lies in [offset, limit) and that
+ *                it is intact. Returns 1 if it is.
+ */
+static int valid_record(disk_tier *disk, uint64_t offset, uint64_t limit) {
+    disk_record *record = (disk_record *)(disk->map + offset);
+    char *id = (char *)(record + 1);
+
+    if (offset + sizeof(disk_record) > limit || record->magic != DISK_MAGIC)
+        return 0;
+    if (record->length > limit || record->id_length > limit ||
+        offset + record_size(record->id_length, record->length) > limit)
+        return 0;
+    if (id[record->id_length] != '\0' || strlen(id) != record->id_length)
+        return 0;
+    return record->checksum ==
+        checksum(id, record->id_length, id + record->id_length + 1,
+                 record->length);
+}
+
+/* load_log - Rebuild the index by replaying the log from the oldest record
+ *            to the newest. The log is cut at the first bad record, which
+ *            can only be one that was being written when the proxy died.
+ */
+static void load_log(disk_tier *disk) {
+    disk_header *header = disk->header;
+    disk_record *record;
+    uint64_t offset = header->tail;
+    uint64_t limit = header->wrapped ? header->end : header->head;
+
+    if (header->tail < DISK_DATA_START || header->head < DISK_DATA_START ||
+        header->tail > header->size || header->head > header->size ||
+        header->end > header->size ||
+        (header->wrapped && header->head > header->tail) ||
+        (!header->wrapped && header->tail > header->head)) {
+        reset_log(disk, header->size);
+        return;
+    }
+
+    while (1) {
+        if (offset == limit) {
+            /* Older lap done, continue with the newer one */
+            if (header->wrapped && limit == header->end &&
+                offset != header->head) {
+                offset = DISK_DATA_START;
+                limit = header->head;
+                continue;
+            }
+            break;
+        }
+        if (!valid_record(disk, offset, limit)) {
+            fprintf(stderr, "Disk cache: log cut at offset %lu\n",
+                    (unsigned long)offset);
+            /* A broken older lap also drops the whole newer one */
+            if (header->wrapped && limit == header->end)
+                header->wrapped = 0;
+            header->head = offset;
+            break;
+        }
+        record = (disk_record *)(disk->map + offset);
+        index_record(disk, offset);
+        offset += record_size(record->id_length, record->length);
+    }
+}
+
+/* reset_log - Start an empty store in a file of the given size. */
+static void reset_log(disk_tier *disk, uint64_t size) {
+    disk_header *header = disk->header;
+
+    header->magic = DISK_MAGIC;
+    header->version = DISK_VERSION;
+    header->wrapped = 0;
+    header->size = size;
+    header->head = header->tail = header->end = DISK_DATA_START;
+    header->seq = 0;
+}
+
+/* checksum - FNV-1a hash of a record's id and data. */
+static uint32_t checksum(char *id, size_t id_length, void *data,
+                         size_t length) {
+    uint32_t hash = 2166136261u;
+    unsigned char *p;
+    size_t i;
+
+    for (p = (unsigned char *)id, i = 0; i < id_length; i++) {
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
+    for (p = (unsigned char *)data, i = 0; i < length; i++) {
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* record_size - Bytes of log used by a record, rounded up so the next
+ *               record header is aligned.
+ */
+static uint64_t record_size(size_t id_length, size_t length) {
+    uint64_t size = sizeof(disk_record) + id_length + 1 + length;
+
+    return (size + DISK_ALIGN - 1) & ~(uint64_t)(DISK_ALIGN - 1);
+}
@@ -0,0 +1,78 @@
+/* Disk cache tier header file for disk.c
+ * Author: Aleksander Bapst (abapst)
+ */
+
+#ifndef __DISK_H__
+#define __DISK_H__
+
+#include <stdint.h>
+#include "csapp.h"
+#include "cache.h"
+
+#define DISK_MAGIC 0x50585944u  // "PXYD", marks the file and every record
+#define DISK_VERSION 3
+#define DISK_DATA_START 4096    // log starts after the file header
+#define DISK_BUCKETS 4096       // index hash buckets, a power of two
+#define DISK_DEF_SIZE (64 << 20) // default size of the store, see -D
+
+/* Record flags */
+#define DISK_TOMBSTONE 1 // the id was dropped, older records are stale
+
+/* File header, at offset 0 of the mapping */
+typedef struct disk_header {
+
+    uint32_t magic;
+    uint32_t version;
+    uint32_t wrapped; // head has gone back to the start of the log
+    uint32_t pad;
+    uint64_t size; // size of the whole file
+    uint64_t head; // where the next record is written
+    uint64_t tail; // oldest live record
+    uint64_t end; // end of the older lap while the log is wrapped
+    uint64_t seq; // sequence number of the last record written
+
+} disk_header;
+
+/* Record header, followed by the id, its NUL and the data */
+typedef struct disk_record {
+
+    uint32_t magic;
+    uint32_t checksum; // FNV-1a of the id and data
+    uint64_t seq;
+    uint64_t length; // bytes of data
+    uint64_t hdr_length; // as in cache_object
+    int64_t expires; // as in cache_object
+    uint64_t identity_length; // as in cache_object
+    uint32_t id_length; // without the NUL
+    uint32_t flags;
+
+} disk_record;
+
+/* Index entry, where the newest record for an id is */
+typedef struct disk_entry {
+
+    char *id;
+    uint64_t offset;
+    struct disk_entry *next; // next entry in the same hash bucket
+
+} disk_entry;
+
+typedef struct disk_tier {
+
+    int fd;
+    char *map; // the whole file, shared with the kernel's page cache
+    disk_header *header;
+    disk_entry *buckets[DISK_BUCKETS];
+    unsigned int count; // ids in the index
+    sem_t mutex; // protects the index, the log and the header
+
+} disk_tier;
+
+disk_tier *open_disk(char *path, size_t size);
+int disk_put(disk_tier *disk, cache_object *object);
+cache_object *disk_get(disk_tier *disk, char *id);
+void disk_remove(disk_tier *disk, char *id);
+void disk_sync(disk_tier *disk);
+void close_disk(disk_tier *disk);
+
+#endif /* __DISK_H__ */
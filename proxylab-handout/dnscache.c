@@ -0,0 +1,479 @@
+/* DNS resolver cache for Proxylab, CMU 15-213/513, Fall 2015
+ * Author: Aleksander Bapst (abapst)
+ *
+ * Caches host name lookups so that a miss in the object cache does not pay
+ * for a getaddrinfo call every time. Successful lookups are kept for
+ * DNS_TTL seconds and failed ones for DNS_NEG_TTL seconds, so a bad host
+ * name can't make every request wait on the resolver again.
+ *
+ * Lookups are done by DNS_RESOLVERS background threads that take host names
+ * from a queue. A caller that finds no usable entry queues one and waits at
+ * most DNS_WAIT_TIMEOUT seconds for the answer. A caller that finds an
+ * expired address is given the stale address right away while the entry is
+ * refreshed in the background, so only the very first request for a host
+ * ever waits. Numeric addresses are converted in place without a lookup.
+ *
+ * Callers that must not block, such as the event loops, use
+ * dns_lookup_nowait instead. It returns at once while the lookup is pending,
+ * and the resolver writes to every eventfd registered with dns_watch when a
+ * lookup such a caller asked for completes, so the caller knows to try again.
+ *
+ * A hosts file in /etc/hosts format (-H) can be loaded at startup. Its
+ * entries never expire and are answered before DNS is consulted, which
+ * makes it possible to point the proxy at local test servers by name.
+ *
+ * A single semaphore protects the table, the resolver queue and the entries.
+ * It is never held across getaddrinfo. Each entry has its own semaphore on
+ * which callers wait for a pending lookup, posted once per waiter.
+ */
+
+#include <stdint.h>
+#include "dnscache.h"
+
+static void *resolver_thread(void *vargp);
+static dns_entry *find_entry(dns_cache *dns, char *host);
+static dns_entry *new_entry(dns_cache *dns, char *host);
+static unsigned int host_hash(char *host);
+static void sweep_entries(dns_cache *dns, time_t now, int all);
+static void queue_entry(dns_cache *dns, dns_entry *entry);
+static int lookup(dns_cache *dns, char *host, char *port, dns_addrs *out,
+                  int wait);
+static int wait_entry(dns_cache *dns, dns_entry *entry);
+static void notify_watchers(dns_cache *dns);
+static int numeric_host(char *host, dns_addrs *out);
+static int service_port(char *port, unsigned short *nport);
+static void copy_addrs(dns_addrs *out, dns_addrs *in, unsigned short nport);
+static int load_hosts(dns_cache *dns, char *hosts_file);
+
+/* init_dns - Create an empty DNS cache, load the hosts file if one is given
+ *            and start the resolver threads.
+ */
+dns_cache *init_dns(char *hosts_file) {
+    dns_cache *dns = (dns_cache *)Calloc(1, sizeof(dns_cache));
+    pthread_t tid;
+    int i;
+
+    Sem_init(&dns->mutex, 0, 1);
+    Sem_init(&dns->items, 0, 0);
+    if (hosts_file != NULL && load_hosts(dns, hosts_file) < 0)
+        fprintf(stderr, "Could not read hosts file %s\n", hosts_file);
+
+    for (i = 0; i < DNS_RESOLVERS; i++)
+        Pthread_create(&tid, NULL, resolver_thread, dns);
+    return dns;
+}
+
+/*
+ * dns_lookup - Find the addresses of host, with port filled in. A fresh or
+ *              stale cached answer is returned without waiting; otherwise
+ *              the lookup is queued for a resolver thread and the caller
+ *              waits for it. Returns 0 with at least one address in out, or
+ *              -1 if the port or host is unknown or the resolver took too
+ *              long. The port may be a number or a service name.
+ */
+int dns_lookup(dns_cache *dns, char *host, char *port, dns_addrs *out) {
+    return lookup(dns, host, port, out, 1);
+}
+
+/*
+ * dns_lookup_nowait - Like dns_lookup, but never wait for the resolver.
+ *                     Returns 1 if the lookup is still pending; the
+ *                     watchers' eventfds are written once it completes.
+ */
+int dns_lookup_nowait(dns_cache *dns, char *host, char *port,
+                      dns_addrs *out) {
+    return lookup(dns, host, port, out, 0);
+}
+
+/* dns_watch - Register an eventfd to be written whenever a lookup asked for
+ *             by dns_lookup_nowait completes.
+ */
+void dns_watch(dns_cache *dns, int fd) {
+    P(&dns->mutex);
+    if (dns->nwatchers == DNS_MAX_WATCHERS)
+        app_error("Too many DNS watchers");
+    dns->watchers[dns->nwatchers++] = fd;
+    V(&dns->mutex);
+}
+
+/*
+ * lookup - Look host up for dns_lookup and dns_lookup_nowait. A lookup that
+ *          is pending is waited for if wait is set, and otherwise marked as
+ *          watched and 1 returned.
+ */
+static int lookup(dns_cache *dns, char *host, char *port, dns_addrs *out,
+                  int wait) {
+    dns_entry *entry;
+    time_t now = time(NULL);
+    unsigned short nport;
+    int rc;
+
+    if (service_port(port, &nport) < 0)
+        return -1;
+
+    /* Numeric addresses don't need the resolver */
+    if (numeric_host(host, out)) {
+        copy_addrs(out, out, nport);
+        return 0;
+    }
+
+    P(&dns->mutex);
+    if (dns->count >= DNS_MAX_ENTRIES)
+        sweep_entries(dns, now, 0);
+    if (dns->count >= DNS_MAX_ENTRIES)
+        sweep_entries(dns, now, 1);
+    if ((entry = find_entry(dns, host)) == NULL) {
+        entry = new_entry(dns, host);
+        queue_entry(dns, entry);
+    }
+
+    if (entry->state == DNS_OK &&
+        (entry->expires == 0 || now < entry->expires)) {
+        /* Fresh answer */
+    } else if (entry->state == DNS_OK) {
+        /* Stale answer, use it while it is looked up again */
+        if (!entry->refreshing) {
+            entry->refreshing = 1;
+            queue_entry(dns, entry);
+        }
+    } else if (entry->state == DNS_FAILED && now < entry->expires) {
+        /* Recently failed, don't ask again yet */
+        V(&dns->mutex);
+        return -1;
+    } else {
+        /* Not resolved yet, or a failure that has expired */
+        if (entry->state == DNS_FAILED) {
+            entry->state = DNS_PENDING;
+            queue_entry(dns, entry);
+        }
+        if (!wait) {
+            entry->watched = 1;
+            V(&dns->mutex);
+            return 1;
+        }
+        if (wait_entry(dns, entry) < 0) {
+            V(&dns->mutex);
+            return -1;
+        }
+    }
+
+    rc = (entry->state == DNS_OK) ? 0 : -1;
+    if (rc == 0)
+        copy_addrs(out, &entry->addrs, nport);
+    V(&dns->mutex);
+    return rc;
+}
+
+/*
+ * dns_connect - Open a connection to host:port, trying each address of the
+ *               host in turn. Returns a connected descriptor, or -1 if the
+ *               host can't be resolved or none of its addresses accept.
+ */
+int dns_connect(dns_cache *dns, char *host, char *port) {
+    dns_addrs addrs;
+    int i, fd;
+
+    if (dns_lookup(dns, host, port, &addrs) < 0)
+        return -1;
+
+    for (i = 0; i < addrs.naddrs; i++) {
+        if ((fd = socket(addrs.addr[i].ss_family,
+                         SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+            continue;
+        if (connect(fd, (SA *)&addrs.addr[i], addrs.addrlen[i]) == 0)
+            return fd;
+        Close(fd);
+    }
+    return -1;
+}
+
+/*
+ * resolver_thread - Take queued entries one at a time and resolve them with
+ *                   getaddrinfo, outside the cache mutex. Waiters are woken
+ *                   once the answer has been stored, and the watchers are
+ *                   told if a caller that doesn't wait asked for it.
+ */
+static void *resolver_thread(void *vargp) {
+    dns_cache *dns = (dns_cache *)vargp;
+    dns_entry *entry;
+    struct addrinfo hints, *list, *p;
+    dns_addrs addrs;
+    char host[MAXLINE];
+    unsigned int i;
+    int rc;
+
+    Pthread_detach(pthread_self());
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+
+    while (1) {
+        P(&dns->items);
+        P(&dns->mutex);
+        entry = dns->qhead;
+        dns->qhead = entry->qnext;
+        if (dns->qhead == NULL)
+            dns->qtail = NULL;
+        entry->qnext = NULL;
+        strncpy(host, entry->host, MAXLINE - 1);
+        host[MAXLINE - 1] = '\0';
+        V(&dns->mutex);
+
+        addrs.naddrs = 0;
+        if ((rc = getaddrinfo(host, NULL, &hints, &list)) == 0) {
+            for (p = list; p != NULL && addrs.naddrs < DNS_MAX_ADDRS;
+                 p = p->ai_next) {
+                memcpy(&addrs.addr[addrs.naddrs], p->ai_addr, p->ai_addrlen);
+                addrs.addrlen[addrs.naddrs++] = p->ai_addrlen;
+            }
+            freeaddrinfo(list);
+        }
+
+        P(&dns->mutex);
+        if (addrs.naddrs > 0) {
+            entry->addrs = addrs;
+            entry->state = DNS_OK;
+            entry->expires = time(NULL) + DNS_TTL;
+        } else if (entry->refreshing) {
+            /* Keep serving the old addresses, but try again later */
+            entry->expires = time(NULL) + DNS_NEG_TTL;
+        } else {
+            entry->state = DNS_FAILED;
+            entry->expires = time(NULL) + DNS_NEG_TTL;
+        }
+        entry->refreshing = 0;
+        for (i = 0; i < entry->nwaiters; i++)
+            V(&entry->ready);
+        entry->nwaiters = 0;
+        if (entry->watched) {
+            entry->watched = 0;
+            notify_watchers(dns);
+        }
+        entry->refs--; // the queue's reference
+        V(&dns->mutex);
+    }
+    return NULL;
+}
+
+/*
+ * wait_entry - Wait for a pending lookup of entry to complete. Called and
+ *              returns with the mutex held. Returns -1 if the lookup did not
+ *              complete within DNS_WAIT_TIMEOUT seconds.
+ */
+static int wait_entry(dns_cache *dns, dns_entry *entry) {
+    struct timespec deadline;
+    int rc;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += DNS_WAIT_TIMEOUT;
+
+    entry->refs++;
+    entry->nwaiters++;
+    V(&dns->mutex);
+    while ((rc = sem_timedwait(&entry->ready, &deadline)) < 0 &&
+           errno == EINTR)
+        ;
+    P(&dns->mutex);
+    entry->refs--;
+
+    if (rc < 0) {
+        if (entry->state == DNS_PENDING) {
+            entry->nwaiters--; // no longer waiting, nothing will be posted
+            return -1;
+        }
+        /* Completed just as we timed out, our post is there to take */
+        P(&entry->ready);
+    }
+    return 0;
+}
+
+/* notify_watchers - Write to every registered eventfd, waking the callers
+ *                   whose lookups may have completed. Called with the mutex
+ *                   held.
+ */
+static void notify_watchers(dns_cache *dns) {
+    uint64_t one = 1;
+    int i;
+
+    for (i = 0; i < dns->nwatchers; i++)
+        if (write(dns->watchers[i], &one, sizeof(one)) < 0 &&
+            errno != EAGAIN)
+            fprintf(stderr, "eventfd write error: %s\n", strerror(errno));
+}
+
+/* queue_entry - Append an entry to the resolver queue. Called with the mutex
+ *               held.
+ */
+static void queue_entry(dns_cache *dns, dns_entry *entry) {
+    entry->refs++;
+    entry->qnext = NULL;
+    if (dns->qtail != NULL)
+        dns->qtail->qnext = entry;
+    else
+        dns->qhead = entry;
+    dns->qtail = entry;
+    V(&dns->items);
+}
+
+/* host_hash - djb2 hash of a host name, ignoring case. */
+static unsigned int host_hash(char *host) {
+    unsigned int hash = 5381;
+    char *p;
+
+    for (p = host; *p; p++)
+        hash = hash * 33 + (unsigned char)tolower(*p);
+    return hash & (DNS_BUCKETS - 1);
+}
+
+/* find_entry - Look up the entry for host. Called with the mutex held. */
+static dns_entry *find_entry(dns_cache *dns, char *host) {
+    dns_entry *entry;
+
+    for (entry = dns->buckets[host_hash(host)]; entry != NULL;
+         entry = entry->next)
+        if (!strcasecmp(entry->host, host))
+            return entry;
+    return NULL;
+}
+
+/* new_entry - Enter a pending entry for host. Called with the mutex held. */
+static dns_entry *new_entry(dns_cache *dns, char *host) {
+    unsigned int hash = host_hash(host);
+    dns_entry *entry = (dns_entry *)Calloc(1, sizeof(dns_entry));
+
+    entry->host = (char *)Malloc(strlen(host) + 1);
+    strcpy(entry->host, host);
+    entry->state = DNS_PENDING;
+    Sem_init(&entry->ready, 0, 0);
+    entry->next = dns->buckets[hash];
+    dns->buckets[hash] = entry;
+    dns->count++;
+    return entry;
+}
+
+/*
+ * sweep_entries - Free entries that nobody is using, to keep the table from
+ *                 growing without bound. Only expired entries are freed
+ *                 unless all is set. Hosts file entries are always kept.
+ *                 Called with the mutex held.
+ */
+static void sweep_entries(dns_cache *dns, time_t now, int all) {
+    dns_entry **link, *entry;
+    int i;
+
+    for (i = 0; i < DNS_BUCKETS; i++) {
+        link = &dns->buckets[i];
+        while ((entry = *link) != NULL) {
+            if (entry->refs == 0 && entry->state != DNS_PENDING &&
+                entry->expires != 0 && (all || entry->expires <= now)) {
+                *link = entry->next;
+                dns->count--;
+                sem_destroy(&entry->ready);
+                Free(entry->host);
+                Free(entry);
+            } else {
+                link = &entry->next;
+            }
+        }
+    }
+}
+
+/* numeric_host - Convert a numeric IPv4 or IPv6 host into an address.
+ *                Returns 1 if host was numeric, 0 otherwise.
+ */
+static int numeric_host(char *host, dns_addrs *out) {
+    struct sockaddr_in *sin = (struct sockaddr_in *)&out->addr[0];
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&out->addr[0];
+
+    memset(&out->addr[0], 0, sizeof(struct sockaddr_storage));
+    if (inet_pton(AF_INET, host, &sin->sin_addr) == 1) {
+        sin->sin_family = AF_INET;
+        out->addrlen[0] = sizeof(struct sockaddr_in);
+    } else if (inet_pton(AF_INET6, host, &sin6->sin6_addr) == 1) {
+        sin6->sin6_family = AF_INET6;
+        out->addrlen[0] = sizeof(struct sockaddr_in6);
+    } else {
+        return 0;
+    }
+    out->naddrs = 1;
+    return 1;
+}
+
+/*
+ * service_port - Convert a port, a number from 1 to 65535 or a TCP service
+ *                name such as "http", to network byte order. Returns 0, or
+ *                -1 if it is neither.
+ */
+static int service_port(char *port, unsigned short *nport) {
+    struct servent serv, *result = NULL;
+    char buf[MAXLINE], *end;
+    long n;
+
+    if (isdigit((unsigned char)port[0])) {
+        errno = 0;
+        n = strtol(port, &end, 10);
+        if (errno != 0 || *end != '\0' || n < 1 || n > 65535)
+            return -1;
+        *nport = htons((unsigned short)n);
+        return 0;
+    }
+    if (getservbyname_r(port, "tcp", &serv, buf, sizeof(buf), &result) != 0 ||
+        result == NULL)
+        return -1;
+    *nport = (unsigned short)result->s_port;
+    return 0;
+}
+
+/* copy_addrs - Copy a set of addresses, setting their port. */
+static void copy_addrs(dns_addrs *out, dns_addrs *in, unsigned short nport) {
+    int i;
+
+    if (out != in)
+        *out = *in;
+    for (i = 0; i < out->naddrs; i++) {
+        if (out->addr[i].ss_family == AF_INET)
+            ((struct sockaddr_in *)&out->addr[i])->sin_port = nport;
+        else if (out->addr[i].ss_family == AF_INET6)
+            ((struct sockaddr_in6 *)&out->addr[i])->sin6_port = nport;
+    }
+}
+
+/*
+ * load_hosts - Enter the names in a hosts file as permanent entries. Each
+ *              line holds a numeric address followed by one or more names;
+ *              anything after a '#' is a comment.
+ */
+static int load_hosts(dns_cache *dns, char *hosts_file) {
+    FILE *fp;
+    char line[MAXLINE], *addr, *name, *save;
+    dns_addrs addrs;
+    dns_entry *entry;
+
+    if ((fp = fopen(hosts_file, "r")) == NULL)
+        return -1;
+
+    while (fgets(line, MAXLINE, fp) != NULL) {
+        if ((name = strchr(line, '#')) != NULL)
+            *name = '\0';
+        if ((addr = strtok_r(line, " \t\r\n", &save)) == NULL)
+            continue;
+        if (!numeric_host(addr, &addrs))
+            continue;
+
+        while ((name = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+            if ((entry = find_entry(dns, name)) == NULL)
+                entry = new_entry(dns, name);
+            /* Like /etc/hosts, several lines may list the same name */
+            if (entry->state == DNS_OK && entry->addrs.naddrs < DNS_MAX_ADDRS) {
+                entry->addrs.addr[entry->addrs.naddrs] = addrs.addr[0];
+                entry->addrs.addrlen[entry->addrs.naddrs++] = addrs.addrlen[0];
+            } else {
+                entry->addrs = addrs;
+            }
+            entry->state = DNS_OK;
+            entry->expires = 0;
+        }
+    }
+    fclose(fp);
+    return 0;
+}
@@ -0,0 +1,68 @@
+/* DNS cache header file for dnscache.c
+ * Author: Aleksander Bapst (abapst)
+ */
+
+#ifndef __DNSCACHE_H__
+#define __DNSCACHE_H__
+
+#include "csapp.h"
+
+#define DNS_BUCKETS 256       // hash buckets for host names, a power of two
+#define DNS_MAX_ENTRIES 1024  // cached host names before idle ones are swept
+#define DNS_MAX_ADDRS 4       // addresses kept per host name
+#define DNS_TTL 300           // seconds a successful lookup is trusted
+#define DNS_NEG_TTL 30        // seconds a failed lookup is remembered
+#define DNS_WAIT_TIMEOUT 5    // seconds a caller waits for the resolver
+#define DNS_RESOLVERS 2       // background resolver threads
+#define DNS_MAX_WATCHERS 64   // eventfds told when a lookup completes
+
+/* Entry states */
+#define DNS_PENDING 0 // queued for or being resolved by a resolver thread
+#define DNS_OK      1
+#define DNS_FAILED  2
+
+/* Addresses of a host, with the port of the lookup filled in */
+typedef struct dns_addrs {
+
+    int naddrs;
+    struct sockaddr_storage addr[DNS_MAX_ADDRS];
+    socklen_t addrlen[DNS_MAX_ADDRS];
+
+} dns_addrs;
+
+typedef struct dns_entry {
+
+    char *host;
+    dns_addrs addrs; // port fields are 0, set per lookup
+    int state; // DNS_PENDING, DNS_OK or DNS_FAILED
+    int refreshing; // a stale DNS_OK entry queued for a new lookup
+    int watched; // a caller that doesn't wait asked for the pending lookup
+    time_t expires; // 0 for entries from the hosts file, which never expire
+    unsigned int refs; // callers and queue slots using the entry
+    unsigned int nwaiters; // callers blocked on ready
+    sem_t ready; // posted once per waiter when a lookup completes
+    struct dns_entry *next; // next entry in the same hash bucket
+    struct dns_entry *qnext; // next entry in the resolver queue
+
+} dns_entry;
+
+typedef struct dns_cache {
+
+    dns_entry *buckets[DNS_BUCKETS];
+    unsigned int count; // number of cached host names
+    dns_entry *qhead, *qtail; // lookups waiting for a resolver thread
+    sem_t mutex; // protects the table, the queue and all entries
+    sem_t items; // number of queued lookups
+    int watchers[DNS_MAX_WATCHERS]; // eventfds of callers that don't wait
+    int nwatchers;
+
+} dns_cache;
+
+dns_cache *init_dns(char *hosts_file);
+int dns_lookup(dns_cache *dns, char *host, char *port, dns_addrs *out);
+int dns_lookup_nowait(dns_cache *dns, char *host, char *port,
+                      dns_addrs *out);
+void dns_watch(dns_cache *dns, int fd);
+int dns_connect(dns_cache *dns, char *host, char *port);
+
+#endif /* __DNSCACHE_H__ */
@@ -0,0 +1,881 @@
+/* Event-driven engine for Proxylab, CMU 15-213/513, Fall 2015
+ * Author: Aleksander Bapst (abapst)
+ *
+ * An alternative to the worker pool in which a handful of event loops
+ * multiplex many client/host connection pairs over non-blocking sockets.
+ * Each loop thread owns an epoll instance. The listening socket is shared
+ * by every loop and registered with EPOLLEXCLUSIVE, so only one loop is
+ * woken per burst of new connections. With several SO_REUSEPORT listening
+ * sockets (-l) the loops take them in turn, and with one socket per loop
+ * the kernel balances new connections between the loops without waking
+ * any loop but the one that gets them. A connection stays on the loop that
+ * accepted it for its whole life, so connections need no locking; the
+ * cache is the only state shared between loops.
+ *
+ * Connection sockets are registered once, edge-triggered, for both reading
+ * and writing. Any event on either socket of a pair runs the connection's
+ * state machine until every step would block, so an edge is never lost:
+ *
+ *     READ_REQ -> (hit)  SEND_HIT -> done
+ *              -> (miss) WAIT_DNS -> CONNECT -> SEND_REQ -> RELAY -> done
+ *
+ * The request is rewritten with the same helpers as the threaded engine
+ * and cache hits are written straight from the pinned cache object, or,
+ * for an object stored gzipped or a byte range of an object, from a
+ * response made for the hit. Ranges that miss are passed on to the host,
+ * whose 206 answers aren't cached. On a
+ * miss the response is relayed to the client through a MAXBUF buffer and
+ * collected for the cache in a buffer that grows as the body arrives. It is
+ * stored in the same form as the threaded engine stores a response, with
+ * its header length, so either engine can slice and revalidate it later.
+ * Host names are resolved through the DNS cache without waiting for it. A
+ * name it can't answer yet parks the connection in WAIT_DNS, and the
+ * resolver thread that looks it up writes to the loop's eventfd, which
+ * sends every parked connection of the loop back to the DNS cache. A lookup
+ * still pending after DNS_WAIT_TIMEOUT seconds fails the request, as in the
+ * threaded engine. Requests are sent with Connection: close. Response bytes
+ * are fed to the incremental parser in parser.c as they arrive, so a framed
+ * response is done as soon as its last byte is in, without waiting for the
+ * host to close, and a response cut short by the host is never cached.
+ * This engine does not revalidate in line: a stale object still within its
+ * stale window is served as a hit and refreshed in the background (see
+ * refresh.c), and any other stale object is simply fetched again.
+ */
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include "event.h"
+#include "http.h"
+#include "parser.h"
+#include "gzip.h"
+#include "stats.h"
+#include "refresh.h"
+
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE 0
+#endif
+
+#define MAX_EVENTS 256   // events handled per epoll_wait
+#define ACCEPT_BATCH 64  // connections accepted per wakeup
+#define CACHE_BUF_INIT 16384 // first allocation of a miss's cache buffer
+#define PARK_CHECK_MS 1000   // how often parked lookups check their deadline
+
+/* Connection header of responses made by the proxy, which are all that need
+ * one: hits on packed objects, 206 slices of hits and local responses
+ */
+static const char *close_hdr = "Connection: close\r\n";
+
+/* Connection states */
+#define ST_READ_REQ 0 // collecting the request headers from the client
+#define ST_SEND_HIT 1 // writing a pinned cache object to the client
+#define ST_WAIT_DNS 2 // parked until the host name has been looked up
+#define ST_CONNECT  3 // waiting for the connection to the host
+#define ST_SEND_REQ 4 // writing the rewritten request to the host
+#define ST_RELAY    5 // copying the response from the host to the client
+#define ST_DONE     6 // closed, waiting to be freed after this batch
+
+/* Results of a state handler */
+#define STEP_AGAIN 0 // state advanced, run the next handler
+#define STEP_BLOCK 1 // would block, wait for the next event
+#define STEP_CLOSE 2 // finished or failed, close the connection
+
+typedef struct conn {
+
+    int state;
+    int clientfd;
+    int serverfd;
+    struct ev_loop *loop;
+    struct conn *next_dead;
+    struct conn *next_parked;
+    int parked; // on the loop's list of connections in WAIT_DNS
+
+    char req[MAXLINE]; // raw request headers read from the client
+    unsigned int req_len;
+    char *fwd; // rewritten request for the host
+    unsigned int fwd_len, fwd_pos;
+    char *cache_id;
+    char *host, *port; // host to look up
+    time_t dns_deadline; // when a pending lookup fails the request
+    dns_addrs addrs; // host addresses
+    int addr_idx; // next address to try
+
+    cache_object *hit; // pinned object being written on a cache hit
+    char *hit_buf; // response made from a packed hit, or NULL
+    char *hit_data; // what is written on a hit, the object or hit_buf
+    size_t hit_len, hit_pos;
+
+    char relay[MAXBUF]; // response bytes not yet written to the client
+    unsigned int relay_pos, relay_len;
+    http_parser parser; // finds the end of the response
+    int server_eof; // the whole response has been read
+    char *cache_buf; // response collected for the cache
+    size_t cache_length, cache_cap;
+    int valid_size;
+
+    long start; // stats_clock when the request started to arrive
+    long mark; // start of the connect or first byte phase, 0 once timed
+
+} conn;
+
+typedef struct ev_loop {
+
+    int epfd;
+    int listenfd;
+    int dnsfd; // eventfd the resolver threads write when a lookup completes
+    conn *dead; // connections closed while handling the current batch
+    conn *parked; // connections waiting for a host name lookup
+
+} ev_loop;
+
+static cache_list *ev_cache;
+static dns_cache *ev_dns;
+static refresh_queue *ev_refresh;
+
+static void *loop_thread(void *vargp);
+static void run_loop(ev_loop *loop);
+static void accept_conns(ev_loop *loop);
+static void watch_fd(ev_loop *loop, int fd, void *ptr, unsigned int events);
+static int set_nonblocking(int fd);
+static void conn_step(conn *c);
+static void close_conn(conn *c);
+static int read_request(conn *c);
+static int process_request(conn *c);
+static int unpack_hit(conn *c, int gzip);
+static void slice_hit(conn *c, request_head *head);
+static int not_modified_hit(conn *c, request_head *head);
+static int local_response(conn *c, request_head *head);
+static int wait_dns(conn *c);
+static void park_conn(conn *c);
+static void unpark_conn(conn *c);
+static void wake_parked(ev_loop *loop);
+static int start_connect(conn *c);
+static int finish_connect(conn *c);
+static int send_request(conn *c);
+static int send_hit(conn *c);
+static int relay_response(conn *c);
+static void collect_response(conn *c, char *buf, unsigned int n);
+static void store_response(conn *c, time_t expires);
+
+/*
+ * run_event_engine - Serve clients on the nlisten sockets in listenfds with
+ *                    nloops event loops, loop i accepting on socket
+ *                    i % nlisten. nloops-1 loops get their own thread and
+ *                    the last one runs in the calling thread, so this never
+ *                    returns. Stale objects are refreshed through refresh.
+ */
+void run_event_engine(int *listenfds, int nlisten, int nloops,
+                      cache_list *cache, dns_cache *dns,
+                      refresh_queue *refresh) {
+    struct rlimit rl;
+    ev_loop *loops;
+    pthread_t tid;
+    int i;
+
+    ev_cache = cache;
+    ev_dns = dns;
+    ev_refresh = refresh;
+
+    /* Every connection pair needs two descriptors, so raise the soft limit */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    for (i = 0; i < nlisten; i++)
+        if (set_nonblocking(listenfds[i]) < 0)
+            unix_error("fcntl error");
+
+    loops = (ev_loop *)Calloc(nloops, sizeof(ev_loop));
+    for (i = 0; i < nloops; i++) {
+        if ((loops[i].epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+            unix_error("epoll_create1 error");
+        loops[i].listenfd = listenfds[i % nlisten];
+        loops[i].dead = NULL;
+        loops[i].parked = NULL;
+        watch_fd(&loops[i], loops[i].listenfd, NULL,
+                 EPOLLIN | EPOLLEXCLUSIVE);
+        if ((loops[i].dnsfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+            unix_error("eventfd error");
+        watch_fd(&loops[i], loops[i].dnsfd, &loops[i], EPOLLIN | EPOLLET);
+        dns_watch(dns, loops[i].dnsfd);
+    }
+    for (i = 0; i < nloops - 1; i++)
+        Pthread_create(&tid, NULL, loop_thread, &loops[i]);
+    run_loop(&loops[nloops - 1]);
+}
+
+/* loop_thread - Thread routine for all but the last event loop. */
+static void *loop_thread(void *vargp) {
+    Pthread_detach(Pthread_self());
+    run_loop((ev_loop *)vargp);
+    return NULL;
+}
+
+/*
+ * run_loop - Wait for events and dispatch them. A NULL event pointer marks
+ *            the listening socket and the loop itself its DNS eventfd.
+ *            While connections are parked the wait times out every
+ *            PARK_CHECK_MS, so that lookups past their deadline fail even
+ *            if the resolver never answers. Connections closed during a
+ *            batch are freed only after the whole batch, since a later
+ *            event in the same batch may still point at them. Each batch
+ *            uses the cache as one user (see enter_cache), so a loop stops
+ *            for good at its next batch once the proxy shuts down.
+ */
+static void run_loop(ev_loop *loop) {
+    struct epoll_event events[MAX_EVENTS];
+    conn *c;
+    int i, n;
+
+    while (1) {
+        if ((n = epoll_wait(loop->epfd, events, MAX_EVENTS,
+                            loop->parked ? PARK_CHECK_MS : -1)) < 0) {
+            if (errno == EINTR)
+                continue;
+            unix_error("epoll_wait error");
+        }
+        enter_cache(ev_cache);
+        if (n == 0)
+            wake_parked(loop);
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL)
+                accept_conns(loop);
+            else if (events[i].data.ptr == loop)
+                wake_parked(loop);
+            else
+                conn_step((conn *)events[i].data.ptr);
+        }
+        while ((c = loop->dead) != NULL) {
+            loop->dead = c->next_dead;
+            Free(c);
+        }
+        leave_cache(ev_cache);
+    }
+}
+
+/*
+ * accept_conns - Accept a batch of new clients and register them with this
+ *                loop. The batch is bounded so that one loop doesn't take
+ *                every connection of a burst.
+ */
+static void accept_conns(ev_loop *loop) {
+    int i, fd;
+    conn *c;
+
+    for (i = 0; i < ACCEPT_BATCH; i++) {
+        if ((fd = accept(loop->listenfd, NULL, NULL)) < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                fprintf(stderr, "accept error: %s\n", strerror(errno));
+            return;
+        }
+        if (set_nonblocking(fd) < 0) {
+            Close(fd);
+            continue;
+        }
+
+        c = (conn *)Calloc(1, sizeof(conn));
+        c->state = ST_READ_REQ;
+        c->clientfd = fd;
+        c->serverfd = -1;
+        c->loop = loop;
+        watch_fd(loop, fd, c, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+        stats_add(STAT_CONNS, 1);
+        stats_add(STAT_CONNS_ACTIVE, 1);
+    }
+}
+
+/* watch_fd - Register a descriptor with a loop's epoll instance. */
+static void watch_fd(ev_loop *loop, int fd, void *ptr, unsigned int events) {
+    struct epoll_event ev;
+
+    ev.events = events;
+    ev.data.ptr = ptr;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        unix_error("epoll_ctl error");
+}
+
+/* set_nonblocking - Put a descriptor in non-blocking mode. */
+static int set_nonblocking(int fd) {
+    int flags;
+
+    if ((flags = fcntl(fd, F_GETFL, 0)) < 0)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/*
+ * conn_step - Run a connection's state machine until it would block or is
+ *             finished. Called for every event on either of its sockets.
+ */
+static void conn_step(conn *c) {
+    int rc = STEP_AGAIN;
+
+    while (rc == STEP_AGAIN) {
+        switch (c->state) {
+        case ST_READ_REQ:
+            rc = read_request(c);
+            break;
+        case ST_SEND_HIT:
+            rc = send_hit(c);
+            break;
+        case ST_WAIT_DNS:
+            rc = wait_dns(c);
+            break;
+        case ST_CONNECT:
+            rc = finish_connect(c);
+            break;
+        case ST_SEND_REQ:
+            rc = send_request(c);
+            break;
+        case ST_RELAY:
+            rc = relay_response(c);
+            break;
+        default: /* ST_DONE, a stale event from this batch */
+            return;
+        }
+    }
+    if (rc == STEP_CLOSE)
+        close_conn(c);
+}
+
+/*
+ * close_conn - Close both sockets, which also removes them from epoll, drop
+ *              everything the connection holds and queue it to be freed.
+ */
+static void close_conn(conn *c) {
+    unpark_conn(c);
+    if (c->clientfd >= 0)
+        Close(c->clientfd);
+    if (c->serverfd >= 0)
+        Close(c->serverfd);
+    if (c->hit != NULL)
+        release_object(c->hit);
+    if (c->fwd != NULL)
+        Free(c->fwd);
+    if (c->hit_buf != NULL)
+        Free(c->hit_buf);
+    if (c->cache_id != NULL)
+        Free(c->cache_id);
+    if (c->host != NULL)
+        Free(c->host);
+    if (c->port != NULL)
+        Free(c->port);
+    if (c->cache_buf != NULL)
+        Free(c->cache_buf);
+    stats_add(STAT_CONNS_ACTIVE, -1);
+
+    c->state = ST_DONE;
+    c->next_dead = c->loop->dead;
+    c->loop->dead = c;
+}
+
+/*
+ * read_request - Read from the client until the blank line that ends the
+ *                request headers has arrived.
+ */
+static int read_request(conn *c) {
+    ssize_t n;
+    unsigned int scan;
+
+    while (1) {
+        if (c->req_len >= sizeof(c->req) - 1)
+            return STEP_CLOSE; /* Headers too long */
+        n = read(c->clientfd, c->req + c->req_len,
+                 sizeof(c->req) - 1 - c->req_len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ?
+                STEP_BLOCK : STEP_CLOSE;
+        }
+        if (n == 0)
+            return STEP_CLOSE;
+        if (c->req_len == 0)
+            c->start = stats_clock();
+
+        /* Only rescan the tail where the terminator could have appeared */
+        scan = (c->req_len > 3) ? c->req_len - 3 : 0;
+        c->req_len += n;
+        c->req[c->req_len] = '\0';
+        if (strstr(c->req + scan, "\r\n\r\n") != NULL ||
+            strstr(c->req + scan, "\n\n") != NULL)
+            return process_request(c);
+    }
+}
+
+/*
+ * process_request - Tokenize the buffered request in place, rewrite it for
+ *                   the host and search the cache. A hit moves on to
+ *                   writing the pinned object, a miss to looking the host
+ *                   up.
+ */
+static int process_request(conn *c) {
+    char cache_id[MAXLINE];
+    char hostname[MAXLINE], host_port[MAXLINE];
+    char *p = c->req, *end = c->req + c->req_len, *nl;
+    request_head head;
+    ssize_t len;
+    time_t now;
+    long lookup;
+    int rc = 0, stale;
+
+    /* Tokenize the request line and then each header line in place */
+    head_init(&head);
+    while (rc == 0 && (nl = memchr(p, '\n', end - p)) != NULL) {
+        rc = head_line(&head, p, nl - p + 1);
+        p = nl + 1;
+    }
+    if (rc == 1 && head.local)
+        return local_response(c, &head);
+    if (rc != 1 || head_host(&head, hostname, host_port) < 0 ||
+        head_cache_id(&head, cache_id) < 0)
+        return STEP_CLOSE;
+    head.identity = ev_cache->compress;
+    stats_phase(PHASE_PARSE, c->start);
+    stats_add(STAT_REQUESTS, 1);
+
+    /* Flatten the rewritten request, which is written out bit by bit */
+    c->fwd = (char *)Malloc(MAXLINE);
+    if ((len = head_compose(&head, 0, c->fwd, MAXLINE)) < 0)
+        return STEP_CLOSE;
+    c->fwd_len = len;
+    c->cache_id = (char *)Malloc(strlen(cache_id) + 1);
+    strcpy(c->cache_id, cache_id);
+
+    /* Cache hit, write the pinned object out without copying it. A stale
+     * object is served too while a refresh of it is allowed to lag, and
+     * fetched again in full otherwise.
+     */
+    lookup = stats_clock();
+    c->hit = search_cache(ev_cache, c->cache_id);
+    stats_phase(PHASE_LOOKUP, lookup);
+    if (c->hit != NULL) {
+        now = time(NULL);
+        stale = !object_fresh(c->hit, now);
+        if (!stale || refresh_stale(ev_refresh, c->hit, c->cache_id, c->req,
+                                    c->req_len, now)) {
+            if (stale)
+                stats_add(STAT_STALE, 1);
+            stats_add(STAT_HITS, 1);
+            c->hit_data = c->hit->data;
+            c->hit_len = c->hit->length;
+            if (not_modified_hit(c, &head) == 0) {
+                c->state = ST_SEND_HIT;
+                return STEP_AGAIN;
+            }
+            if (c->hit->identity_length > 0 &&
+                unpack_hit(c, head.accept_gzip) < 0)
+                return STEP_CLOSE;
+            if (c->hit->identity_length == 0 && head.ranged)
+                slice_hit(c, &head);
+            c->state = ST_SEND_HIT;
+            return STEP_AGAIN;
+        }
+        release_object(c->hit);
+        c->hit = NULL;
+    }
+
+    /* Cache miss, find the host */
+    stats_add(STAT_MISSES, 1);
+    c->mark = stats_clock();
+    c->host = (char *)Malloc(strlen(hostname) + 1);
+    strcpy(c->host, hostname);
+    c->port = (char *)Malloc(strlen(host_port) + 1);
+    strcpy(c->port, host_port);
+    c->dns_deadline = time(NULL) + DNS_WAIT_TIMEOUT;
+    c->state = ST_WAIT_DNS;
+    return STEP_AGAIN;
+}
+
+/*
+ * wait_dns - Look the host up without waiting for the resolver, and start
+ *            connecting to it once its addresses are known. A lookup that
+ *            is still pending parks the connection until the loop's
+ *            eventfd says a lookup has completed, or fails the request
+ *            once it is past its deadline.
+ */
+static int wait_dns(conn *c) {
+    int rc;
+
+    unpark_conn(c);
+    if ((rc = dns_lookup_nowait(ev_dns, c->host, c->port, &c->addrs)) < 0)
+        return STEP_CLOSE;
+    if (rc > 0) {
+        if (time(NULL) >= c->dns_deadline)
+            return STEP_CLOSE;
+        park_conn(c);
+        return STEP_BLOCK;
+    }
+    c->addr_idx = 0;
+    return start_connect(c);
+}
+
+/* park_conn - Put a connection on its loop's list of pending lookups. */
+static void park_conn(conn *c) {
+    c->next_parked = c->loop->parked;
+    c->loop->parked = c;
+    c->parked = 1;
+}
+
+/* unpark_conn - Take a connection off its loop's list of pending lookups,
+ *               if it is on it.
+ */
+static void unpark_conn(conn *c) {
+    conn **link;
+
+    if (!c->parked)
+        return;
+    for (link = &c->loop->parked; *link != c; link = &(*link)->next_parked)
+        ;
+    *link = c->next_parked;
+    c->parked = 0;
+}
+
+/*
+ * wake_parked - Drain the loop's DNS eventfd and run every parked
+ *               connection again. The list is taken whole first, since the
+ *               connections whose lookups are still pending park again.
+ */
+static void wake_parked(ev_loop *loop) {
+    uint64_t count;
+    conn *c, *next;
+
+    while (read(loop->dnsfd, &count, sizeof(count)) > 0)
+        ;
+    c = loop->parked;
+    loop->parked = NULL;
+    for (; c != NULL; c = next) {
+        next = c->next_parked;
+        c->parked = 0;
+        conn_step(c);
+    }
+}
+
+/*
+ * start_connect - Start a non-blocking connect to the next candidate address
+ *                 of the host, skipping addresses that fail right away.
+ */
+static int start_connect(conn *c) {
+    int fd, i;
+
+    for (; c->addr_idx < c->addrs.naddrs; c->addr_idx++) {
+        i = c->addr_idx;
+        fd = socket(c->addrs.addr[i].ss_family,
+                    SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            continue;
+        if (connect(fd, (SA *)&c->addrs.addr[i], c->addrs.addrlen[i]) < 0 &&
+            errno != EINPROGRESS) {
+            Close(fd);
+            continue;
+        }
+        c->serverfd = fd;
+        c->state = ST_CONNECT;
+        watch_fd(c->loop, fd, c, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+        return STEP_AGAIN;
+    }
+    return STEP_CLOSE;
+}
+
+/*
+ * finish_connect - Check whether the pending connect has completed. On
+ *                  failure the next address of the host is tried.
+ */
+static int finish_connect(conn *c) {
+    struct sockaddr_storage peer;
+    socklen_t len = sizeof(int);
+    int err = 0;
+
+    if (getsockopt(c->serverfd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+        err = errno;
+    if (err == 0) {
+        len = sizeof(peer);
+        if (getpeername(c->serverfd, (SA *)&peer, &len) == 0) {
+            stats_phase(PHASE_CONNECT, c->mark);
+            c->state = ST_SEND_REQ;
+            return STEP_AGAIN;
+        }
+        if (errno == ENOTCONN)
+            return STEP_BLOCK; /* Still connecting */
+    }
+
+    Close(c->serverfd);
+    c->serverfd = -1;
+    c->addr_idx++;
+    return start_connect(c);
+}
+
+/* send_request - Write the rewritten request to the host. */
+static int send_request(conn *c) {
+    ssize_t n;
+
+    while (c->fwd_pos < c->fwd_len) {
+        n = write(c->serverfd, c->fwd + c->fwd_pos, c->fwd_len - c->fwd_pos);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ?
+                STEP_BLOCK : STEP_CLOSE;
+        }
+        c->fwd_pos += n;
+    }
+    Free(c->fwd);
+    c->fwd = NULL;
+    c->valid_size = 1;
+    c->mark = stats_clock();
+    parser_init(&c->parser, PARSE_RESPONSE);
+    c->state = ST_RELAY;
+    return STEP_AGAIN;
+}
+
+/*
+ * unpack_hit - Make the response for a hit on a packed object in hit_buf,
+ *              gzipped if the client accepts it and inflated otherwise
+ *              (see gzip.c).
+ */
+static int unpack_hit(conn *c, int gzip) {
+    struct iovec iov[GZIP_IOV_MAX];
+    char hdrs[GZIP_HDRS_MAX];
+    char *body;
+    size_t len = 0;
+    int i, n;
+
+    if ((n = gzip_iov(c->hit, gzip, close_hdr, hdrs, &body, iov)) < 0)
+        return -1;
+    for (i = 0; i < n; i++)
+        len += iov[i].iov_len;
+    c->hit_buf = (char *)Malloc(len);
+    for (len = 0, i = 0; i < n; i++) {
+        memcpy(c->hit_buf + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+    if (body != NULL)
+        Free(body);
+    c->hit_data = c->hit_buf;
+    c->hit_len = len;
+    return 0;
+}
+
+/*
+ * slice_hit - Make the 206 answer to a request for a byte range of the
+ *             cached object, unless the range can't be cut out of it (see
+ *             head_slice) and the object is sent whole.
+ */
+static void slice_hit(conn *c, request_head *head) {
+    cache_object *object = c->hit;
+    char buf[MAXBUF];
+    char *data = object->data;
+    size_t hdr_end = object->hdr_length, blank, first, count;
+    ssize_t n;
+
+    if (hdr_end == 0)
+        return;
+    blank = (data[hdr_end] == '\r') ? 2 : 1;
+    if ((n = head_slice(head, data, hdr_end,
+                        object->length - hdr_end - blank, close_hdr, buf,
+                        sizeof(buf), &first, &count)) < 0)
+        return;
+    c->hit_buf = (char *)Malloc(n + count);
+    memcpy(c->hit_buf, buf, n);
+    memcpy(c->hit_buf + n, data + hdr_end + blank + first, count);
+    c->hit_data = c->hit_buf;
+    c->hit_len = n + count;
+}
+
+/*
+ * not_modified_hit - Make the 304 answer to a conditional request that the
+ *                    cached object still matches (see head_not_modified).
+ *                    Returns -1 if the object is to be sent instead.
+ */
+static int not_modified_hit(conn *c, request_head *head) {
+    char buf[MAXBUF];
+    ssize_t n;
+
+    if (c->hit->hdr_length == 0 ||
+        (n = head_not_modified(head, c->hit->data, c->hit->hdr_length,
+                               close_hdr, buf, sizeof(buf))) < 0)
+        return -1;
+    c->hit_buf = (char *)Malloc(n);
+    memcpy(c->hit_buf, buf, n);
+    c->hit_data = c->hit_buf;
+    c->hit_len = n;
+    return 0;
+}
+
+/*
+ * local_response - Answer a request made to the proxy itself, such as one
+ *                  for its statistics (see stats.c), like a hit.
+ */
+static int local_response(conn *c, request_head *head) {
+    ssize_t n;
+
+    c->hit_buf = (char *)Malloc(STATS_RESPONSE_MAX);
+    if ((n = stats_response(head->path.iov_base, head->path.iov_len,
+                            close_hdr, c->hit_buf, STATS_RESPONSE_MAX)) < 0)
+        return STEP_CLOSE;
+    c->hit_data = c->hit_buf;
+    c->hit_len = n;
+    c->state = ST_SEND_HIT;
+    return STEP_AGAIN;
+}
+
+/* send_hit - Write the pinned cache object, or a local response, to the
+ *            client.
+ */
+static int send_hit(conn *c) {
+    ssize_t n;
+
+    while (c->hit_pos < c->hit_len) {
+        n = write(c->clientfd, c->hit_data + c->hit_pos,
+                  c->hit_len - c->hit_pos);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ?
+                STEP_BLOCK : STEP_CLOSE;
+        }
+        c->hit_pos += n;
+        if (c->hit != NULL)
+            stats_add(STAT_BYTES_CACHE, n);
+    }
+    if (c->hit != NULL)
+        stats_phase(PHASE_TOTAL, c->start);
+    return STEP_CLOSE;
+}
+
+/*
+ * relay_response - Copy the response from the host to the client until the
+ *                  parser finds its end or the host closes the connection,
+ *                  then add the response to the cache if it is complete and
+ *                  was small enough. The host is only read once the client
+ *                  has taken everything in the relay buffer, so a slow
+ *                  client throttles the host through TCP.
+ */
+static int relay_response(conn *c) {
+    ssize_t n;
+    size_t used;
+    freshness f;
+    time_t expires;
+
+    while (1) {
+        /* Drain the relay buffer to the client first */
+        if (c->relay_pos < c->relay_len) {
+            n = write(c->clientfd, c->relay + c->relay_pos,
+                      c->relay_len - c->relay_pos);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                return (errno == EAGAIN || errno == EWOULDBLOCK) ?
+                    STEP_BLOCK : STEP_CLOSE;
+            }
+            c->relay_pos += n;
+            stats_add(STAT_BYTES_ORIGIN, n);
+            continue;
+        }
+        c->relay_pos = c->relay_len = 0;
+
+        /* The whole response has been written, cache it if its headers
+         * allow it
+         */
+        if (c->server_eof) {
+            if (c->valid_size && c->cache_length > 0 &&
+                parser_finish(&c->parser) == 0) {
+                freshness_scan(&f, c->cache_buf, c->cache_length);
+                if ((expires = freshness_expiry(&f, time(NULL))) >= 0)
+                    store_response(c, expires);
+            }
+            stats_phase(PHASE_TOTAL, c->start);
+            return STEP_CLOSE;
+        }
+
+        n = read(c->serverfd, c->relay, sizeof(c->relay));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ?
+                STEP_BLOCK : STEP_CLOSE;
+        }
+        if (n == 0)
+            c->server_eof = 1;
+        else if (c->mark != 0) {
+            stats_phase(PHASE_FIRST_BYTE, c->mark);
+            c->mark = 0;
+        }
+
+        /* Anything the host sends after the response is not relayed. A
+         * response the parser can't follow is relayed up to the close.
+         */
+        used = parser_execute(&c->parser, c->relay, n);
+        if (c->parser.state == PARSE_DONE) {
+            n = used;
+            c->server_eof = 1;
+        }
+        c->relay_len = n;
+        collect_response(c, c->relay, n);
+    }
+}
+
+/*
+ * collect_response - Append response bytes to the connection's cache buffer,
+ *                    doubling it as needed. Once the response is larger than
+ *                    the cache's max_object it can't be cached and the
+ *                    buffer is dropped.
+ */
+static void collect_response(conn *c, char *buf, unsigned int n) {
+    if (!c->valid_size || n == 0)
+        return;
+    if (c->cache_length + n > ev_cache->max_object) {
+        c->valid_size = 0;
+        if (c->cache_buf != NULL)
+            Free(c->cache_buf);
+        c->cache_buf = NULL;
+        return;
+    }
+    if (c->cache_length + n > c->cache_cap) {
+        c->cache_cap = (c->cache_cap == 0) ? CACHE_BUF_INIT : c->cache_cap;
+        while (c->cache_cap < c->cache_length + n)
+            c->cache_cap *= 2;
+        if (c->cache_cap > ev_cache->max_object)
+            c->cache_cap = ev_cache->max_object;
+        c->cache_buf = (char *)Realloc(c->cache_buf, c->cache_cap);
+    }
+    memcpy(c->cache_buf + c->cache_length, buf, n);
+    c->cache_length += n;
+}
+
+/*
+ * store_response - Add the collected response to the cache as the threaded
+ *                  engine stores one: without the hop-by-hop Connection,
+ *                  Keep-Alive and Proxy-Connection headers, with a
+ *                  Content-Length if the host ended the body by closing,
+ *                  and with the length of its headers, so that the object
+ *                  can be sliced for ranges and revalidated like any other.
+ */
+static void store_response(conn *c, time_t expires) {
+    char *data = c->cache_buf, *p, *nl;
+    char *end = data + c->parser.header_length;
+    char *buf = (char *)Malloc(c->cache_length + MAXLINE);
+    size_t len = 0, rest;
+
+    for (p = data; p < end &&
+         (nl = memchr(p, '\n', end - p)) != NULL; p = nl + 1) {
+        if (p > data && nl - p <= 1)
+            break; /* The blank line */
+        if (!strncasecmp(p, "Connection:", 11) ||
+            !strncasecmp(p, "Keep-Alive:", 11) ||
+            !strncasecmp(p, "Proxy-Connection:", 17))
+            continue;
+        memcpy(buf + len, p, nl + 1 - p);
+        len += nl + 1 - p;
+    }
+    rest = c->cache_length - (p - data);
+    if (!c->parser.framed)
+        len += sprintf(buf + len, "Content-Length: %zu\r\n",
+                       rest - ((*p == '\r') ? 2 : 1));
+    memcpy(buf + len, p, rest);
+    add_to_cache(ev_cache, c->cache_id, buf, len + rest, len, expires);
+    Free(buf);
+}
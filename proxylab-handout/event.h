@@ -0,0 +1,17 @@
+/* Event engine header file for event.c
+ * Author: Aleksander Bapst (abapst)
+ */
+
+#ifndef __EVENT_H__
+#define __EVENT_H__
+
+#include "csapp.h"
+#include "cache.h"
+#include "dnscache.h"
+#include "refresh.h"
+
+void run_event_engine(int *listenfds, int nlisten, int nloops,
+                      cache_list *cache, dns_cache *dns,
+                      refresh_queue *refresh);
+
+#endif /* __EVENT_H__ */
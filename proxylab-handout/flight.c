@@ -0,0 +1,233 @@
+/* Request coalescing for Proxylab, CMU 15-213/513, Fall 2015
+ * Author: Aleksander Bapst (abapst)
+ *
+ * When many clients ask for the same uncached object at once, only the
+ * first one, the leader, fetches it from the host. Requests that miss the
+ * cache while that fetch is in flight become followers: they wait for the
+ * leader to finish and then look in the cache again, where the object now
+ * is. If the leader could not cache the object (too large, or the fetch
+ * failed) the followers fetch it themselves, so coalescing never turns one
+ * failure into many.
+ *
+ * Followers of a large object shouldn't have to wait for all of it, so a
+ * leader whose response is cacheable and of known length streams it: as
+ * soon as the headers are in it moves them into a buffer of the full
+ * length owned by the fetch, and publishes every piece of the body it
+ * relays. Followers then write the prefix that is already there to their
+ * clients and wait for more, so their first byte goes out as soon as the
+ * leader's does. The buffer only ever grows at its end and is freed with
+ * the fetch, so followers read it without holding the lock.
+ *
+ * Fetches in flight are kept in a chained hash table keyed by cache id,
+ * protected by one semaphore that is never held while waiting. Waiting
+ * followers are counted, and each progress of the leader posts the fetch's
+ * semaphore once for each of them, which serves as a condition variable. A
+ * fetch is removed from the table when its leader finishes, and freed once
+ * every follower has left. A follower gives up after FLIGHT_WAIT_TIMEOUT
+ * seconds without progress, so a host that hangs only holds its leader.
+ */
+
+#include "flight.h"
+#include "cache.h"
+
+static flight *new_flight(flight_table *table, unsigned int index,
+                          char *id);
+static void wake_waiters(flight *f);
+static void put_flight(flight *f);
+
+/* init_flights - Create an empty table of fetches in flight. */
+flight_table *init_flights(void) {
+    flight_table *table = (flight_table *)Calloc(1, sizeof(flight_table));
+
+    Sem_init(&table->mutex, 0, 1);
+    return table;
+}
+
+/*
+ * flight_join - Find the fetch in flight for id, or start one. *leader is set
+ *               if the caller started it and must fetch the object and then
+ *               call flight_finish. Otherwise the caller is a follower and
+ *               must call flight_wait.
+ */
+flight *flight_join(flight_table *table, char *id, int *leader) {
+    unsigned int index = hash_id(id) & (FLIGHT_BUCKETS - 1);
+    flight *f;
+
+    P(&table->mutex);
+    for (f = table->buckets[index]; f != NULL; f = f->next) {
+        if (!strcmp(f->id, id)) {
+            f->refs++;
+            V(&table->mutex);
+            *leader = 0;
+            return f;
+        }
+    }
+    f = new_flight(table, index, id);
+    V(&table->mutex);
+    *leader = 1;
+    return f;
+}
+
+/*
+ * flight_lead - Start a fetch of id and return it, for the caller to
+ *               finish, unless one is in flight already, in which case
+ *               NULL is returned and nothing needs to be done.
+ */
+flight *flight_lead(flight_table *table, char *id) {
+    unsigned int index = hash_id(id) & (FLIGHT_BUCKETS - 1);
+    flight *f;
+
+    P(&table->mutex);
+    for (f = table->buckets[index]; f != NULL; f = f->next)
+        if (!strcmp(f->id, id))
+            break;
+    f = (f == NULL) ? new_flight(table, index, id) : NULL;
+    V(&table->mutex);
+    return f;
+}
+
+/*
+ * flight_wait - Wait until the leader of f has streamed more than *filled
+ *               bytes of its response, or has finished, or for
+ *               FLIGHT_WAIT_TIMEOUT seconds. *filled is set to the bytes of
+ *               f->data filled by then, which may be read without the lock.
+ *               Returns 1 while the leader is still fetching, 0 once it has
+ *               finished, and -1 on a timeout.
+ */
+int flight_wait(flight_table *table, flight *f, size_t *filled) {
+    struct timespec deadline;
+    unsigned int gen;
+    int rc;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += FLIGHT_WAIT_TIMEOUT;
+
+    P(&table->mutex);
+    while (f->length <= *filled && !f->finished) {
+        gen = f->gen;
+        f->nwaiters++;
+        V(&table->mutex);
+        while ((rc = sem_timedwait(&f->done, &deadline)) < 0 &&
+               errno == EINTR)
+            ;
+        P(&table->mutex);
+        if (rc < 0) {
+            if (f->gen == gen) {
+                f->nwaiters--; // no longer waiting, nothing will be posted
+                V(&table->mutex);
+                return -1;
+            }
+            P(&f->done); // woken just as we timed out, take our post
+        }
+    }
+    *filled = f->length;
+    rc = !f->finished;
+    V(&table->mutex);
+    return rc;
+}
+
+/*
+ * flight_leave - Drop a follower's reference to f once it is done with it.
+ *                f must not be used afterwards.
+ */
+void flight_leave(flight_table *table, flight *f) {
+    P(&table->mutex);
+    if (--f->refs == 0)
+        put_flight(f);
+    V(&table->mutex);
+}
+
+/*
+ * flight_stream - Called by the leader once it has the headers, length
+ *                 bytes of data with the blank line at hdr_length, of a
+ *                 response that will be total bytes long. Copies them into
+ *                 a buffer of the full length that followers can stream
+ *                 from, and returns it. The leader appends the rest of the
+ *                 response to that buffer, calling flight_fill as it goes,
+ *                 and must not free it.
+ */
+char *flight_stream(flight_table *table, flight *f, char *data, size_t length,
+                    size_t hdr_length, size_t total) {
+    char *buf = (char *)Malloc(total);
+
+    memcpy(buf, data, length);
+    P(&table->mutex);
+    f->data = buf;
+    f->hdr_length = hdr_length;
+    f->total = total;
+    V(&table->mutex);
+    flight_fill(table, f, length);
+    return buf;
+}
+
+/* flight_fill - Publish the first length bytes of a streamed response to
+ *               the followers and wake them.
+ */
+void flight_fill(flight_table *table, flight *f, size_t length) {
+    P(&table->mutex);
+    f->length = length;
+    wake_waiters(f);
+    V(&table->mutex);
+}
+
+/*
+ * flight_finish - Called by the leader once the object is in the cache, or
+ *                 has turned out not to be cacheable. Removes the fetch
+ *                 from the table so new misses start a fetch of their own,
+ *                 and wakes the followers. A streamed response that is
+ *                 shorter than its total by then was cut short.
+ */
+void flight_finish(flight_table *table, flight *f) {
+    unsigned int index = hash_id(f->id) & (FLIGHT_BUCKETS - 1);
+    flight **link;
+
+    P(&table->mutex);
+    for (link = &table->buckets[index]; *link != NULL; link = &(*link)->next) {
+        if (*link == f) {
+            *link = f->next;
+            break;
+        }
+    }
+    f->finished = 1;
+    wake_waiters(f);
+    if (--f->refs == 0)
+        put_flight(f);
+    V(&table->mutex);
+}
+
+/* new_flight - Add a fetch of id, led by the caller, to bucket index of the
+ *              table. Called with the table locked.
+ */
+static flight *new_flight(flight_table *table, unsigned int index,
+                          char *id) {
+    flight *f = (flight *)Calloc(1, sizeof(flight));
+
+    f->id = (char *)Malloc(strlen(id) + 1);
+    strcpy(f->id, id);
+    f->refs = 1;
+    Sem_init(&f->done, 0, 0);
+    f->next = table->buckets[index];
+    table->buckets[index] = f;
+    return f;
+}
+
+/* wake_waiters - Post done once for every waiting follower. Called with the
+ *                table locked.
+ */
+static void wake_waiters(flight *f) {
+    unsigned int i;
+
+    f->gen++;
+    for (i = 0; i < f->nwaiters; i++)
+        V(&f->done);
+    f->nwaiters = 0;
+}
+
+/* put_flight - Free a fetch nobody refers to anymore. */
+static void put_flight(flight *f) {
+    sem_destroy(&f->done);
+    if (f->data != NULL)
+        Free(f->data);
+    Free(f->id);
+    Free(f);
+}
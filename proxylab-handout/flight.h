@@ -0,0 +1,50 @@
+/* Request coalescing header file for flight.c
+ * Author: Aleksander Bapst (abapst)
+ */
+
+#ifndef __FLIGHT_H__
+#define __FLIGHT_H__
+
+#include "csapp.h"
+
+#define FLIGHT_BUCKETS 256      // hash buckets for fetches, a power of two
+#define FLIGHT_WAIT_TIMEOUT 30  // seconds a follower waits for the leader
+
+/* One fetch from a host that other requests for the same object wait on */
+typedef struct flight {
+
+    char *id; // cache id of the object being fetched
+    unsigned int refs; // the leader plus one per waiting follower
+    unsigned int nwaiters; // followers blocked on done
+    unsigned int gen; // bumped every time the waiters are woken
+    int finished; // the leader is done, successfully or not
+    sem_t done; // posted once per waiter when the leader makes progress
+
+    /* The response as the leader receives it, if it streams it */
+    char *data; // NULL until the headers are in, then total bytes
+    size_t hdr_length; // offset of the blank line ending the headers
+    size_t length; // bytes of data filled so far
+    size_t total; // bytes of data once the response is complete
+
+    struct flight *next; // next fetch in the same hash bucket
+
+} flight;
+
+typedef struct flight_table {
+
+    flight *buckets[FLIGHT_BUCKETS];
+    sem_t mutex; // protects the table and all fetches
+
+} flight_table;
+
+flight_table *init_flights(void);
+flight *flight_join(flight_table *table, char *id, int *leader);
+flight *flight_lead(flight_table *table, char *id);
+int flight_wait(flight_table *table, flight *f, size_t *filled);
+void flight_leave(flight_table *table, flight *f);
+char *flight_stream(flight_table *table, flight *f, char *data, size_t length,
+                    size_t hdr_length, size_t total);
+void flight_fill(flight_table *table, flight *f, size_t length);
+void flight_finish(flight_table *table, flight *f);
+
+#endif /* __FLIGHT_H__ */
@@ -0,0 +1,288 @@
+/* Compressed object storage for Proxylab, CMU 15-213/513, Fall 2015
+ * Author: Aleksander Bapst (abapst)
+ *
+ * With -z the cache stores text responses gzipped, so the same byte budget
+ * holds several times as many of them. A response is packed as it is added
+ * to the cache if it is a complete 200 with a text-like Content-Type, no
+ * Content-Encoding of its own, and a body of at least GZIP_MIN_LENGTH bytes
+ * that shrinks by an eighth or more. Everything else is stored as it came.
+ *
+ * A packed object keeps the response's own headers, minus Content-Length
+ * and the hop-by-hop Connection headers, followed by the blank line and the
+ * gzip stream. The length of the body before compression is kept in the
+ * object. The framing headers are added on every hit, depending on the
+ * client: one that accepts gzip gets the stored stream as it is, with
+ * Content-Encoding: gzip, and any other gets the body inflated again into a
+ * buffer that only lives for the hit. Since the two are different
+ * representations of the response, a strong ETag is stored weak (RFC 9110
+ * requires a strong tag to differ between content codings, and a weak one
+ * still revalidates, since If-None-Match compares weakly), and Accept-Encoding
+ * is added to the response's Vary header, or a Vary header of its own.
+ * Since the proxy chooses the encoding itself, the hosts are only asked for
+ * the identity encoding while -z is on (see http.c).
+ *
+ * Compression uses the system zlib.
+ */
+
+#include <zlib.h>
+#include "gzip.h"
+#include "http.h"
+
+static const char *gzip_hdr = "Content-Encoding: gzip\r\n";
+static const char *vary_hdr = "Vary: Accept-Encoding\r\n";
+
+static ssize_t header_end(char *data, size_t length);
+static int packable(char *data, size_t hdr_end, size_t body_length);
+static int packable_type(char *type);
+static int dropped_header(char *line);
+static size_t copy_header(char *out, char *p, size_t n, char *line, int *vary);
+static int gunzip(char *in, size_t length, char *out, size_t out_length);
+
+/*
+ * gzip_response - Pack the complete response in data, *length bytes, if it
+ *                 is worth it. Returns a Malloc'd buffer with the packed
+ *                 response, its length and header length in *length and
+ *                 *hdr_length, and the length of the body before compression
+ *                 in *identity_length. Returns NULL, leaving everything as it
+ *                 was, if the response is stored as is. Responses collected
+ *                 by the event engine still have their Connection headers,
+ *                 which are dropped here like Content-Length.
+ */
+char *gzip_response(char *data, size_t *length, size_t *hdr_length,
+                    size_t *identity_length) {
+    char *packed, *p, *nl, *body;
+    char line[MAXLINE];
+    size_t hdr_end, body_length, used, n;
+    ssize_t end;
+    z_stream zs;
+    int vary;
+
+    if ((end = header_end(data, *length)) < 0)
+        return NULL;
+    hdr_end = end;
+    body = data + hdr_end + ((data[hdr_end] == '\r') ? 2 : 1);
+    body_length = data + *length - body;
+    if (!packable(data, hdr_end, body_length))
+        return NULL;
+
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+        return NULL;
+    packed = (char *)Malloc(2 * hdr_end + GZIP_HDRS_MAX + 2 +
+                            deflateBound(&zs, body_length));
+
+    /* The response's own headers, without those added on every hit */
+    used = 0;
+    vary = 0;
+    for (p = data; p < data + hdr_end; p = nl + 1) {
+        nl = memchr(p, '\n', data + hdr_end - p);
+        n = nl - p + 1;
+        memcpy(line, p, (n < MAXLINE) ? n : MAXLINE - 1);
+        line[(n < MAXLINE) ? n : MAXLINE - 1] = '\0';
+        if (p == data)
+            used += copy_header(packed + used, p, n, NULL, &vary);
+        else if (!dropped_header(line))
+            used += copy_header(packed + used, p, n, line, &vary);
+    }
+    if (!vary) {
+        memcpy(packed + used, vary_hdr, strlen(vary_hdr));
+        used += strlen(vary_hdr);
+    }
+    memcpy(packed + used, "\r\n", 2);
+
+    zs.next_in = (Bytef *)body;
+    zs.avail_in = body_length;
+    zs.next_out = (Bytef *)packed + used + 2;
+    zs.avail_out = deflateBound(&zs, body_length);
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END ||
+        zs.total_out > body_length - body_length / 8) {
+        deflateEnd(&zs);
+        Free(packed);
+        return NULL;
+    }
+    deflateEnd(&zs);
+
+    *hdr_length = used;
+    *length = used + 2 + zs.total_out;
+    *identity_length = body_length;
+    return packed;
+}
+
+/*
+ * gzip_iov - Split a hit on a packed object into iov, which has room for
+ *            GZIP_IOV_MAX pieces, and return the number of pieces, or -1 if
+ *            the body can't be inflated. If gzip is set the client accepts
+ *            gzip and gets the stored stream; otherwise the body is inflated
+ *            into *body, which the caller frees once the hit is written.
+ *            The framing headers are written into hdrs, GZIP_HDRS_MAX bytes,
+ *            and conn_hdr goes in front of the blank line.
+ */
+int gzip_iov(cache_object *object, int gzip, const char *conn_hdr,
+             char *hdrs, char **body, struct iovec *iov) {
+    char *data = object->data;
+    size_t hdr_length = object->hdr_length;
+    size_t stream_length = object->length - hdr_length - 2;
+
+    *body = NULL;
+    if (gzip)
+        snprintf(hdrs, GZIP_HDRS_MAX, "Content-Length: %zu\r\n%s",
+                 stream_length, gzip_hdr);
+    else
+        snprintf(hdrs, GZIP_HDRS_MAX, "Content-Length: %zu\r\n",
+                 object->identity_length);
+
+    iov[0].iov_base = data;
+    iov[0].iov_len = hdr_length;
+    iov[1].iov_base = hdrs;
+    iov[1].iov_len = strlen(hdrs);
+    iov[2].iov_base = (void *)conn_hdr;
+    iov[2].iov_len = strlen(conn_hdr);
+    iov[3].iov_base = data + hdr_length;
+    iov[3].iov_len = 2;
+    if (gzip) {
+        iov[4].iov_base = data + hdr_length + 2;
+        iov[4].iov_len = stream_length;
+        return 5;
+    }
+
+    *body = (char *)Malloc(object->identity_length);
+    if (gunzip(data + hdr_length + 2, stream_length, *body,
+               object->identity_length) < 0) {
+        Free(*body);
+        *body = NULL;
+        return -1;
+    }
+    iov[4].iov_base = *body;
+    iov[4].iov_len = object->identity_length;
+    return 5;
+}
+
+/*
+ * header_end - Offset of the blank line ending the headers in the first
+ *              length bytes of data, or -1 if there is none.
+ */
+static ssize_t header_end(char *data, size_t length) {
+    char *p = data, *end = data + length, *nl;
+
+    while (p < end && (nl = memchr(p, '\n', end - p)) != NULL) {
+        if (p != data && (nl == p || (nl == p + 1 && *p == '\r')))
+            return p - data;
+        p = nl + 1;
+    }
+    return -1;
+}
+
+/*
+ * packable - Check whether a response with a body of body_length bytes is
+ *            worth packing, from its status line and headers, which end at
+ *            hdr_end. The body must be complete, which a Content-Length
+ *            that doesn't match would give away.
+ */
+static int packable(char *data, size_t hdr_end, size_t body_length) {
+    char line[MAXLINE];
+    char *p, *nl;
+    size_t n;
+    int status = 0, text = 0;
+
+    if (body_length < GZIP_MIN_LENGTH)
+        return 0;
+    for (p = data; p < data + hdr_end; p = nl + 1) {
+        nl = memchr(p, '\n', data + hdr_end - p);
+        n = nl - p + 1;
+        if (n >= MAXLINE)
+            n = MAXLINE - 1;
+        memcpy(line, p, n);
+        line[n] = '\0';
+
+        if (p == data)
+            sscanf(line, "%*s %d", &status);
+        else if (!strncasecmp(line, "Content-Type:", 13))
+            text = packable_type(line + 13);
+        else if (!strncasecmp(line, "Content-Length:", 15)) {
+            if (strtoul(line + 15, NULL, 10) != body_length)
+                return 0;
+        } else if (!strncasecmp(line, "Content-Encoding:", 17) ||
+                   !strncasecmp(line, "Transfer-Encoding:", 18) ||
+                   !strncasecmp(line, "Content-Range:", 14))
+            return 0;
+        else if (!strncasecmp(line, "Cache-Control:", 14) &&
+                 header_has_token(line, "no-transform"))
+            return 0;
+    }
+    return status == 200 && text;
+}
+
+/* packable_type - Check whether a media type is text that compresses well. */
+static int packable_type(char *type) {
+    while (*type == ' ' || *type == '\t')
+        type++;
+    return !strncasecmp(type, "text/", 5) ||
+        header_has_token(type, "javascript") ||
+        header_has_token(type, "json") || header_has_token(type, "xml");
+}
+
+/* dropped_header - Check whether a stored header is left out of a packed
+ *                  object, since it is generated again on every hit.
+ */
+static int dropped_header(char *line) {
+    return !strncasecmp(line, "Content-Length:", 15) ||
+        !strncasecmp(line, "Connection:", 11) ||
+        !strncasecmp(line, "Keep-Alive:", 11) ||
+        !strncasecmp(line, "Proxy-Connection:", 17);
+}
+
+/*
+ * copy_header - Copy the header line at p, n bytes, into a packed object at
+ *               out and return the bytes written. line is the line as a
+ *               string, NULL for the status line. A strong ETag is made
+ *               weak, and Accept-Encoding is added to a Vary header that
+ *               doesn't already cover it; *vary is set once a Vary header
+ *               is seen. An ETag line grows by at most 3 bytes, less than
+ *               half its length, and only the first Vary line by more.
+ */
+static size_t copy_header(char *out, char *p, size_t n, char *line,
+                          int *vary) {
+    size_t eol = (n >= 2 && p[n - 2] == '\r') ? 2 : 1;
+    size_t skip, used;
+
+    if (line != NULL && !strncasecmp(line, "ETag:", 5)) {
+        for (skip = 5; skip < n && (p[skip] == ' ' || p[skip] == '\t');
+             skip++)
+            ;
+        if (strncmp(p + skip, "W/", 2)) {
+            memcpy(out, "ETag: W/", 8);
+            memcpy(out + 8, p + skip, n - skip);
+            return 8 + n - skip;
+        }
+    } else if (line != NULL && !strncasecmp(line, "Vary:", 5)) {
+        if (!*vary && !header_has_token(line + 5, "Accept-Encoding") &&
+            !header_has_token(line + 5, "*")) {
+            *vary = 1;
+            used = n - eol;
+            memcpy(out, p, used);
+            memcpy(out + used, ", Accept-Encoding\r\n", 19);
+            return used + 19;
+        }
+        *vary = 1;
+    }
+    memcpy(out, p, n);
+    return n;
+}
+
+/* gunzip - Inflate a gzip stream into exactly out_length bytes at out. */
+static int gunzip(char *in, size_t length, char *out, size_t out_length) {
+    z_stream zs;
+    int rc;
+
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, 15 + 16) != Z_OK)
+        return -1;
+    zs.next_in = (Bytef *)in;
+    zs.avail_in = length;
+    zs.next_out = (Bytef *)out;
+    zs.avail_out = out_length;
+    rc = inflate(&zs, Z_FINISH);
+    inflateEnd(&zs);
+    return (rc == Z_STREAM_END && zs.total_out == out_length) ? 0 : -1;
+}
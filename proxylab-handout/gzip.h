@@ -0,0 +1,21 @@
+/* Compressed object storage header file for gzip.c
+ * Author: Aleksander Bapst (abapst)
+ */
+
+#ifndef __GZIP_H__
+#define __GZIP_H__
+
+#include <sys/uio.h>
+#include "csapp.h"
+#include "cache.h"
+
+#define GZIP_MIN_LENGTH 256 // smaller bodies are stored as they are
+#define GZIP_HDRS_MAX 128   // framing headers added to a packed object's hit
+#define GZIP_IOV_MAX 5      // pieces of a hit on a packed object
+
+char *gzip_response(char *data, size_t *length, size_t *hdr_length,
+                    size_t *identity_length);
+int gzip_iov(cache_object *object, int gzip, const char *conn_hdr,
+             char *hdrs, char **body, struct iovec *iov);
+
+#endif /* __GZIP_H__ */
@@ -0,0 +1,919 @@
+/* HTTP request helpers for Proxylab, CMU 15-213/513, Fall 2015
+ * Author: Aleksander Bapst (abapst)
+ *
+ * Tokenizes a client's request head and rewrites it into the request that
+ * is forwarded to the host. These routines only work on buffers, so they
+ * are shared by the threaded engine, which reads the request with Rio, and
+ * the event engine, which collects it from a non-blocking socket.
+ *
+ * The head is tokenized in a single pass, one line at a time, in the buffer
+ * it was read into: the request line is split into spans for the method,
+ * host, port and path, and each header line is classified by its name and
+ * recorded as a span if it is forwarded. Nothing is copied. The forwarded
+ * request is then emitted as an iovec array of those spans and a few
+ * constant strings, which the threaded engine hands to a single writev and
+ * the event engine flattens into one buffer. The cache id, of the form
+ * "GET host:port /path", is assembled from the same spans.
+ *
+ * The request line, Host and Connection headers are always generated by
+ * the proxy; the client's own versions of these hop-by-hop headers are
+ * dropped. A request is either sent as HTTP/1.1 with keep-alive, so that
+ * the connection to the host can be pooled, or as HTTP/1.0 with
+ * Connection: close. Only requests from HTTP/1.1 clients are sent as
+ * HTTP/1.1, since the host may then answer with a chunked body, which an
+ * HTTP/1.0 client can't read.
+ *
+ * The client's If-None-Match and If-Modified-Since headers are not
+ * forwarded, so the host always sends a full response that can be cached.
+ * They are noted instead, and a hit whose cached response still matches
+ * them is answered with a 304 made by head_not_modified. The proxy adds its
+ * own conditional headers when it revalidates a stale cached response,
+ * using the validators saved with the response. How long a response stays fresh
+ * is worked out from its Cache-Control, Expires, Date, Age and
+ * Last-Modified headers, roughly as RFC 7234 describes for a shared cache.
+ *
+ * When the cache stores responses gzipped itself (see gzip.c), the
+ * client's Accept-Encoding is only noted and not forwarded, so that hosts
+ * send the identity coding.
+ *
+ * A single byte range in a Range header is noted as well. The proxy may
+ * then drop the header, fetch the whole object so it can be cached, and
+ * answer with a 206 slice of it, made by head_slice. Ranges it doesn't
+ * serve itself, multiple ranges and ranges under If-Range among them, are
+ * forwarded as they are, and the 206 the host answers is never cached.
+ */
+
+#include "http.h"
+
+/* You won't lose style points for including this long line in your code */
+static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
+static const char *connection_hdr = "Connection: close\r\n";
+static const char *keep_alive_hdr = "Connection: keep-alive\r\n";
+static const char *host_hdr_prefix = "Host: ";
+static const char *proxy_connection_hdr = "Proxy-Connection: close\r\n";
+static const char *http_version = " HTTP/1.0\r\n";
+static const char *http_version_11 = " HTTP/1.1\r\n";
+static const char *if_none_match_hdr = "If-None-Match:";
+static const char *if_modified_since_hdr = "If-Modified-Since:";
+static const char *default_port = "80";
+static const char *default_path = "/";
+
+/* What happens to a client header line */
+#define HDR_FORWARD    0 // forwarded as is
+#define HDR_DROP       1 // generated by the proxy, or hop-by-hop
+#define HDR_CONNECTION 2 // dropped, but decides whether the client persists
+#define HDR_USER_AGENT 3 // replaced by our own
+#define HDR_ACCEPT_ENCODING 4 // forwarded unless the proxy does the coding
+#define HDR_RANGE      5 // forwarded unless the proxy cuts the range itself
+#define HDR_IF_RANGE   6 // forwarded with Range, which is then never cut
+#define HDR_IF_NONE_MATCH 7 // noted to answer hits with a 304
+#define HDR_IF_MODIFIED_SINCE 8 // noted like If-None-Match
+
+static int request_line(request_head *head, char *line, size_t len);
+static int classify_header(char *name, size_t len);
+static int span_has_token(char *p, size_t len, const char *token);
+static int span_accepts(char *p, size_t len, const char *coding);
+static int span_range(char *p, size_t len, long *first, long *last);
+static int span_etag_match(char *p, size_t len, char *tag, size_t tag_len);
+static void set_span(struct iovec *iov, const char *p, size_t len);
+static char *find_token(char *buf, const char *token);
+static long token_value(char *buf, const char *token);
+static time_t parse_date(char *buf);
+static char *next_line(char *p, char *end, char *line);
+static int cacheable_status(int status);
+
+/* head_init - Get ready to tokenize a new request head. */
+void head_init(request_head *head) {
+    head->started = 0;
+    head->local = 0;
+    head->keep_alive = 0;
+    head->http11 = 0;
+    head->accept_gzip = 0;
+    head->identity = 0;
+    set_span(&head->accept_encoding, NULL, 0);
+    set_span(&head->range, NULL, 0);
+    set_span(&head->if_range, NULL, 0);
+    set_span(&head->if_none_match, NULL, 0);
+    set_span(&head->if_modified_since, NULL, 0);
+    head->ranged = 0;
+    head->range_first = head->range_last = -1;
+    head->slice = 0;
+    head->nheaders = 0;
+    head->nvalidators = 0;
+}
+
+/*
+ * head_line - Tokenize the next line of a request head, len bytes at line
+ *             ending in a newline. The line must stay where it is until the
+ *             request has been forwarded. Returns 1 once the blank line
+ *             ending the head has been seen, 0 if more lines may follow, and
+ *             -1 if the request can't be forwarded: it isn't a GET, is
+ *             malformed, or has too many headers.
+ */
+int head_line(request_head *head, char *line, size_t len) {
+    char *colon;
+    int kind;
+
+    if (len == 0 || line[len - 1] != '\n')
+        return -1; /* Longer than the buffer it was read into */
+    if (!head->started)
+        return request_line(head, line, len);
+    if (len == 1 || (len == 2 && line[0] == '\r')) {
+        head->ranged = (head->range.iov_len > 0 &&
+                        head->if_range.iov_len == 0 &&
+                        span_range(head->range.iov_base, head->range.iov_len,
+                                   &head->range_first, &head->range_last));
+        return 1;
+    }
+
+    /* The name alone decides what happens to a header */
+    colon = memchr(line, ':', len);
+    kind = colon ? classify_header(line, colon - line) : HDR_FORWARD;
+    if (kind == HDR_DROP)
+        return 0;
+    if (kind == HDR_CONNECTION) {
+        if (span_has_token(colon, line + len - colon, "close"))
+            head->keep_alive = 0;
+        else if (span_has_token(colon, line + len - colon, "keep-alive"))
+            head->keep_alive = 1;
+        return 0;
+    }
+    if (kind == HDR_ACCEPT_ENCODING) {
+        head->accept_gzip = span_accepts(colon + 1, line + len - (colon + 1),
+                                         "gzip");
+        set_span(&head->accept_encoding, line, len);
+        return 0;
+    }
+    if (kind == HDR_RANGE) {
+        set_span(&head->range, line, len);
+        return 0;
+    }
+    if (kind == HDR_IF_RANGE) {
+        set_span(&head->if_range, line, len);
+        return 0;
+    }
+    if (kind == HDR_IF_NONE_MATCH) {
+        set_span(&head->if_none_match, line, len);
+        return 0;
+    }
+    if (kind == HDR_IF_MODIFIED_SINCE) {
+        set_span(&head->if_modified_since, line, len);
+        return 0;
+    }
+
+    if (head->nheaders == MAX_HEADERS)
+        return -1;
+    if (kind == HDR_USER_AGENT)
+        set_span(&head->headers[head->nheaders++], user_agent_hdr,
+                 strlen(user_agent_hdr));
+    else
+        set_span(&head->headers[head->nheaders++], line, len);
+    return 0;
+}
+
+/*
+ * head_host - Copy the host name and port (80 if none is given) of a
+ *             tokenized request into NUL-terminated MAXLINE buffers.
+ */
+int head_host(request_head *head, char *hostname, char *host_port) {
+    if (head->host.iov_len >= MAXLINE || head->port.iov_len >= MAXLINE)
+        return -1;
+    memcpy(hostname, head->host.iov_base, head->host.iov_len);
+    hostname[head->host.iov_len] = '\0';
+    memcpy(host_port, head->port.iov_base, head->port.iov_len);
+    host_port[head->port.iov_len] = '\0';
+    return 0;
+}
+
+/*
+ * head_cache_id - Compose the cache id "GET host:port /path" of a tokenized
+ *                 request in a MAXLINE buffer. Returns -1 if it won't fit.
+ */
+int head_cache_id(request_head *head, char *cache_id) {
+    struct iovec *parts[4] = { &head->method, &head->host, &head->port,
+                               &head->path };
+    const char seps[4] = { ' ', ':', ' ', '\0' };
+    size_t len = 0;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        if (len + parts[i]->iov_len + 1 >= MAXLINE)
+            return -1;
+        memcpy(cache_id + len, parts[i]->iov_base, parts[i]->iov_len);
+        len += parts[i]->iov_len;
+        cache_id[len++] = seps[i];
+    }
+    return 0;
+}
+
+/*
+ * head_validators - Make the request conditional on the stored response in
+ *                   data, whose headers end at a blank line or after length
+ *                   bytes: its ETag is sent back in If-None-Match and its
+ *                   Last-Modified date in If-Modified-Since. The values are
+ *                   referenced in place, so the response must stay pinned
+ *                   until the request has been forwarded. Returns the number
+ *                   of validators added.
+ */
+int head_validators(request_head *head, char *data, size_t length) {
+    char *p = data, *end = data + length, *nl;
+    const char *name;
+    size_t skip;
+
+    head->nvalidators = 0;
+    while (p < end && (nl = memchr(p, '\n', end - p)) != NULL) {
+        if (nl - p <= 1) /* Blank line */
+            break;
+        if (!strncasecmp(p, "ETag:", 5)) {
+            name = if_none_match_hdr;
+            skip = 5;
+        } else if (!strncasecmp(p, "Last-Modified:", 14)) {
+            name = if_modified_since_hdr;
+            skip = 14;
+        } else {
+            p = nl + 1;
+            continue;
+        }
+        if (head->nvalidators == MAX_VALIDATORS)
+            break;
+        set_span(&head->validators[2 * head->nvalidators], name,
+                 strlen(name));
+        set_span(&head->validators[2 * head->nvalidators + 1], p + skip,
+                 nl + 1 - (p + skip));
+        head->nvalidators++;
+        p = nl + 1;
+    }
+    return head->nvalidators;
+}
+
+/*
+ * head_iov - Split the request to forward into iov, which has room for
+ *            HEAD_IOV_MAX pieces, and return the number of pieces. If
+ *            keep_alive is set the request asks for a persistent HTTP/1.1
+ *            connection.
+ */
+int head_iov(request_head *head, struct iovec *iov, int keep_alive) {
+    int i, n = 0;
+
+    /* Request line */
+    iov[n++] = head->method;
+    set_span(&iov[n++], " ", 1);
+    iov[n++] = head->path;
+    if (keep_alive)
+        set_span(&iov[n++], http_version_11, strlen(http_version_11));
+    else
+        set_span(&iov[n++], http_version, strlen(http_version));
+
+    /* Host and Connection headers */
+    set_span(&iov[n++], host_hdr_prefix, strlen(host_hdr_prefix));
+    iov[n++] = head->host;
+    if (head->port.iov_len != 2 || memcmp(head->port.iov_base, "80", 2)) {
+        set_span(&iov[n++], ":", 1);
+        iov[n++] = head->port;
+    }
+    set_span(&iov[n++], "\r\n", 2);
+    if (keep_alive) {
+        set_span(&iov[n++], keep_alive_hdr, strlen(keep_alive_hdr));
+    } else {
+        set_span(&iov[n++], connection_hdr, strlen(connection_hdr));
+        set_span(&iov[n++], proxy_connection_hdr,
+                 strlen(proxy_connection_hdr));
+    }
+
+    /* The client's headers, our validators and the blank line */
+    if (head->accept_encoding.iov_len > 0 && !head->identity)
+        iov[n++] = head->accept_encoding;
+    if (head->range.iov_len > 0 && !head->slice)
+        iov[n++] = head->range;
+    if (head->if_range.iov_len > 0 && !head->slice)
+        iov[n++] = head->if_range;
+    for (i = 0; i < head->nheaders; i++)
+        iov[n++] = head->headers[i];
+    for (i = 0; i < 2 * head->nvalidators; i++)
+        iov[n++] = head->validators[i];
+    set_span(&iov[n++], "\r\n", 2);
+    return n;
+}
+
+/*
+ * head_slice - Make the head of a 206 answer to the ranged request head
+ *              from a whole 200 response: its status line and headers,
+ *              hdr_length bytes at data, followed by a body of body_length
+ *              bytes. The Content-Length is replaced by that of the range,
+ *              a Content-Range is added, the hop-by-hop headers are
+ *              dropped, and conn_hdr and the blank line end the head,
+ *              which is written to buf. *first and *count are
+ *              set to the part of the body that follows it. Returns the
+ *              length of the head, or -1 if the range can't be cut out of
+ *              the response and the whole of it should be sent instead:
+ *              it isn't a 200 with a plain body, the range lies past its
+ *              end, or the head doesn't fit in size bytes.
+ */
+ssize_t head_slice(request_head *head, char *data, size_t hdr_length,
+                   size_t body_length, const char *conn_hdr, char *buf,
+                   size_t size, size_t *first, size_t *count) {
+    char *p = data, *end = data + hdr_length, *nl;
+    size_t len, last;
+    int status = 0, n;
+
+    if (!head->ranged || body_length == 0)
+        return -1;
+    if (head->range_first < 0) {
+        if (head->range_last == 0)
+            return -1;
+        *first = ((size_t)head->range_last < body_length) ?
+                 body_length - head->range_last : 0;
+        last = body_length - 1;
+    } else {
+        if ((size_t)head->range_first >= body_length)
+            return -1;
+        *first = head->range_first;
+        last = (head->range_last < 0 ||
+                (size_t)head->range_last >= body_length) ?
+               body_length - 1 : (size_t)head->range_last;
+    }
+    *count = last - *first + 1;
+
+    /* The status line, then every header but Content-Length and the
+     * Connection headers the event engine stores
+     */
+    if ((nl = memchr(p, '\n', end - p)) == NULL ||
+        sscanf(p, "%*s %d", &status) != 1 || status != 200)
+        return -1;
+    n = snprintf(buf, size, "HTTP/1.1 206 Partial Content\r\n");
+    len = n;
+    for (p = nl + 1; p < end && (nl = memchr(p, '\n', end - p)) != NULL;
+         p = nl + 1) {
+        if (!strncasecmp(p, "Transfer-Encoding:", 18))
+            return -1;
+        if (!strncasecmp(p, "Content-Length:", 15) ||
+            !strncasecmp(p, "Connection:", 11) ||
+            !strncasecmp(p, "Keep-Alive:", 11) ||
+            !strncasecmp(p, "Proxy-Connection:", 17))
+            continue;
+        if (len + (nl + 1 - p) >= size)
+            return -1;
+        memcpy(buf + len, p, nl + 1 - p);
+        len += nl + 1 - p;
+    }
+    n = snprintf(buf + len, size - len, "Content-Range: bytes %zu-%zu/%zu\r\n"
+                 "Content-Length: %zu\r\n%s\r\n", *first, last, body_length,
+                 *count, conn_hdr);
+    if (n < 0 || len + n >= size)
+        return -1;
+    return len + n;
+}
+
+/*
+ * head_not_modified - Make the head of a 304 answer to the conditional
+ *                     request head from a cached 200 response, whose status
+ *                     line and headers are hdr_length bytes at data, if the
+ *                     client's copy of it is still current: If-None-Match
+ *                     is "*" or lists the response's ETag, compared weakly,
+ *                     or, without If-None-Match, the response's
+ *                     Last-Modified date is no later than If-Modified-Since.
+ *                     Only the headers a 304 carries are kept, and conn_hdr
+ *                     and the blank line end the head, which is written to
+ *                     buf. Returns the length of the head, or -1 if the
+ *                     whole response should be sent instead.
+ */
+ssize_t head_not_modified(request_head *head, char *data, size_t hdr_length,
+                          const char *conn_hdr, char *buf, size_t size) {
+    char line[MAXLINE], date[MAXLINE];
+    char *p, *start, *end = data + hdr_length, *etag = NULL;
+    size_t len, etag_len = 0;
+    time_t modified = -1, since;
+    int status = 0, match, n;
+
+    if (head->if_none_match.iov_len == 0 &&
+        head->if_modified_since.iov_len == 0)
+        return -1;
+    if ((p = next_line(data, end, line)) == NULL ||
+        sscanf(line, "%*s %d", &status) != 1 || status != 200)
+        return -1;
+
+    /* The status line, then the headers RFC 9110 has a 304 repeat */
+    n = snprintf(buf, size, "HTTP/1.1 304 Not Modified\r\n");
+    len = n;
+    for (start = p; (p = next_line(start, end, line)) != NULL; start = p) {
+        if (!strncasecmp(line, "ETag:", 5)) {
+            /* The tag is looked at in place, where it isn't cut short */
+            etag = start + 5 + strspn(start + 5, " \t");
+            for (etag_len = p - etag; etag_len > 0 &&
+                 strchr(" \t\r\n", etag[etag_len - 1]); etag_len--)
+                ;
+        } else if (!strncasecmp(line, "Last-Modified:", 14)) {
+            modified = parse_date(line + 14);
+        } else if (strncasecmp(line, "Cache-Control:", 14) &&
+                   strncasecmp(line, "Content-Location:", 17) &&
+                   strncasecmp(line, "Date:", 5) &&
+                   strncasecmp(line, "Expires:", 8) &&
+                   strncasecmp(line, "Vary:", 5)) {
+            continue;
+        }
+        if (len + strlen(line) >= size)
+            return -1;
+        memcpy(buf + len, line, strlen(line));
+        len += strlen(line);
+    }
+
+    if (head->if_none_match.iov_len > 0) {
+        match = etag != NULL &&
+                span_etag_match(head->if_none_match.iov_base,
+                                head->if_none_match.iov_len, etag, etag_len);
+    } else {
+        n = (head->if_modified_since.iov_len < MAXLINE) ?
+            head->if_modified_since.iov_len : MAXLINE - 1;
+        memcpy(date, head->if_modified_since.iov_base, n);
+        date[n] = '\0';
+        since = parse_date(date + 18); /* After "If-Modified-Since:" */
+        match = modified >= 0 && since >= 0 && modified <= since;
+    }
+    if (!match)
+        return -1;
+    n = snprintf(buf + len, size - len, "%s\r\n", conn_hdr);
+    if (n < 0 || len + n >= size)
+        return -1;
+    return len + n;
+}
+
+/*
+ * head_compose - Write the request to forward into buf, NUL-terminated, and
+ *                return its length, or -1 if it doesn't fit in size bytes.
+ */
+ssize_t head_compose(request_head *head, int keep_alive, char *buf,
+                     size_t size) {
+    struct iovec iov[HEAD_IOV_MAX];
+    int i, n = head_iov(head, iov, keep_alive);
+    size_t len = 0;
+
+    for (i = 0; i < n; i++) {
+        if (len + iov[i].iov_len >= size)
+            return -1;
+        memcpy(buf + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+/*
+ * header_has_token - Check whether a header line contains token, ignoring
+ *                    case, e.g. "chunked" in a Transfer-Encoding header.
+ */
+int header_has_token(char *buf, const char *token) {
+    return find_token(buf, token) != NULL;
+}
+
+/*
+ * request_keep_alive - Default persistence of a connection from the version
+ *                      in a request or status line in buf: HTTP/1.1 and later
+ *                      connections persist, HTTP/1.0 connections don't.
+ */
+int request_keep_alive(char *buf) {
+    char *version = strstr(buf, "HTTP/1.");
+
+    return version != NULL && version[7] >= '1' && version[7] <= '9';
+}
+
+/*
+ * connection_keep_alive - Update a persistence decision with the header line
+ *                         in buf. A Connection or Proxy-Connection header
+ *                         with "close" or "keep-alive" overrides keep_alive,
+ *                         any other line leaves it unchanged.
+ */
+int connection_keep_alive(char *buf, int keep_alive) {
+    if (strncasecmp(buf, "Connection:", 11) &&
+        strncasecmp(buf, "Proxy-Connection:", 17))
+        return keep_alive;
+    if (header_has_token(buf, "close"))
+        return 0;
+    if (header_has_token(buf, "keep-alive"))
+        return 1;
+    return keep_alive;
+}
+
+/* freshness_init - Start collecting the freshness of a response. */
+void freshness_init(freshness *f, int status) {
+    f->status = status;
+    f->max_age = f->s_maxage = -1;
+    f->age = 0;
+    f->date = f->expires = f->last_modified = -1;
+    f->no_store = f->no_cache = f->validator = 0;
+    f->must_revalidate = 0;
+    f->stale_while_revalidate = -1;
+}
+
+/*
+ * freshness_header - Record what the response header line in buf says about
+ *                    freshness. A later header overrides an earlier one, so
+ *                    the headers of a 304 can be fed in after those of the
+ *                    response it refreshes.
+ */
+void freshness_header(freshness *f, char *buf) {
+    time_t t;
+
+    if (!strncasecmp(buf, "Cache-Control:", 14)) {
+        if (header_has_token(buf, "no-store") ||
+            header_has_token(buf, "private"))
+            f->no_store = 1;
+        if (header_has_token(buf, "no-cache"))
+            f->no_cache = 1;
+        if (header_has_token(buf, "s-maxage="))
+            f->s_maxage = token_value(buf, "s-maxage=");
+        if (header_has_token(buf, "max-age="))
+            f->max_age = token_value(buf, "max-age=");
+        if (header_has_token(buf, "must-revalidate") ||
+            header_has_token(buf, "proxy-revalidate"))
+            f->must_revalidate = 1;
+        if (header_has_token(buf, "stale-while-revalidate="))
+            f->stale_while_revalidate =
+                token_value(buf, "stale-while-revalidate=");
+    } else if (!strncasecmp(buf, "Pragma:", 7)) {
+        if (header_has_token(buf, "no-cache"))
+            f->no_cache = 1;
+    } else if (!strncasecmp(buf, "Expires:", 8)) {
+        /* An invalid date, like 0, means already expired */
+        f->expires = ((t = parse_date(buf + 8)) < 0) ? 0 : t;
+    } else if (!strncasecmp(buf, "Date:", 5)) {
+        f->date = parse_date(buf + 5);
+    } else if (!strncasecmp(buf, "Age:", 4)) {
+        f->age = strtol(buf + 4, NULL, 10);
+    } else if (!strncasecmp(buf, "Last-Modified:", 14)) {
+        f->last_modified = parse_date(buf + 14);
+        f->validator = 1;
+    } else if (!strncasecmp(buf, "ETag:", 5)) {
+        f->validator = 1;
+    }
+}
+
+/*
+ * freshness_scan - Collect the freshness of a stored response from its
+ *                  status line and headers, which end at a blank line or
+ *                  after length bytes.
+ */
+void freshness_scan(freshness *f, char *data, size_t length) {
+    char line[MAXLINE];
+    char *p, *end = data + length;
+    int status = 0;
+
+    freshness_init(f, 0);
+    if ((p = next_line(data, end, line)) == NULL)
+        return;
+    sscanf(line, "%*s %d", &status);
+    f->status = status;
+    while ((p = next_line(p, end, line)) != NULL)
+        freshness_header(f, line);
+}
+
+/*
+ * freshness_expiry - Return the time at which a response received at now
+ *                    goes stale, or -1 if it must not be cached. The
+ *                    lifetime comes from s-maxage, max-age, Expires, or else
+ *                    a tenth of the time since Last-Modified, and defaults
+ *                    to DEF_LIFETIME. A response that is stale on arrival is
+ *                    only worth storing if it can be revalidated.
+ */
+time_t freshness_expiry(freshness *f, time_t now) {
+    time_t base = (f->date >= 0) ? f->date : now;
+    long lifetime;
+
+    if (f->no_store || !cacheable_status(f->status))
+        return -1;
+
+    if (f->s_maxage >= 0)
+        lifetime = f->s_maxage;
+    else if (f->max_age >= 0)
+        lifetime = f->max_age;
+    else if (f->expires >= 0)
+        lifetime = f->expires - base;
+    else if (f->last_modified >= 0) {
+        lifetime = (base - f->last_modified) / 10;
+        if (lifetime > MAX_HEURISTIC)
+            lifetime = MAX_HEURISTIC;
+    } else
+        lifetime = DEF_LIFETIME;
+
+    if (f->no_cache)
+        lifetime = 0;
+    lifetime -= f->age;
+    if (lifetime <= 0) {
+        if (!f->validator)
+            return -1;
+        lifetime = 0;
+    }
+    return now + lifetime;
+}
+
+/*
+ * freshness_stale_window - Return how many seconds past its expiry a
+ *                          response may still be served while it is
+ *                          revalidated in the background: as many as its
+ *                          stale-while-revalidate allows, or else window.
+ *                          A response that must be revalidated before it
+ *                          is served stale, or on every use, gets none.
+ */
+long freshness_stale_window(freshness *f, long window) {
+    if (f->no_cache || f->must_revalidate)
+        return 0;
+    return (f->stale_while_revalidate >= 0) ? f->stale_while_revalidate
+                                            : window;
+}
+
+/*
+ * request_line - Split the request line into spans for the method, the host,
+ *                port and path of the absolute URL, and find the version.
+ *                A request with only a path was sent to the proxy itself.
+ *                The only supported method is GET. HTTP/1.1 clients persist
+ *                by default, HTTP/1.0 ones don't.
+ */
+static int request_line(request_head *head, char *line, size_t len) {
+    char *p = line, *end = line + len, *url, *url_end, *host, *host_end;
+    char *colon;
+
+    head->started = 1;
+
+    /* Method */
+    while (p < end && *p != ' ')
+        p++;
+    set_span(&head->method, line, p - line);
+    if (p - line != 3 || strncasecmp(line, "GET", 3))
+        return -1;
+
+    /* URL, then the version */
+    while (p < end && *p == ' ')
+        p++;
+    url = p;
+    while (p < end && *p != ' ' && *p != '\r' && *p != '\n')
+        p++;
+    url_end = p;
+    while (p < end && *p == ' ')
+        p++;
+    if (p == end || *p == '\r' || *p == '\n')
+        return -1;
+    head->http11 = (end - p > 8 && !strncmp(p, "HTTP/1.", 7) &&
+                    p[7] >= '1' && p[7] <= '9');
+    head->keep_alive = head->http11;
+
+    /* A path alone is a request for the proxy itself, e.g. its stats */
+    if (url < url_end && *url == '/') {
+        head->local = 1;
+        set_span(&head->path, url, url_end - url);
+        set_span(&head->host, NULL, 0);
+        set_span(&head->port, NULL, 0);
+        return 0;
+    }
+
+    /* scheme://host[:port][/path] */
+    for (host = url; host + 3 <= url_end && strncmp(host, "://", 3); host++)
+        ;
+    if (host + 3 > url_end || host == url)
+        return -1;
+    host += 3;
+    for (host_end = host; host_end < url_end && *host_end != '/'; host_end++)
+        ;
+    if ((colon = memchr(host, ':', host_end - host)) != NULL) {
+        set_span(&head->host, host, colon - host);
+        set_span(&head->port, colon + 1, host_end - (colon + 1));
+    } else {
+        set_span(&head->host, host, host_end - host);
+        set_span(&head->port, default_port, strlen(default_port));
+    }
+    if (host_end < url_end)
+        set_span(&head->path, host_end, url_end - host_end);
+    else
+        set_span(&head->path, default_path, 1);
+    if (head->host.iov_len == 0 || head->port.iov_len == 0)
+        return -1;
+    return 0;
+}
+
+/*
+ * classify_header - Decide what happens to a client header from its name,
+ *                   len bytes at name. Only names of the right length are
+ *                   compared.
+ */
+static int classify_header(char *name, size_t len) {
+    switch (len) {
+    case 4:
+        if (!strncasecmp(name, "Host", 4))
+            return HDR_DROP;
+        break;
+    case 5:
+        if (!strncasecmp(name, "Range", 5))
+            return HDR_RANGE;
+        break;
+    case 8:
+        if (!strncasecmp(name, "If-Range", 8))
+            return HDR_IF_RANGE;
+        break;
+    case 10:
+        if (!strncasecmp(name, "Connection", 10))
+            return HDR_CONNECTION;
+        if (!strncasecmp(name, "Keep-Alive", 10))
+            return HDR_DROP;
+        if (!strncasecmp(name, "User-Agent", 10))
+            return HDR_USER_AGENT;
+        break;
+    case 13:
+        if (!strncasecmp(name, "If-None-Match", 13))
+            return HDR_IF_NONE_MATCH;
+        break;
+    case 15:
+        if (!strncasecmp(name, "Accept-Encoding", 15))
+            return HDR_ACCEPT_ENCODING;
+        break;
+    case 16:
+        if (!strncasecmp(name, "Proxy-Connection", 16))
+            return HDR_CONNECTION;
+        break;
+    case 17:
+        if (!strncasecmp(name, "If-Modified-Since", 17))
+            return HDR_IF_MODIFIED_SINCE;
+        break;
+    }
+    return HDR_FORWARD;
+}
+
+/* span_has_token - header_has_token for len bytes at p. */
+static int span_has_token(char *p, size_t len, const char *token) {
+    size_t tlen = strlen(token);
+    char *end = p + len;
+
+    for (; p + tlen <= end; p++)
+        if (!strncasecmp(p, token, tlen))
+            return 1;
+    return 0;
+}
+
+/*
+ * span_accepts - Check whether an Accept-Encoding value, len bytes at p,
+ *                accepts coding: it is listed without a q of 0.
+ */
+static int span_accepts(char *p, size_t len, const char *coding) {
+    size_t clen = strlen(coding);
+    char *end = p + len, *q;
+
+    for (; p + clen <= end; p++) {
+        if (strncasecmp(p, coding, clen))
+            continue;
+        /* A q value of 0, 0.0 and so on refuses the coding */
+        for (q = p + clen; q < end && (*q == ' ' || *q == ';'); q++)
+            ;
+        if (end - q < 2 || strncasecmp(q, "q=", 2))
+            return 1;
+        for (q += 2; q < end && (*q == '0' || *q == '.'); q++)
+            ;
+        return q < end && *q >= '1' && *q <= '9';
+    }
+    return 0;
+}
+
+/*
+ * span_range - Parse a Range header line, len bytes at p, that asks for a
+ *              single byte range: "bytes=first-last", "bytes=first-" or
+ *              the suffix "bytes=-length". *last is -1 if open-ended, and
+ *              for a suffix *first is -1 and *last its length. Returns 0
+ *              for anything else, which isn't served from the cache.
+ */
+static int span_range(char *p, size_t len, long *first, long *last) {
+    char value[MAXLINE], *q, *dash, *end;
+
+    if ((q = memchr(p, ':', len)) == NULL ||
+        (size_t)(p + len - q) >= sizeof(value))
+        return 0;
+    memcpy(value, q + 1, p + len - (q + 1));
+    value[p + len - (q + 1)] = '\0';
+    for (q = value; *q == ' ' || *q == '\t'; q++)
+        ;
+    if (strncasecmp(q, "bytes=", 6) || strchr(q, ',') != NULL ||
+        (dash = strchr(q + 6, '-')) == NULL)
+        return 0;
+    q += 6;
+
+    *first = *last = -1;
+    if (dash > q) {
+        *first = strtol(q, &end, 10);
+        if (end != dash || *first < 0)
+            return 0;
+    }
+    q = dash + 1;
+    if (*q >= '0' && *q <= '9') {
+        *last = strtol(q, &end, 10);
+        if (*first >= 0 && *last < *first)
+            return 0;
+    } else
+        end = q;
+    for (; *end == ' ' || *end == '\t' || *end == '\r' || *end == '\n';
+         end++)
+        ;
+    return *end == '\0' && (*first >= 0 || *last >= 0);
+}
+
+/*
+ * span_etag_match - Check whether the If-None-Match header line, len bytes
+ *                   at p, is "*" or lists the entity tag tag_len bytes at
+ *                   tag. Tags are compared weakly: a W/ prefix on either
+ *                   side is ignored.
+ */
+static int span_etag_match(char *p, size_t len, char *tag, size_t tag_len) {
+    char *end = p + len, *close;
+
+    if (tag_len > 2 && !strncmp(tag, "W/", 2)) {
+        tag += 2;
+        tag_len -= 2;
+    }
+    for (p = memchr(p, ':', len) + 1; p < end; p++) {
+        if (*p == '*')
+            return 1;
+        if (end - p > 2 && !strncmp(p, "W/", 2))
+            p += 2;
+        if (*p != '"' || (close = memchr(p + 1, '"', end - (p + 1))) == NULL)
+            continue;
+        if ((size_t)(close + 1 - p) == tag_len && !memcmp(p, tag, tag_len))
+            return 1;
+        p = close;
+    }
+    return 0;
+}
+
+/* set_span - Point an iovec at len bytes at p. */
+static void set_span(struct iovec *iov, const char *p, size_t len) {
+    iov->iov_base = (void *)p;
+    iov->iov_len = len;
+}
+
+/* find_token - Find token in a header line, ignoring case, or return NULL. */
+static char *find_token(char *buf, const char *token) {
+    size_t len = strlen(token);
+    char *p;
+
+    for (p = buf; *p; p++)
+        if (!strncasecmp(p, token, len))
+            return p;
+    return NULL;
+}
+
+/* token_value - Number after a token such as "max-age=" in a header line. */
+static long token_value(char *buf, const char *token) {
+    char *p = find_token(buf, token);
+
+    return (p != NULL) ? strtol(p + strlen(token), NULL, 10) : -1;
+}
+
+/*
+ * parse_date - Parse an HTTP date such as "Sun, 06 Nov 1994 08:49:37 GMT"
+ *              into seconds since the epoch, or return -1.
+ */
+static time_t parse_date(char *buf) {
+    static const char *months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    char month[4];
+    char *m;
+    struct tm tm;
+
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(buf, " %*[A-Za-z], %d %3s %d %d:%d:%d", &tm.tm_mday, month,
+               &tm.tm_year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+        return -1;
+    if (strlen(month) != 3 || (m = strstr(months, month)) == NULL ||
+        (m - months) % 3)
+        return -1;
+    tm.tm_mon = (m - months) / 3;
+    tm.tm_year -= 1900;
+    return timegm(&tm);
+}
+
+/*
+ * next_line - Copy the line starting at p into line, unless it is the blank
+ *             line ending the headers or runs past end. Returns where the
+ *             next line starts, or NULL once the headers are done.
+ */
+static char *next_line(char *p, char *end, char *line) {
+    char *nl;
+    size_t len;
+
+    if (p >= end || (nl = memchr(p, '\n', end - p)) == NULL)
+        return NULL;
+    len = nl - p + 1;
+    if (len == 1 || (len == 2 && *p == '\r'))
+        return NULL;
+    if (len >= MAXLINE)
+        len = MAXLINE - 1;
+    memcpy(line, p, len);
+    line[len] = '\0';
+    return nl + 1;
+}
+
+/*
+ * cacheable_status - Check whether responses with this status are cached:
+ *                    those cacheable by default (RFC 7231), except 204
+ *                    and partial 206 responses.
+ */
+static int cacheable_status(int status) {
+    switch (status) {
+    case 200: case 203: case 300: case 301: case 404: case 405:
+    case 410: case 414: case 501:
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,97 @@
+/* HTTP helpers header file for http.c
+ * Author: Aleksander Bapst (abapst)
+ */
+
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include <time.h>
+#include <sys/uio.h>
+#include "csapp.h"
+
+#define MAX_HEADERS 64        // client header lines forwarded per request
+#define MAX_VALIDATORS 2      // conditional headers added to a request
+
+/* Most pieces head_iov can split a request into: 13 for the request line,
+ * Host, Connection, Accept-Encoding and the blank line, 2 for Range and
+ * If-Range, and the client's headers and our validators
+ */
+#define HEAD_IOV_MAX (15 + MAX_HEADERS + 2 * MAX_VALIDATORS)
+
+#define DEF_LIFETIME 300      // seconds a response without freshness
+                              // information is fresh
+#define MAX_HEURISTIC 86400   // cap on a lifetime guessed from Last-Modified
+
+/* A client's request head, tokenized in place. Every span points into the
+ * buffer the head was read into, or at a constant string.
+ */
+typedef struct request_head {
+
+    int started; // the request line has been read
+    int local; // for the proxy itself: a path without scheme and host
+    int keep_alive; // the client connection persists after this request
+    int http11; // the client speaks HTTP/1.1 or later, and so takes chunked
+                // responses
+    int accept_gzip; // the client accepts gzip content coding
+    int identity; // set to ask the host for the identity coding only
+    struct iovec method, path, host, port; // from the request line
+    struct iovec accept_encoding; // the client's header, forwarded unless
+                                  // identity is set
+    struct iovec range, if_range; // the client's headers, forwarded unless
+                                  // slice is set
+    struct iovec if_none_match, if_modified_since; // the client's headers,
+                                                   // answered from the cache
+    int ranged; // a single byte range was asked for, without If-Range
+    long range_first; // first byte of the range, -1 for a suffix
+    long range_last; // last byte, -1 for open-ended, or the suffix length
+    int slice; // set to fetch the whole object and cut the range out of it
+    int nheaders;
+    struct iovec headers[MAX_HEADERS]; // header lines forwarded, with CRLF
+    int nvalidators;
+    struct iovec validators[2 * MAX_VALIDATORS]; // names and stored values
+
+} request_head;
+
+/* Freshness information collected from a response's headers */
+typedef struct freshness {
+
+    int status; // response status code
+    long max_age; // Cache-Control max-age, -1 if absent
+    long s_maxage; // Cache-Control s-maxage, -1 if absent
+    long age; // Age header, 0 if absent
+    time_t date; // Date header, -1 if absent
+    time_t expires; // Expires header, -1 if absent, 0 if invalid
+    time_t last_modified; // Last-Modified header, -1 if absent
+    int no_store; // no-store or private, never cached
+    int no_cache; // cached, but revalidated on every use
+    int must_revalidate; // never served stale, must-revalidate or
+                         // proxy-revalidate
+    long stale_while_revalidate; // seconds it may be served stale while
+                                 // revalidated, -1 if absent
+    int validator; // has an ETag or Last-Modified to revalidate with
+
+} freshness;
+
+void head_init(request_head *head);
+int head_line(request_head *head, char *line, size_t len);
+int head_host(request_head *head, char *hostname, char *host_port);
+int head_cache_id(request_head *head, char *cache_id);
+int head_validators(request_head *head, char *data, size_t length);
+int head_iov(request_head *head, struct iovec *iov, int keep_alive);
+ssize_t head_slice(request_head *head, char *data, size_t hdr_length,
+                   size_t body_length, const char *conn_hdr, char *buf,
+                   size_t size, size_t *first, size_t *count);
+ssize_t head_not_modified(request_head *head, char *data, size_t hdr_length,
+                          const char *conn_hdr, char *buf, size_t size);
+ssize_t head_compose(request_head *head, int keep_alive, char *buf,
+                     size_t size);
+int header_has_token(char *buf, const char *token);
+int request_keep_alive(char *buf);
+int connection_keep_alive(char *buf, int keep_alive);
+void freshness_init(freshness *f, int status);
+void freshness_header(freshness *f, char *buf);
+void freshness_scan(freshness *f, char *data, size_t length);
+time_t freshness_expiry(freshness *f, time_t now);
+long freshness_stale_window(freshness *f, long window);
+
+#endif /* __HTTP_H__ */
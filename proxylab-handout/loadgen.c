@@ -0,0 +1,455 @@
+/* Load generator for Proxylab, CMU 15-213/513, Fall 2015
+ * Author: Aleksander Bapst (abapst)
+ *
+ * A closed-loop load generator: each of a fixed number of client threads
+ * (-c) sends a request through the proxy, waits for the whole response and
+ * then sends the next, until the requests (-n) or the time (-t) run out. So
+ * the offered load adapts to how fast the proxy answers, and the latency of
+ * every request is measured from its first byte out to its last byte in.
+ *
+ * The origin is a local tiny. Before the run the objects are written into a
+ * directory (-d) under tiny's document root (-r), so tiny serves them as
+ * /<dir>/<i>.txt. There are -u of them, of text that compresses about as
+ * well as source code. Their popularity is Zipf distributed with exponent
+ * -a: object i is asked for in proportion to 1/i^a. Their sizes are Zipf
+ * distributed as well, independently of popularity: the object of size
+ * rank k has max/k^b bytes (-m and -b), but no fewer than MIN_OBJECT.
+ *
+ * Responses are read with the incremental parser of parser.c, so keep-alive
+ * connections (-k) can be reused. A response is an error unless it is a
+ * 200 with exactly the object's size in its body. The hit ratio comes from
+ * the proxy's own counters at /proxy-stats (see stats.c), read before and
+ * after the run.
+ *
+ * Usage: make loadgen && ./loadgen [options] <proxy port> <origin port>
+ */
+
+#include <math.h>
+#include <sys/stat.h>
+#include "csapp.h"
+#include "parser.h"
+
+#define DEF_CONNS 16
+#define DEF_REQUESTS 10000
+#define DEF_OBJECTS 1000
+#define DEF_ALPHA 1.0
+#define DEF_BETA 1.0
+#define DEF_MAX_OBJECT 102400
+#define MIN_OBJECT 64
+#define IO_TIMEOUT 10 // seconds a socket may block before it is an error
+
+/* What the run looks like, shared read-only by the client threads */
+typedef struct workload {
+
+    char *host; // where the proxy and tiny run
+    char *proxy_port;
+    char *origin_port;
+    char *dir; // objects' directory in tiny's document root
+    int nobjects;
+    size_t *sizes; // bytes of each object
+    double *cdf; // cumulative popularity of objects 0..i
+    int keep_alive;
+    long requests; // stop after this many, if duration is 0
+    long deadline; // stop at this now_us, if duration is set
+
+} workload;
+
+/* One client thread's results */
+typedef struct client {
+
+    pthread_t tid;
+    unsigned short seed[3]; // for erand48
+    long *latency; // microseconds of every request that succeeded
+    size_t nlatency, cap;
+    long errors;
+    long bytes; // body bytes received
+
+} client;
+
+static workload wl;
+static long issued = 0; // requests started by all clients
+
+static void *client_thread(void *vargp);
+static int fetch(client *cl, int *fd, int object);
+static int pick_object(client *cl);
+static void make_objects(char *root, double beta, size_t max_size,
+                         unsigned int seed);
+static int fetch_stats(long *hits, long *misses);
+static long now_us(void);
+static int cmp_long(const void *a, const void *b);
+static long percentile(long *sorted, size_t n, double p);
+static void usage(char *prog);
+
+int main(int argc, char **argv) {
+    int c, i, nconns = DEF_CONNS;
+    double alpha = DEF_ALPHA, beta = DEF_BETA, sum, duration = 0;
+    size_t max_size = DEF_MAX_OBJECT;
+    char *root = "tiny";
+    unsigned int seed = 15213;
+    long hits0, misses0, hits1, misses1, errors = 0, bytes = 0, start;
+    long *all;
+    size_t n = 0;
+    double secs;
+    client *clients;
+    int have_stats;
+
+    wl.host = "localhost";
+    wl.dir = "loadgen";
+    wl.nobjects = DEF_OBJECTS;
+    wl.requests = DEF_REQUESTS;
+    wl.keep_alive = 0;
+
+    while ((c = getopt(argc, argv, "hc:n:t:u:a:b:m:kH:r:d:s:")) != EOF) {
+        switch (c) {
+        case 'c':             /* concurrent clients */
+            if ((nconns = atoi(optarg)) < 1)
+                usage(argv[0]);
+            break;
+        case 'n':             /* requests in all */
+            if ((wl.requests = atol(optarg)) < 1)
+                usage(argv[0]);
+            break;
+        case 't':             /* seconds to run instead */
+            if ((duration = atof(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        case 'u':             /* distinct objects */
+            if ((wl.nobjects = atoi(optarg)) < 1)
+                usage(argv[0]);
+            break;
+        case 'a':             /* Zipf exponent of popularity */
+            alpha = atof(optarg);
+            break;
+        case 'b':             /* Zipf exponent of sizes */
+            beta = atof(optarg);
+            break;
+        case 'm':             /* largest object */
+            if ((max_size = atol(optarg)) < MIN_OBJECT)
+                usage(argv[0]);
+            break;
+        case 'k':             /* keep client connections alive */
+            wl.keep_alive = 1;
+            break;
+        case 'H':             /* host of the proxy and tiny */
+            wl.host = optarg;
+            break;
+        case 'r':             /* tiny's document root */
+            root = optarg;
+            break;
+        case 'd':             /* objects' directory under it */
+            wl.dir = optarg;
+            break;
+        case 's':             /* random seed */
+            seed = atoi(optarg);
+            break;
+        case 'h':
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 2)
+        usage(argv[0]);
+    wl.proxy_port = argv[optind];
+    wl.origin_port = argv[optind + 1];
+    Signal(SIGPIPE, SIG_IGN);
+
+    /* Objects on the origin, and how popular each one is */
+    make_objects(root, beta, max_size, seed);
+    wl.cdf = (double *)Malloc(wl.nobjects * sizeof(double));
+    for (sum = 0, i = 0; i < wl.nobjects; i++)
+        wl.cdf[i] = (sum += 1.0 / pow(i + 1, alpha));
+    for (i = 0; i < wl.nobjects; i++)
+        wl.cdf[i] /= sum;
+
+    have_stats = (fetch_stats(&hits0, &misses0) == 0);
+
+    /* Run the clients */
+    clients = (client *)Calloc(nconns, sizeof(client));
+    start = now_us();
+    wl.deadline = (duration > 0) ? start + (long)(duration * 1e6) : 0;
+    for (i = 0; i < nconns; i++) {
+        clients[i].seed[0] = seed;
+        clients[i].seed[1] = i;
+        clients[i].seed[2] = i >> 16;
+        Pthread_create(&clients[i].tid, NULL, client_thread, &clients[i]);
+    }
+    for (i = 0; i < nconns; i++)
+        Pthread_join(clients[i].tid, NULL);
+    secs = (now_us() - start) / 1e6;
+
+    /* Gather every latency and sort them for the percentiles */
+    for (i = 0; i < nconns; i++)
+        n += clients[i].nlatency;
+    all = (long *)Malloc((n + 1) * sizeof(long));
+    for (n = 0, i = 0; i < nconns; i++) {
+        memcpy(all + n, clients[i].latency,
+               clients[i].nlatency * sizeof(long));
+        n += clients[i].nlatency;
+        errors += clients[i].errors;
+        bytes += clients[i].bytes;
+    }
+    qsort(all, n, sizeof(long), cmp_long);
+
+    printf("%d clients%s, %d objects, alpha %.2f, beta %.2f, largest %zu "
+           "bytes\n", nconns, wl.keep_alive ? " with keep-alive" : "",
+           wl.nobjects, alpha, beta, max_size);
+    printf("requests %zu, errors %ld, %.2f s\n", n, errors, secs);
+    printf("throughput %.1f req/s, %.2f MB/s\n", n / secs,
+           bytes / secs / 1e6);
+    printf("latency us: p50 %ld, p99 %ld, p99.9 %ld, max %ld\n",
+           percentile(all, n, 0.5), percentile(all, n, 0.99),
+           percentile(all, n, 0.999), n ? all[n - 1] : 0);
+    if (have_stats && fetch_stats(&hits1, &misses1) == 0 &&
+        hits1 + misses1 > hits0 + misses0)
+        printf("hit ratio %.3f (%ld hits, %ld misses)\n",
+               (double)(hits1 - hits0) /
+               (hits1 - hits0 + misses1 - misses0),
+               hits1 - hits0, misses1 - misses0);
+    else
+        printf("hit ratio unknown, no stats from the proxy\n");
+    return errors ? 1 : 0;
+}
+
+/*
+ * client_thread - Send requests one after the other until the run is over,
+ *                 recording the latency of each.
+ */
+static void *client_thread(void *vargp) {
+    client *cl = (client *)vargp;
+    int fd = -1;
+    long start;
+
+    while (1) {
+        if (wl.deadline ? now_us() >= wl.deadline
+                        : __atomic_fetch_add(&issued, 1, __ATOMIC_RELAXED) >=
+                          wl.requests)
+            break;
+        start = now_us();
+        if (fetch(cl, &fd, pick_object(cl)) < 0) {
+            cl->errors++;
+            continue;
+        }
+        if (cl->nlatency == cl->cap) {
+            cl->cap = cl->cap ? 2 * cl->cap : 1024;
+            cl->latency = (long *)Realloc(cl->latency,
+                                          cl->cap * sizeof(long));
+        }
+        cl->latency[cl->nlatency++] = now_us() - start;
+    }
+    if (fd >= 0)
+        Close(fd);
+    return NULL;
+}
+
+/*
+ * fetch - Request an object through the proxy on *fd, connecting first if
+ *         it is closed, and read the whole response. The connection is left
+ *         open for the next request if both sides keep it alive. Returns -1
+ *         on any error or unexpected response.
+ */
+static int fetch(client *cl, int *fd, int object) {
+    char buf[MAXBUF];
+    http_parser parser;
+    struct timeval timeout = { IO_TIMEOUT, 0 };
+    ssize_t n;
+    size_t used, total = 0;
+    int len;
+
+    if (*fd < 0) {
+        if ((*fd = open_clientfd(wl.host, wl.proxy_port)) < 0)
+            return -1;
+        setsockopt(*fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(*fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    }
+
+    len = snprintf(buf, sizeof(buf), "GET http://%s:%s/%s/%d.txt HTTP/1.1\r\n"
+                   "Host: %s:%s\r\nConnection: %s\r\n\r\n", wl.host,
+                   wl.origin_port, wl.dir, object, wl.host, wl.origin_port,
+                   wl.keep_alive ? "keep-alive" : "close");
+    if (rio_writen(*fd, buf, len) != len)
+        goto fail;
+
+    parser_init(&parser, PARSE_RESPONSE);
+    while (parser.state != PARSE_DONE) {
+        if ((n = read(*fd, buf, sizeof(buf))) < 0) {
+            if (errno == EINTR)
+                continue;
+            goto fail;
+        }
+        if (n == 0) {
+            if (parser_finish(&parser) < 0)
+                goto fail;
+            break;
+        }
+        used = parser_execute(&parser, buf, n);
+        if (parser.state == PARSE_ERROR || used != (size_t)n)
+            goto fail; /* Nothing may follow the response */
+        total += used;
+    }
+
+    if (parser.status != 200 ||
+        total - parser.header_length != wl.sizes[object])
+        goto fail;
+    cl->bytes += wl.sizes[object];
+    if (!wl.keep_alive || !parser.keep_alive) {
+        Close(*fd);
+        *fd = -1;
+    }
+    return 0;
+
+ fail:
+    Close(*fd);
+    *fd = -1;
+    return -1;
+}
+
+/* pick_object - Draw an object by its Zipf popularity. */
+static int pick_object(client *cl) {
+    double u = erand48(cl->seed);
+    int lo = 0, hi = wl.nobjects - 1, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (wl.cdf[mid] < u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * make_objects - Give every object a size and write the ones that aren't
+ *                already there, with that size, into root/dir. Sizes are
+ *                dealt out by a shuffle of size ranks, so a popular object
+ *                is no more likely to be small than an unpopular one.
+ */
+static void make_objects(char *root, double beta, size_t max_size,
+                         unsigned int seed) {
+    static const char *words[] = {
+        "int ", "char ", "return ", "if (", ") {\n", "} else {\n", "buf",
+        "size_t ", "len", " = ", "; ", "->", "for (i = 0; i < n; i++)",
+        "    ", "\n", "/* ", " */", "object", "cache", "request", "NULL",
+        "while (", "rio_t ", "fd", "static ", "void ", "struct ", "0", "1",
+    };
+    int nwords = sizeof(words) / sizeof(words[0]);
+    char path[MAXLINE];
+    unsigned short rng[3] = { seed, seed >> 16, 0x5eed };
+    struct stat st;
+    int *rank, i, j, tmp;
+    size_t size, len;
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "%s/%s", root, wl.dir);
+    if (mkdir(path, 0755) < 0 && errno != EEXIST)
+        unix_error("mkdir error");
+
+    rank = (int *)Malloc(wl.nobjects * sizeof(int));
+    for (i = 0; i < wl.nobjects; i++)
+        rank[i] = i + 1;
+    for (i = wl.nobjects - 1; i > 0; i--) {
+        j = nrand48(rng) % (i + 1);
+        tmp = rank[i];
+        rank[i] = rank[j];
+        rank[j] = tmp;
+    }
+
+    wl.sizes = (size_t *)Malloc(wl.nobjects * sizeof(size_t));
+    for (i = 0; i < wl.nobjects; i++) {
+        size = (size_t)(max_size / pow(rank[i], beta));
+        wl.sizes[i] = (size < MIN_OBJECT) ? MIN_OBJECT : size;
+
+        snprintf(path, sizeof(path), "%s/%s/%d.txt", root, wl.dir, i);
+        if (stat(path, &st) == 0 && (size_t)st.st_size == wl.sizes[i])
+            continue;
+        if ((fp = fopen(path, "w")) == NULL)
+            unix_error("fopen error");
+        for (size = 0; size < wl.sizes[i]; size += len) {
+            const char *w = words[nrand48(rng) % nwords];
+            len = strlen(w);
+            if (len > wl.sizes[i] - size)
+                len = wl.sizes[i] - size;
+            fwrite(w, 1, len, fp);
+        }
+        fclose(fp);
+    }
+    Free(rank);
+}
+
+/*
+ * fetch_stats - Read the proxy's hit and miss counters from its statistics
+ *               page. Returns -1 if the proxy doesn't serve one.
+ */
+static int fetch_stats(long *hits, long *misses) {
+    char buf[MAXBUF], *p;
+    const char *request = "GET /proxy-stats HTTP/1.0\r\n\r\n";
+    size_t len = 0;
+    ssize_t n;
+    int fd;
+
+    if ((fd = open_clientfd(wl.host, wl.proxy_port)) < 0)
+        return -1;
+    if (rio_writen(fd, (void *)request, strlen(request)) < 0) {
+        Close(fd);
+        return -1;
+    }
+    while (len < sizeof(buf) - 1 &&
+           (n = rio_readn(fd, buf + len, sizeof(buf) - 1 - len)) > 0)
+        len += n;
+    Close(fd);
+    buf[len] = '\0';
+
+    if ((p = strstr(buf, "\nproxy_cache_hits_total ")) == NULL)
+        return -1;
+    *hits = atol(p + 24);
+    if ((p = strstr(buf, "\nproxy_cache_misses_total ")) == NULL)
+        return -1;
+    *misses = atol(p + 26);
+    return 0;
+}
+
+/* now_us - Monotonic time in microseconds. */
+static long now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/* cmp_long - qsort comparison of longs. */
+static int cmp_long(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* percentile - The p quantile of n sorted values, 0 if there are none. */
+static long percentile(long *sorted, size_t n, double p) {
+    size_t i = (size_t)(p * n);
+
+    if (n == 0)
+        return 0;
+    return sorted[(i < n) ? i : n - 1];
+}
+
+static void usage(char *prog) {
+    printf("Usage: %s [-h] [-c conns] [-n requests] [-t seconds] "
+           "[-u objects]\n       [-a alpha] [-b beta] [-m bytes] [-k] "
+           "[-H host] [-r root] [-d dir]\n       [-s seed] "
+           "<proxy port> <origin port>\n", prog);
+    printf("   -c conns     concurrent clients (default %d)\n", DEF_CONNS);
+    printf("   -n requests  requests in all (default %d)\n", DEF_REQUESTS);
+    printf("   -t seconds   run for this long instead\n");
+    printf("   -u objects   distinct objects (default %d)\n", DEF_OBJECTS);
+    printf("   -a alpha     Zipf exponent of popularity (default %.1f)\n",
+           DEF_ALPHA);
+    printf("   -b beta      Zipf exponent of sizes (default %.1f)\n",
+           DEF_BETA);
+    printf("   -m bytes     largest object (default %d)\n", DEF_MAX_OBJECT);
+    printf("   -k           keep client connections alive\n");
+    printf("   -H host      host of the proxy and tiny (default localhost)\n");
+    printf("   -r root      tiny's document root (default tiny)\n");
+    printf("   -d dir       objects' directory in it (default loadgen)\n");
+    printf("   -s seed      random seed\n");
+    exit(1);
+}
@@ -0,0 +1,307 @@
+/* HTTP message parser for Proxylab, CMU 15-213/513, Fall 2015
+ * Author: Aleksander Bapst (abapst)
+ *
+ * An incremental parser that finds where an HTTP/1.x message ends. It is
+ * fed the bytes of a message in pieces of any size, e.g. whatever is in a
+ * Rio buffer or whatever a non-blocking read returned, and consumes bytes
+ * up to the end of the message and no further, so whatever follows (the
+ * next pipelined response) is left for the next message. Nothing is
+ * copied or allocated: the parser keeps its state in a fixed-size struct,
+ * including the first PARSE_LINE_MAX bytes of the line it is in, which is
+ * enough to read the headers that decide the framing.
+ *
+ *     START -> HEADER -> DONE                       (no body)
+ *                     -> BODY -> DONE               (Content-Length)
+ *                     -> BODY_EOF                   (until the close)
+ *                     -> CHUNK_SIZE -> CHUNK_DATA -> CHUNK_END -> ...
+ *                        CHUNK_SIZE (0) -> TRAILER -> DONE
+ *
+ * Responses to 1xx, 204 and 304 have no body; other responses are framed
+ * by chunked transfer coding, Content-Length, or else the end of the
+ * connection. Requests without either have no body. Body bytes can also be
+ * passed on without being looked at (parser_body_left, parser_skip), so a
+ * caller may splice them instead. A chunked body collected whole can be
+ * decoded in place with parser_dechunk.
+ *
+ * The parser depends on nothing but the C library, so that it can be used
+ * by the proxy's engines and by a server like tiny alike.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "parser.h"
+
+static void keep_line(http_parser *parser, const char *buf, size_t n);
+static void end_line(http_parser *parser);
+static void start_line(http_parser *parser, char *line);
+static void header_line(http_parser *parser, char *line);
+static void end_headers(http_parser *parser);
+static int has_token(char *line, const char *token);
+
+/* parser_init - Get ready to parse a new response or request. */
+void parser_init(http_parser *parser, int type) {
+    parser->type = type;
+    parser->state = PARSE_START;
+    parser->status = 0;
+    parser->keep_alive = 0;
+    parser->chunked = 0;
+    parser->framed = 0;
+    parser->content_length = -1;
+    parser->remaining = 0;
+    parser->header_length = 0;
+    parser->line_length = 0;
+}
+
+/*
+ * parser_execute - Parse up to len bytes of the message in buf and return
+ *                  how many were consumed. Fewer than len are consumed only
+ *                  if the message ends inside buf, or is malformed, which
+ *                  leaves the parser in PARSE_DONE or PARSE_ERROR.
+ */
+size_t parser_execute(http_parser *parser, const char *buf, size_t len) {
+    size_t used = 0, n;
+    const char *nl;
+
+    while (used < len && parser->state != PARSE_DONE &&
+           parser->state != PARSE_ERROR) {
+        switch (parser->state) {
+        case PARSE_BODY:
+        case PARSE_CHUNK_DATA:
+            n = len - used;
+            if ((long)n > parser->remaining)
+                n = parser->remaining;
+            used += n;
+            parser_skip(parser, n);
+            break;
+        case PARSE_BODY_EOF:
+            used = len;
+            break;
+        default:
+            /* Every other state is a line, which may span several calls */
+            nl = memchr(buf + used, '\n', len - used);
+            n = (nl != NULL) ? (size_t)(nl - (buf + used)) + 1 : len - used;
+            if (parser->state == PARSE_START ||
+                parser->state == PARSE_HEADER)
+                parser->header_length += n;
+            keep_line(parser, buf + used, n);
+            used += n;
+            if (nl != NULL)
+                end_line(parser);
+        }
+    }
+    return used;
+}
+
+/*
+ * parser_body_left - Number of body bytes that can be passed on without
+ *                    parsing them: the rest of a Content-Length body or of
+ *                    the current chunk, -1 for a body that runs until the
+ *                    connection closes, and 0 anywhere else.
+ */
+long parser_body_left(http_parser *parser) {
+    if (parser->state == PARSE_BODY || parser->state == PARSE_CHUNK_DATA)
+        return parser->remaining;
+    if (parser->state == PARSE_BODY_EOF)
+        return -1;
+    return 0;
+}
+
+/*
+ * parser_skip - Account for n body bytes passed on without parsing them, at
+ *               most parser_body_left of them.
+ */
+void parser_skip(http_parser *parser, size_t n) {
+    if (parser->state != PARSE_BODY && parser->state != PARSE_CHUNK_DATA)
+        return;
+    parser->remaining -= n;
+    if (parser->remaining > 0)
+        return;
+    parser->state = (parser->state == PARSE_BODY) ? PARSE_DONE
+                                                  : PARSE_CHUNK_END;
+}
+
+/*
+ * parser_finish - Tell the parser that the connection was closed. Returns 0
+ *                 if the message is complete, which a body that runs until
+ *                 the close always is, and -1 if it was cut short.
+ */
+int parser_finish(http_parser *parser) {
+    if (parser->state == PARSE_BODY_EOF)
+        parser->state = PARSE_DONE;
+    if (parser->state == PARSE_DONE)
+        return 0;
+    parser->state = PARSE_ERROR;
+    return -1;
+}
+
+/*
+ * parser_dechunk - Decode a complete chunked body, len bytes at body, in
+ *                  place: the data of the chunks is moved together and the
+ *                  chunk sizes, extensions and trailers are dropped. Returns
+ *                  the length of the decoded body, or -1 if the body isn't
+ *                  well formed.
+ */
+long parser_dechunk(char *body, size_t len) {
+    char *p = body, *end = body + len, *out = body, *nl, *digits_end;
+    unsigned long size;
+
+    while (p < end && (nl = memchr(p, '\n', end - p)) != NULL) {
+        size = strtoul(p, &digits_end, 16);
+        if (digits_end == p)
+            return -1;
+        p = nl + 1;
+        if (size == 0) /* The last chunk, only trailers follow */
+            return out - body;
+        if (size > (size_t)(end - p))
+            return -1;
+        memmove(out, p, size);
+        out += size;
+        p += size;
+        if (p < end && *p == '\r')
+            p++;
+        if (p == end || *p != '\n')
+            return -1;
+        p++;
+    }
+    return -1;
+}
+
+/* keep_line - Keep as much of a line as fits in the parser. */
+static void keep_line(http_parser *parser, const char *buf, size_t n) {
+    size_t room = PARSE_LINE_MAX - 1;
+
+    if (parser->line_length < room)
+        memcpy(parser->line + parser->line_length, buf,
+               (n < room - parser->line_length) ? n
+                                               : room - parser->line_length);
+    parser->line_length += n;
+}
+
+/* end_line - Act on a complete line, without its CRLF. */
+static void end_line(http_parser *parser) {
+    size_t kept = parser->line_length;
+    char *line = parser->line;
+    int blank;
+
+    if (kept > PARSE_LINE_MAX - 1) {
+        kept = PARSE_LINE_MAX - 1; /* Only the start of a long line */
+    } else {
+        kept--; /* the LF */
+        if (kept > 0 && line[kept - 1] == '\r')
+            kept--;
+    }
+    line[kept] = '\0';
+    blank = (kept == 0);
+    parser->line_length = 0;
+
+    switch (parser->state) {
+    case PARSE_START:
+        /* Empty lines before a request line are ignored */
+        if (!blank)
+            start_line(parser, line);
+        else if (parser->type == PARSE_RESPONSE)
+            parser->state = PARSE_ERROR;
+        break;
+    case PARSE_HEADER:
+        if (blank)
+            end_headers(parser);
+        else
+            header_line(parser, line);
+        break;
+    case PARSE_CHUNK_SIZE:
+        if (!isxdigit((unsigned char)line[0])) {
+            parser->state = PARSE_ERROR;
+            break;
+        }
+        /* Chunk extensions after the size are ignored */
+        parser->remaining = strtol(line, NULL, 16);
+        if (parser->remaining < 0)
+            parser->state = PARSE_ERROR;
+        else
+            parser->state = (parser->remaining == 0) ? PARSE_TRAILER
+                                                     : PARSE_CHUNK_DATA;
+        break;
+    case PARSE_CHUNK_END:
+        parser->state = blank ? PARSE_CHUNK_SIZE : PARSE_ERROR;
+        break;
+    case PARSE_TRAILER:
+        if (blank)
+            parser->state = PARSE_DONE;
+        break;
+    }
+}
+
+/*
+ * start_line - Read the version of a status or request line, and the status
+ *              of a response. HTTP/1.1 connections persist by default.
+ */
+static void start_line(http_parser *parser, char *line) {
+    char *version = strstr(line, "HTTP/1.");
+
+    if (version == NULL || (parser->type == PARSE_RESPONSE &&
+                            version != line)) {
+        parser->state = PARSE_ERROR;
+        return;
+    }
+    parser->keep_alive = (version[7] >= '1' && version[7] <= '9');
+    if (parser->type == PARSE_RESPONSE) {
+        if ((line = strchr(line, ' ')) == NULL ||
+            (parser->status = atoi(line + 1)) < 100) {
+            parser->state = PARSE_ERROR;
+            return;
+        }
+    }
+    parser->state = PARSE_HEADER;
+}
+
+/* header_line - Note the headers that decide framing and persistence. */
+static void header_line(http_parser *parser, char *line) {
+    if (!strncasecmp(line, "Content-Length:", 15)) {
+        parser->content_length = strtol(line + 15, NULL, 10);
+        if (parser->content_length < 0)
+            parser->state = PARSE_ERROR;
+    } else if (!strncasecmp(line, "Transfer-Encoding:", 18)) {
+        parser->chunked = has_token(line, "chunked");
+    } else if (!strncasecmp(line, "Connection:", 11)) {
+        if (has_token(line, "close"))
+            parser->keep_alive = 0;
+        else if (has_token(line, "keep-alive"))
+            parser->keep_alive = 1;
+    }
+}
+
+/* end_headers - Work out how the body is framed once the headers are read. */
+static void end_headers(http_parser *parser) {
+    int status = parser->status;
+
+    parser->framed = 1;
+    if (parser->type == PARSE_RESPONSE &&
+        (status / 100 == 1 || status == 204 || status == 304)) {
+        parser->state = PARSE_DONE;
+    } else if (parser->chunked) {
+        parser->state = PARSE_CHUNK_SIZE;
+    } else if (parser->content_length > 0) {
+        parser->remaining = parser->content_length;
+        parser->state = PARSE_BODY;
+    } else if (parser->content_length == 0 ||
+               parser->type == PARSE_REQUEST) {
+        parser->state = PARSE_DONE;
+    } else {
+        /* Only closing the connection can end this body */
+        parser->framed = 0;
+        parser->keep_alive = 0;
+        parser->state = PARSE_BODY_EOF;
+    }
+}
+
+/* has_token - Check whether a line contains token, ignoring case. */
+static int has_token(char *line, const char *token) {
+    size_t len = strlen(token);
+
+    for (; *line; line++)
+        if (!strncasecmp(line, token, len))
+            return 1;
+    return 0;
+}
@@ -0,0 +1,51 @@
+/* HTTP message parser header file for parser.c
+ * Author: Aleksander Bapst (abapst)
+ */
+
+#ifndef __PARSER_H__
+#define __PARSER_H__
+
+#include <stddef.h>
+
+#define PARSE_LINE_MAX 256 // prefix of a header line kept for inspection
+
+/* Kinds of message */
+#define PARSE_RESPONSE 0
+#define PARSE_REQUEST  1
+
+/* Parser states */
+#define PARSE_START      0 // in the status or request line
+#define PARSE_HEADER     1 // in a header line
+#define PARSE_BODY       2 // in a body framed by Content-Length
+#define PARSE_BODY_EOF   3 // in a body that ends when the connection closes
+#define PARSE_CHUNK_SIZE 4 // in the size line of a chunk
+#define PARSE_CHUNK_DATA 5 // in the data of a chunk
+#define PARSE_CHUNK_END  6 // in the CRLF after the data of a chunk
+#define PARSE_TRAILER    7 // in a trailer line after the last chunk
+#define PARSE_DONE       8 // the message is complete
+#define PARSE_ERROR      9 // the message is malformed
+
+typedef struct http_parser {
+
+    int type; // PARSE_RESPONSE or PARSE_REQUEST
+    int state;
+    int status; // response status code
+    int keep_alive; // the connection persists after this message
+    int chunked; // Transfer-Encoding: chunked
+    int framed; // the end of the body is known without closing
+    long content_length; // -1 if absent
+    long remaining; // bytes left in the body or the current chunk
+    size_t header_length; // bytes up to and including the blank line
+    size_t line_length; // bytes of the current line seen so far
+    char line[PARSE_LINE_MAX]; // start of the current line
+
+} http_parser;
+
+void parser_init(http_parser *parser, int type);
+size_t parser_execute(http_parser *parser, const char *buf, size_t len);
+long parser_body_left(http_parser *parser);
+void parser_skip(http_parser *parser, size_t n);
+int parser_finish(http_parser *parser);
+long parser_dechunk(char *body, size_t len);
+
+#endif /* __PARSER_H__ */
@@ -0,0 +1,218 @@
+/* Cache eviction policies for Proxylab, CMU 15-213/513, Fall 2015
+ * Author: Aleksander Bapst (abapst)
+ *
+ * The eviction policies plugged into cache.c. Each policy is a table of
+ * hooks that cache.c calls with the shard's writer lock held, except
+ * for hits that don't write shared state (see cache_policy in cache.h).
+ *
+ * CACHE_LRU: new objects go to the end of the list, hits move the object to
+ *     the end, and the victim is the first object.
+ * CACHE_CLOCK: the list is a ring with a hand. Hits set the object's access
+ *     bit, new objects go just behind the hand so that they get a full
+ *     revolution, and the victim is found by sweeping the hand, clearing
+ *     set bits, up to the first object whose bit is clear.
+ * CACHE_GDSF: GreedyDual-Size-Frequency. Every object has the priority
+ *         L + freq * cost / size
+ *     where cost is the number of packets needed to fetch it again,
+ *     2 + size / GDSF_PACKET, as in GD-Size(packets). With that cost a
+ *     large object is not evicted just for being large, which favours the
+ *     byte hit ratio, while a small, often hit object still outranks a
+ *     large one hit once. L is the priority of the last victim, so objects
+ *     that stop being hit age relative to new ones. The victim is the
+ *     object with the lowest priority, kept at the top of a binary
+ *     min-heap. The objects are also kept on the list, in insertion order,
+ *     so the cache can walk them.
+ */
+
+#include "cache.h"
+
+static void lru_insert(cache_shard *shard, cache_object *object);
+static void lru_remove(cache_shard *shard, cache_object *object, int evicted);
+static void lru_hit(cache_shard *shard, cache_object *object);
+static cache_object *lru_victim(cache_shard *shard);
+static void clock_insert(cache_shard *shard, cache_object *object);
+static void clock_hit(cache_shard *shard, cache_object *object);
+static cache_object *clock_victim(cache_shard *shard);
+static cache_object *clock_peek(cache_shard *shard);
+static void gdsf_insert(cache_shard *shard, cache_object *object);
+static void gdsf_remove(cache_shard *shard, cache_object *object, int evicted);
+static void gdsf_hit(cache_shard *shard, cache_object *object);
+static cache_object *gdsf_victim(cache_shard *shard);
+static double gdsf_priority(cache_shard *shard, cache_object *object);
+static void heap_swap(cache_shard *shard, unsigned int i, unsigned int j);
+static void heap_up(cache_shard *shard, unsigned int i);
+static void heap_down(cache_shard *shard, unsigned int i);
+
+static const cache_policy lru_policy = {
+    "LRU", 1, lru_insert, lru_remove, lru_hit, lru_victim, lru_victim
+};
+static const cache_policy clock_policy = {
+    "CLOCK", 0, clock_insert, lru_remove, clock_hit, clock_victim, clock_peek
+};
+static const cache_policy gdsf_policy = {
+    "GDSF", 1, gdsf_insert, gdsf_remove, gdsf_hit, gdsf_victim, gdsf_victim
+};
+
+/* Policies by number, as passed to init_cache */
+const cache_policy *cache_policies[CACHE_NPOLICIES] = {
+    &lru_policy, &clock_policy, &gdsf_policy
+};
+
+/* lru_insert - A new object is the most recently used one. */
+static void lru_insert(cache_shard *shard, cache_object *object) {
+    link_before(shard, object, NULL);
+}
+
+/* lru_remove - Unlink an object, for LRU and CLOCK alike. */
+static void lru_remove(cache_shard *shard, cache_object *object, int evicted) {
+    unlink_object(shard, object);
+}
+
+/* lru_hit - Move a read object to the end of the list. */
+static void lru_hit(cache_shard *shard, cache_object *object) {
+    if (object != shard->last) {
+        unlink_object(shard, object);
+        link_before(shard, object, NULL);
+    }
+}
+
+/* lru_victim - The least recently used object is at the front. */
+static cache_object *lru_victim(cache_shard *shard) {
+    return shard->first;
+}
+
+/* clock_insert - Link a new object just behind the hand. */
+static void clock_insert(cache_shard *shard, cache_object *object) {
+    link_before(shard, object, shard->hand);
+}
+
+/* clock_hit - Set the access bit, only storing it if needed to keep the
+ *             cache line shared. Called under a reader lock.
+ */
+static void clock_hit(cache_shard *shard, cache_object *object) {
+    if (!__atomic_load_n(&object->referenced, __ATOMIC_RELAXED))
+        __atomic_store_n(&object->referenced, 1, __ATOMIC_RELAXED);
+}
+
+/* clock_victim - Sweep the CLOCK hand around the shard's ring, giving each
+ *                referenced object a second chance by clearing its bit, and
+ *                return the first object found with its bit clear.
+ */
+static cache_object *clock_victim(cache_shard *shard) {
+    cache_object *object = (shard->hand != NULL) ? shard->hand : shard->first;
+
+    while (__atomic_load_n(&object->referenced, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&object->referenced, 0, __ATOMIC_RELAXED);
+        object = (object->next != NULL) ? object->next : shard->first;
+    }
+    shard->hand = object;
+    return object;
+}
+
+/* clock_peek - Find the object clock_victim would pick without clearing any
+ *              bits or moving the hand: the first object from the hand on
+ *              with its bit clear, or the hand's own object if every bit is
+ *              set, since the sweep comes back to it once it has cleared
+ *              them all.
+ */
+static cache_object *clock_peek(cache_shard *shard) {
+    cache_object *start = (shard->hand != NULL) ? shard->hand : shard->first;
+    cache_object *object = start;
+
+    do {
+        if (!__atomic_load_n(&object->referenced, __ATOMIC_RELAXED))
+            return object;
+        object = (object->next != NULL) ? object->next : shard->first;
+    } while (object != start);
+    return start;
+}
+
+/* gdsf_insert - Link a new object and push it on the heap, with the hit
+ *               count it comes with: one, or that of the copy it replaces.
+ */
+static void gdsf_insert(cache_shard *shard, cache_object *object) {
+    link_before(shard, object, NULL);
+
+    if (shard->heap_size == shard->heap_cap) {
+        shard->heap_cap = shard->heap_cap ? 2 * shard->heap_cap : 64;
+        shard->heap = (cache_object **)Realloc(shard->heap, shard->heap_cap *
+                                               sizeof(cache_object *));
+    }
+    object->priority = gdsf_priority(shard, object);
+    object->heap_index = shard->heap_size++;
+    shard->heap[object->heap_index] = object;
+    heap_up(shard, object->heap_index);
+}
+
+/* gdsf_remove - Unlink an object and take it off the heap. An evicted
+ *               object's priority becomes the new L.
+ */
+static void gdsf_remove(cache_shard *shard, cache_object *object,
+                        int evicted) {
+    unsigned int i = object->heap_index;
+
+    unlink_object(shard, object);
+    if (evicted)
+        shard->inflation = object->priority;
+
+    shard->heap_size--;
+    if (i != shard->heap_size) {
+        heap_swap(shard, i, shard->heap_size);
+        heap_up(shard, i);
+        heap_down(shard, i);
+    }
+}
+
+/* gdsf_hit - Count the hit and raise the object's priority. */
+static void gdsf_hit(cache_shard *shard, cache_object *object) {
+    object->freq++;
+    object->priority = gdsf_priority(shard, object);
+    heap_down(shard, object->heap_index);
+}
+
+/* gdsf_victim - The object with the lowest priority is at the top. */
+static cache_object *gdsf_victim(cache_shard *shard) {
+    return shard->heap[0];
+}
+
+/* gdsf_priority - L + freq * cost / size for an object. */
+static double gdsf_priority(cache_shard *shard, cache_object *object) {
+    double size = object->length ? object->length : 1;
+    double cost = 2.0 + (double)object->length / GDSF_PACKET;
+
+    return shard->inflation + object->freq * cost / size;
+}
+
+/* heap_swap - Swap two heap entries, keeping their indices up to date. */
+static void heap_swap(cache_shard *shard, unsigned int i, unsigned int j) {
+    cache_object *tmp = shard->heap[i];
+
+    shard->heap[i] = shard->heap[j];
+    shard->heap[j] = tmp;
+    shard->heap[i]->heap_index = i;
+    shard->heap[j]->heap_index = j;
+}
+
+/* heap_up - Move an entry up while it has a lower priority than its parent. */
+static void heap_up(cache_shard *shard, unsigned int i) {
+    while (i > 0 && shard->heap[i]->priority <
+           shard->heap[(i - 1) / 2]->priority) {
+        heap_swap(shard, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+/* heap_down - Move an entry down while a child has a lower priority. */
+static void heap_down(cache_shard *shard, unsigned int i) {
+    unsigned int child;
+
+    while ((child = 2 * i + 1) < shard->heap_size) {
+        if (child + 1 < shard->heap_size &&
+            shard->heap[child + 1]->priority < shard->heap[child]->priority)
+            child++;
+        if (shard->heap[i]->priority <= shard->heap[child]->priority)
+            break;
+        heap_swap(shard, i, child);
+        i = child;
+    }
+}
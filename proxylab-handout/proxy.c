@@ -3,14 +3,92 @@
  * Random port number for abapst: 45318
  *
  * A no-frills multi-threaded proxy server for retrieving web content on behalf
- * of clients. A simple 1 MB cache is used to store objects locally for faster
- * service, with a maximum allowed object size in the cache of 1 KB. Only the
- * GET request is supported, but most http sites can be loaded with this proxy. 
+ * of clients. A cache of 1 MB by default (-c) is used to store objects locally
+ * for faster service, with a maximum allowed object size in the cache of
+ * 100 KB by default (-o). Only the GET request is supported, but most http
+ * sites can be loaded with this proxy.
  *
  * Concurrency:
- *     The proxy uses a multi-threaded setup with the cache as the only shared
- *     variable. Semaphores are used to protect the cache from read/write
- *     errors.
+ *     The proxy is prethreaded: a fixed pool of worker threads (-t) takes
+ *     connected descriptors from a bounded queue (-q) filled by the main
+ *     accept loop. When the queue is full the accept loop blocks, so bursts
+ *     queue up in the kernel's listen backlog instead of spawning threads.
+ *     At high connection rates a single accept loop becomes the bottleneck;
+ *     with -l several sockets listen on the port with SO_REUSEPORT, each
+ *     with an accept loop of its own, and the kernel balances new
+ *     connections between them.
+ *     The cache is the only other shared variable.
+ *
+ *     Alternatively (-m event) a few event loops (-n, one per core by
+ *     default) multiplex all connections over non-blocking sockets with
+ *     epoll, see event.c. Both engines share the request rewriting in http.c
+ *     and the cache. Each shard of the cache is protected by a reader-writer
+ *     lock. The cache can be split into shards (-s) with independent locks
+ *     so that threads hitting different objects do not serialize. With the
+ *     CLOCK eviction policy (-e clock) cache hits only share the lock and
+ *     never take it exclusively.
+ *     GDSF eviction (-e gdsf) and TinyLFU admission (-a tinylfu) protect
+ *     popular objects from large or one-off ones.
+ *     Concurrent misses on the same object are coalesced into a single fetch
+ *     from the host, see flight.c. The waiting requests stream a response
+ *     of known length from the fetching one while it arrives, rather than
+ *     wait for it to be cached.
+ *
+ *     Cached responses are only served while they are fresh, as given by
+ *     their Cache-Control or Expires headers (see http.c). A stale response
+ *     with an ETag or Last-Modified date is revalidated with a conditional
+ *     request, and a 304 answer makes it fresh again without sending the
+ *     body twice. Responses marked no-store or private are never cached.
+ *     A stale response that allows it with stale-while-revalidate, or any
+ *     stale response up to -w seconds past its expiry, is served at once
+ *     while a background thread refreshes it, see refresh.c.
+ *
+ *     A request for a single byte range is answered with a 206 slice of
+ *     the cached object. On a miss the Range header is dropped and the
+ *     whole object fetched and cached, so the next seek in it is a hit; the
+ *     client is sent only its range as the object arrives. Ranges starting
+ *     past the largest cacheable object are passed on to the host.
+ *
+ *     Objects evicted from memory can be kept in a larger memory-mapped disk
+ *     cache (-d, sized by -D), see disk.c. It is saved on ctrl-c and loaded
+ *     again at startup, so a restarted proxy does not start cold. SIGINT is
+ *     blocked in every thread but one, which waits for it with sigwait,
+ *     stops accepting, waits for requests in progress to finish and only
+ *     then saves and frees the cache.
+ *
+ *     With -z text objects are stored gzipped, see gzip.c, so the cache
+ *     holds several times as many of them. Clients that send
+ *     Accept-Encoding: gzip get them as they are stored; others get them
+ *     inflated again.
+ *
+ * Statistics:
+ *     Hits, misses, evictions, bytes served from the cache and from hosts,
+ *     open connections and latency histograms of each phase of a request
+ *     are counted per thread and served at /proxy-stats to a client that
+ *     asks the proxy itself, see stats.c.
+ *
+ * Persistent connections:
+ *     The worker pool talks HTTP/1.1 to hosts for HTTP/1.1 clients and keeps
+ *     idle keep-alive connections in a per-origin pool (-p), see
+ *     connpool.c. Responses are framed by Content-Length or chunked coding,
+ *     which the incremental parser in parser.c follows, so a connection can
+ *     be reused once the response has been read. HTTP/1.0 clients, which
+ *     can't read a chunked body, get their requests sent as HTTP/1.0 on a
+ *     connection of their own. Host names are looked up through a DNS cache
+ *     with background resolver threads, see dnscache.c.
+ *
+ *     Client connections are persistent too: a worker keeps serving requests
+ *     from the same client, including pipelined ones waiting in its Rio
+ *     buffer, until the client asks to close, sends nothing for
+ *     CLIENT_IDLE_TIMEOUT seconds, or a response can only be ended by
+ *     closing the connection. Cached responses are stored without their
+ *     Connection headers; the proxy adds its own on every response.
+ *
+ * Usage:
+ *     ./proxy [-h] [-m thread|event] [-t workers] [-q depth] [-n loops]
+ *             [-l n] [-s shards] [-e lru|clock|gdsf] [-a all|tinylfu]
+ *             [-c bytes] [-o bytes] [-p idle] [-H hosts] [-d file] [-D bytes]
+ *             [-w secs] [-z] <port>
  *
  * csapp.c
  *     I modified a few wrapper functions.
@@ -19,367 +97,1237 @@
  *     Rio_readn
  *     Rio_readnb
  *     Rio_readlinb - These functions do not terminate if errno = ECONNRESET 
+ *                    or EAGAIN, the latter being an idle client timing out.
+ *     Rio_writen also does not terminate on ECONNRESET, which a pooled host
+ *     connection can give when the host has closed it.
+ *     Rio_fill - added, refills an empty Rio buffer without copying out of
+ *                it, so that responses can be parsed in place.
+ *     open_listenfd_reuse - added, open_listenfd with optional SO_REUSEPORT.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <sys/uio.h>
 #include "csapp.h"
 #include "cache.h"
+#include "sbuf.h"
+#include "http.h"
+#include "event.h"
+#include "connpool.h"
+#include "dnscache.h"
+#include "zcopy.h"
+#include "flight.h"
+#include "disk.h"
+#include "parser.h"
+#include "gzip.h"
+#include "stats.h"
+#include "refresh.h"
+
+/* Default worker pool size and connection queue depth */
+#define DEF_WORKERS 16
+#define DEF_QUEUE_DEPTH 64
+
+/* Default number of listening sockets, each with its own accept loop */
+#define DEF_ACCEPTORS 1
+
+/* Default number of idle connections kept per origin */
+#define DEF_POOL_IDLE 8
+
+/* First allocation of a miss's cache buffer, doubled as the response grows */
+#define CACHEBUF_INIT 16384
+
+/* Seconds an idle client connection may hold a worker between requests */
+#define CLIENT_IDLE_TIMEOUT 5
+
+/* Seconds shutdown waits for requests in progress to finish */
+#define SHUTDOWN_TIMEOUT 10
+
+/* Concurrency engines */
+#define ENGINE_THREAD 0 // prethreaded workers with blocking I/O
+#define ENGINE_EVENT  1 // epoll event loops with non-blocking I/O
+
+/* A client request, rewritten for the host */
+typedef struct request {
+    char cache_id[MAXLINE];
+    char hostname[MAXLINE];
+    char host_port[MAXLINE];
+    char head_buf[MAXBUF]; // the client's request head, as read
+    request_head head; // head_buf tokenized in place
+    int serverfd;
+    int reused; // serverfd was taken from the connection pool
+    int keep_alive; // the client connection persists after this request
+    flight *flight; // fetch this request leads, finished once it is cached
+    flight *follow; // fetch whose streamed response this request is served
+    cache_object *stale; // pinned cached copy the host is asked to confirm
+    int in_cache; // entered the cache, left once the request is done
+    long start; // stats_clock when the request line arrived
+    long sent; // stats_clock when the request was sent to the host
+} request;
+
+/* Response collected for the cache while it is relayed to the client */
+typedef struct cachebuf_t {
+    char *data; // grown as the response arrives
+    size_t length, capacity;
+    size_t hdr_length; // offset of the blank line ending the headers
+    int valid; // still cacheable and no larger than the cache's max_object
+    time_t expires; // when the response goes stale
+    flight *stream; // fetch that owns data and whose followers read it
+    size_t skip; // bytes of the response still to be kept from the client
+    long left; // bytes the client still gets, -1 for the whole response
+} cachebuf_t;
 
 /* Function declarations */
-void *client_job(void *connfdp);
-int forward_request(int clientfd, int *serverfd, char *cache_id,
-                    void *cache_object, unsigned int *cache_length);
+void *acceptor_thread(void *vargp);
+void accept_loop(int listenfd);
+void *worker_thread(void *vargp);
+void client_job(int clientfd);
+int forward_request(rio_t *rio_client, request *req, cache_object **hit);
+int send_request(request *req, int allow_reuse);
 void close_openfds(int *clientfd, int *serverfd);
-int parse_request(char *buf, char *method, char *version,
-                  char *protocol, char *hostname, char *filename);
-int forward_server_response(int clientfd, int serverfd, char *cache_id, 
-                            void *cache_object);
-int forward_cache_response(int clientfd, void *cache_object, 
-                           unsigned int cache_length); 
-int cachebuf_append(void *cache_buffer, unsigned int *cache_length,
-                    char *buf, unsigned int buf_length);
-void sigint_handler(int sig);
-
-/* You won't lose style points for including this long line in your code */
-static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
-static const char *connection_hdr = "Connection: close\r\n";
-static const char *host_hdr_prefix = "Host:";
-static const char *proxy_connection_hdr = "Proxy-Connection: close\r\n";
-static const char *http_version = "HTTP/1.0\r\n";
+int forward_server_response(int clientfd, request *req);
+int forward_local_response(int clientfd, request *req);
+int forward_flight_response(int clientfd, request *req);
+int forward_cache_response(int clientfd, cache_object *object,
+                           request *req);
+int refresh_cache_response(int clientfd, request *req, rio_t *rio_server,
+                           char *buf, int *reusable);
+int relay_server_response(int clientfd, request *req, rio_t *rio_server,
+                          char *buf, cachebuf_t *cb, int *reusable);
+int relay_body(int clientfd, rio_t *rio_server, http_parser *parser,
+               cachebuf_t *cb);
+int relay_bytes(int clientfd, char *buf, size_t n, cachebuf_t *cb);
+int cachebuf_reserve(cachebuf_t *cb, size_t n);
+void cachebuf_append(cachebuf_t *cb, char *buf, size_t n);
+void cachebuf_drop(cachebuf_t *cb);
+void cachebuf_frame(cachebuf_t *cb);
+void cachebuf_dechunk(cachebuf_t *cb);
+ssize_t writev_full(int fd, struct iovec *iov, int iovcnt);
+void *shutdown_thread(void *vargp);
+void usage(char *prog);
+size_t parse_size(char *arg);
 
 /* Global pointer to start of cache list */
 cache_list *cache = NULL;
 
+/* Queue of accepted connections waiting for a worker */
+sbuf_t conn_queue;
+
+/* Idle persistent connections to origin servers */
+conn_pool *upstream_pool = NULL;
+
+/* Cached host name lookups */
+dns_cache *dns = NULL;
+
+/* Misses currently being fetched from hosts */
+flight_table *flights = NULL;
+
+/* Stale objects waiting to be fetched again in the background */
+refresh_queue *refreshes = NULL;
+
+/* Listening sockets of the accept loops, shut down to stop them */
+static int *accept_fds = NULL;
+static int naccept_fds = 0;
+static int stopping = 0; // set once the accept loops are to stop
+
+/* Connection headers the proxy sends to clients */
+static const char *keep_alive_hdr = "Connection: keep-alive\r\n";
+static const char *close_hdr = "Connection: close\r\n";
+
 /*
  * main - Initializes proxy server and starts listening for requests.
- *        Requests are handled in a multi-threaded manner.
+ *        Requests are handed to a pool of worker threads.
  */
 int main(int argc, char **argv)
 {
-    int listenfd, *connfdp;
-    socklen_t clientlen;
-    struct sockaddr_storage clientaddr;
+    int i, *listenfds;
     pthread_t tid;
+    int c;
+    int nworkers = DEF_WORKERS, queue_depth = DEF_QUEUE_DEPTH;
+    int nacceptors = DEF_ACCEPTORS;
+    int engine = ENGINE_THREAD;
+    int nloops = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int nshards = 1;
+    int policy = CACHE_LRU;
+    int admission = ADMIT_ALL;
+    size_t cache_size = MAX_CACHE_SIZE, object_size = MAX_OBJECT_SIZE;
+    int pool_idle = DEF_POOL_IDLE;
+    char *hosts_file = NULL;
+    char *disk_file = NULL;
+    size_t disk_size = DISK_DEF_SIZE;
+    int compress = 0;
+    long stale_window = 0;
+    sigset_t mask;
 
     /* Ignore SIGPIPE */
     Signal(SIGPIPE, SIG_IGN);
-    /* Install SIGINT handler */
-    Signal(SIGINT,  sigint_handler);   /* ctrl-c */
+    /* Block SIGINT (ctrl-c) here, before any thread starts, so that every
+     * thread inherits the mask and only shutdown_thread ever takes it
+     */
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGINT);
+    Sigprocmask(SIG_BLOCK, &mask, NULL);
+
+    /* Parse the command line */
+    while ((c = getopt(argc, argv, "hm:t:q:n:l:s:e:a:"
+                       "c:o:p:H:d:D:w:z")) != EOF) {
+        switch (c) {
+        case 'l':             /* number of listening sockets */
+            if ((nacceptors = atoi(optarg)) < 1)
+                usage(argv[0]);
+            break;
+        case 'w':             /* seconds stale objects may be served */
+            if ((stale_window = atol(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        case 'z':             /* store text objects gzipped */
+            compress = 1;
+            break;
+        case 'd':             /* file of the disk cache tier */
+            disk_file = optarg;
+            break;
+        case 'D':             /* size of the disk cache tier in bytes */
+            if ((disk_size = parse_size(optarg)) == 0)
+                usage(argv[0]);
+            break;
+        case 'H':             /* hosts file answered before DNS */
+            hosts_file = optarg;
+            break;
+        case 'p':             /* idle host connections kept per origin */
+            if ((pool_idle = atoi(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        case 'm':             /* concurrency engine */
+            if (!strcmp(optarg, "thread"))
+                engine = ENGINE_THREAD;
+            else if (!strcmp(optarg, "event"))
+                engine = ENGINE_EVENT;
+            else
+                usage(argv[0]);
+            break;
+        case 'n':             /* number of event loops */
+            if ((nloops = atoi(optarg)) < 1)
+                usage(argv[0]);
+            break;
+        case 't':             /* number of worker threads */
+            if ((nworkers = atoi(optarg)) < 1)
+                usage(argv[0]);
+            break;
+        case 'q':             /* connection queue depth */
+            if ((queue_depth = atoi(optarg)) < 1)
+                usage(argv[0]);
+            break;
+        case 's':             /* number of cache shards */
+            nshards = atoi(optarg);
+            break;
+        case 'e':             /* cache eviction policy */
+            if (!strcmp(optarg, "lru"))
+                policy = CACHE_LRU;
+            else if (!strcmp(optarg, "clock"))
+                policy = CACHE_CLOCK;
+            else if (!strcmp(optarg, "gdsf"))
+                policy = CACHE_GDSF;
+            else
+                usage(argv[0]);
+            break;
+        case 'c':             /* cache capacity in bytes */
+            if ((cache_size = parse_size(optarg)) == 0)
+                usage(argv[0]);
+            break;
+        case 'o':             /* largest cached object in bytes */
+            if ((object_size = parse_size(optarg)) == 0)
+                usage(argv[0]);
+            break;
+        case 'a':             /* cache admission filter */
+            if (!strcmp(optarg, "all"))
+                admission = ADMIT_ALL;
+            else if (!strcmp(optarg, "tinylfu"))
+                admission = ADMIT_TINYLFU;
+            else
+                usage(argv[0]);
+            break;
+        case 'h':             /* print help message */
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1)
+        usage(argv[0]);
+
+    if (nloops < 1)
+        nloops = 1;
 
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    /* Initialize cache and upstream connection pool */
+    if (object_size > cache_size)
+        usage(argv[0]);
+    init_stats();
+    cache = init_cache(nshards, policy, admission, cache_size, object_size);
+    cache->compress = compress;
+    if (disk_file != NULL &&
+        (cache->disk = open_disk(disk_file, disk_size)) == NULL) {
+        fprintf(stderr, "Could not open disk cache %s\n", disk_file);
         exit(1);
     }
+    dns = init_dns(hosts_file);
+    flights = init_flights();
+    upstream_pool = init_pool(pool_idle, dns);
+    refreshes = init_refresh(cache, dns, flights, stale_window);
+    Pthread_create(&tid, NULL, shutdown_thread, NULL);
 
-    /* Initialize cache */
-    cache = init_cache();
+    /* With more than one acceptor every socket is bound to the same port
+     * with SO_REUSEPORT, and the kernel spreads new connections across them
+     */
+    listenfds = (int *)Malloc(nacceptors * sizeof(int));
+    for (i = 0; i < nacceptors; i++)
+        listenfds[i] = Open_listenfd_reuse(argv[optind], nacceptors > 1);
+    printf("Proxy server started, listening on port %s\n", argv[optind]);
+    if (nacceptors > 1)
+        printf("Accepting on %d SO_REUSEPORT socket(s)\n", nacceptors);
+    printf("Cache of %zu bytes, objects up to %zu bytes\n", cache->capacity,
+           cache->max_object);
+    printf("Cache split into %u shard(s), %s eviction%s\n", cache->nshards,
+           cache_policies[cache->policy]->name,
+           (admission == ADMIT_TINYLFU) ? ", TinyLFU admission" : "");
+    if (cache->compress)
+        printf("Text objects are stored gzipped\n");
+    if (stale_window > 0)
+        printf("Stale objects served for up to %lds while refreshed\n",
+               stale_window);
+    printf("Statistics at http://localhost:%s%s\n", argv[optind], STATS_PATH);
+    if (cache->disk != NULL)
+        printf("Disk cache of %zu bytes in %s, %u object(s) restored\n",
+               (size_t)cache->disk->header->size, disk_file,
+               cache->disk->count);
 
-    /* Listen for client requests and create new threads when they arrive */
-    listenfd = Open_listenfd(argv[1]);
-    printf("Proxy server started, listening on port %s\n", argv[1]);
-    while (1) {
-        clientlen = sizeof(clientaddr);
-        connfdp = Malloc(sizeof(int));
-        *connfdp = Accept(listenfd, (SA *) &clientaddr, &clientlen);
-        Pthread_create(&tid, NULL, client_job, connfdp);
+    /* Hand all connections to the event loops */
+    if (engine == ENGINE_EVENT) {
+        printf("%d event loop(s)\n", nloops);
+        fflush(stdout);
+        run_event_engine(listenfds, nacceptors, nloops, cache, dns,
+                         refreshes);
+        return 0;
     }
+
+    /* Prethread the worker pool */
+    sbuf_init(&conn_queue, queue_depth);
+    for (i = 0; i < nworkers; i++)
+        Pthread_create(&tid, NULL, worker_thread, NULL);
+    printf("%d worker(s), connection queue depth %d\n", nworkers,
+           queue_depth);
+    printf("Keeping up to %d idle connection(s) per origin\n", pool_idle);
+
+    /* Listen for client requests and queue them for the workers, one
+     * accept loop per socket with the last one in the main thread
+     */
+    accept_fds = listenfds;
+    naccept_fds = nacceptors;
+    for (i = 0; i < nacceptors - 1; i++)
+        Pthread_create(&tid, NULL, acceptor_thread, &listenfds[i]);
+    accept_loop(listenfds[nacceptors - 1]);
+
+    /* Shutting down, leave the process to shutdown_thread */
+    Pthread_exit(NULL);
     return 0;
 }
 
-/*
- * client_job - Safely handles a client thread in a self-contained manner.
- *              A request is processed and if data is found in the cache,
- *              the cache is instructed to return data to the client.
- *              Otherwise the request is forward to the host. Upon successful
- *              completion of a request, or if something goes wrong, any open 
- *              file descriptors are closed and the thread gracefully exists.
- */
-void *client_job(void *connfdp) {
-    int clientfd = *((int *)connfdp); 
-    int serverfd = -1;
-    int request_token, response_token;
+/* acceptor_thread - Thread routine for all but the last accept loop. */
+void *acceptor_thread(void *vargp) {
     Pthread_detach(Pthread_self());
-    Free(connfdp); /* Free allocated connfdp pointer to avoid leak */
+    accept_loop(*(int *)vargp);
+    return NULL;
+}
 
-    /* Cache-related variables */
-    char cache_id[MAXLINE];
-    char cache_object[MAX_OBJECT_SIZE];
-    unsigned int cache_length; 
+/*
+ * accept_loop - Accept clients on listenfd and queue them for the workers.
+ *               Every acceptor feeds the same queue, so a busy worker never
+ *               strands connections behind one socket. Returns once the
+ *               socket is shut down by shutdown_thread.
+ */
+void accept_loop(int listenfd) {
+    socklen_t clientlen;
+    struct sockaddr_storage clientaddr;
+    int connfd;
 
-    /* Process request. Possible return values are:
-     * -1: error, close thread
-     *  1: requested object found in cache
-     *  2: requested object not found in cache, forward to server
-     */
-    request_token = forward_request(clientfd, &serverfd, cache_id,
-                                    cache_object, &cache_length);  
-    if (request_token < 0) {
-        close_openfds(&clientfd, &serverfd);
-        Pthread_exit(NULL);
-    } else if (request_token == 1) {
-        response_token = forward_cache_response(clientfd, cache_object, 
-                                                cache_length);
-    } else {
-        response_token = forward_server_response(clientfd, serverfd,
-                                                 cache_id, cache_object);
+    while (1) {
+        clientlen = sizeof(clientaddr);
+        if ((connfd = accept(listenfd, (SA *) &clientaddr, &clientlen)) < 0) {
+            if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE))
+                return;
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            unix_error("Accept error");
+        }
+        sbuf_insert(&conn_queue, connfd); /* Blocks while the queue is full */
     }
+}
 
-    if (response_token < 0) {
-        close_openfds(&clientfd, &serverfd);
-        Pthread_exit(NULL);
+/*
+ * worker_thread - Body of a pooled worker. Repeatedly takes a connected
+ *                 descriptor from the queue and serves it.
+ */
+void *worker_thread(void *vargp) {
+    Pthread_detach(Pthread_self());
+    while (1) {
+        int clientfd = sbuf_remove(&conn_queue);
+        client_job(clientfd);
     }
-
-    close_openfds(&clientfd, &serverfd);
-    Pthread_exit(NULL);
     return NULL;
 }
 
 /*
- * forward_request - Forward a request from a client to the specified server.
- *                   The request line and headers are parsed and recomposed
- *                   into a new request that is passed on to the host. The only
- *                   supported method is GET. If a port number is not supplied,
- *                   the default port of 80 is used. Before forwarding, the
- *                   cache is searched for a matching object. If one is found,
- *                   the data is written back to the client. Otherwise, the
- *                   request is sent forward to the host.
+ * client_job - Safely handles a client connection in a self-contained manner.
+ *              A request is processed and if data is found in the cache,
+ *              the cache is instructed to return data to the client.
+ *              Otherwise the request is forward to the host. Requests are
+ *              served one after the other from the same Rio buffer, so
+ *              pipelined requests are picked up where the last one ended.
+ *              Once the connection no longer persists, or if something goes
+ *              wrong, any open file descriptors are closed and the worker
+ *              moves on to the next connection. A host connection that can
+ *              be reused has already been returned to the pool by then.
  */
-int forward_request(int clientfd, int *serverfd, char *cache_id,
-                    void *cache_object, unsigned int *cache_length) {
-    char buf[MAXLINE], forward_buf[MAXLINE];
-    char method[MAXLINE], version[MAXLINE]; 
-    char protocol[MAXLINE], hostname[MAXLINE], filename[MAXLINE];
-    char host_port[MAXLINE];
-    char host_hdr[MAXLINE];
-    char *colon;
+void client_job(int clientfd) {
+    request req;
     rio_t rio_client;
+    int request_token;
+    cache_object *hit = NULL;
+    struct timeval timeout = { CLIENT_IDLE_TIMEOUT, 0 };
 
-    /* Read the request line from the client */
+    req.serverfd = -1;
+    req.flight = NULL;
+    req.follow = NULL;
+    req.stale = NULL;
+    req.in_cache = 0;
+
+    /* Don't let an idle client hold on to the worker forever */
+    setsockopt(clientfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
     Rio_readinitb(&rio_client, clientfd);
-    if (!Rio_readlineb(&rio_client, buf, MAXLINE))
-        return -1; 
+    stats_add(STAT_CONNS, 1);
+    stats_add(STAT_CONNS_ACTIVE, 1);
 
-    /* Parse the request line into relevant components */ 
-    if (parse_request(buf, method, version,
-                      protocol, hostname, filename) < 0)
-        return -1; 
+    do {
+        /* Process request. Possible return values are:
+         * -1: error or end of the connection, close it
+         *  1: requested object found in cache and pinned in hit
+         *  0: requested object not found in cache, forwarded to server
+         *  2: request for the proxy itself, such as its statistics
+         *  3: another request is fetching the object, stream its response
+         */
+        request_token = forward_request(&rio_client, &req, &hit);
+        if (request_token == 1) {
+            if (forward_cache_response(clientfd, hit, &req) < 0)
+                req.keep_alive = 0;
+            release_object(hit);
+        } else if (request_token == 0) {
+            if (forward_server_response(clientfd, &req) < 0)
+                req.keep_alive = 0;
+            if (req.serverfd >= 0) {
+                Close(req.serverfd);
+                req.serverfd = -1;
+            }
+        } else if (request_token == 2) {
+            if (forward_local_response(clientfd, &req) < 0)
+                req.keep_alive = 0;
+        } else if (request_token == 3) {
+            if (forward_flight_response(clientfd, &req) < 0)
+                req.keep_alive = 0;
+            flight_leave(flights, req.follow);
+            req.follow = NULL;
+        } else {
+            req.keep_alive = 0;
+        }
+        if (request_token == 0 || request_token == 1 || request_token == 3)
+            stats_phase(PHASE_TOTAL, req.start);
 
-    /* Get the requested port, else set it to 80 by default */
-    if ((colon = index(hostname, ':')) != NULL) {
-        *colon = '\0';    
-        strcpy(host_port, colon+1);
-    } else {
-        strcpy(host_port, "80");
-    } 
+        /* Wake requests that waited for this one to fetch the object */
+        if (req.flight != NULL) {
+            flight_finish(flights, req.flight);
+            req.flight = NULL;
+        }
+        if (req.stale != NULL) {
+            release_object(req.stale);
+            req.stale = NULL;
+        }
+        if (req.in_cache) {
+            leave_cache(cache);
+            req.in_cache = 0;
+        }
+    } while (req.keep_alive);
+
+    close_openfds(&clientfd, &req.serverfd);
+    stats_add(STAT_CONNS_ACTIVE, -1);
+}
+
+/*
+ * forward_request - Forward a request from a client to the specified server.
+ *                   The request line and headers are read into one buffer and
+ *                   tokenized in place as they arrive (see http.c); the new
+ *                   request passed on to the host is made of spans of that
+ *                   buffer. The only supported method is GET. If a port
+ *                   number is not supplied, the default port of 80 is used.
+ *                   Before forwarding, the cache is searched for a matching
+ *                   object. If a fresh one is found, the data is written
+ *                   back to the client. Otherwise, the request is sent
+ *                   forward to the host. A stale object is kept pinned in
+ *                   req->stale and the host is asked whether it is still
+ *                   valid with a conditional request.
+ */
+int forward_request(rio_t *rio_client, request *req, cache_object **hit) {
+    ssize_t n;
+    size_t used, filled = 0;
+    long lookup;
+    int rc, leader;
 
-    /* Make the host header string */
-    strcpy(host_hdr, host_hdr_prefix);
-    strcat(host_hdr, " ");
-    strcat(host_hdr, hostname);
-    strcat(host_hdr, "\r\n");
+    /* Read the request line from the client */
+    head_init(&req->head);
+    if ((n = Rio_readlineb(rio_client, req->head_buf, MAXBUF)) <= 0)
+        return -1; 
+    req->start = stats_clock();
+    rc = head_line(&req->head, req->head_buf, n);
+    used = n;
 
-    /* We only support the GET method */
-    if (strcasecmp(method, "GET"))
+    /* Read client headers right behind it. A client that stops before the
+     * blank line gets its request forwarded as it is.
+     */
+    while (rc == 0 && used < MAXBUF - 1 &&
+           (n = Rio_readlineb(rio_client, req->head_buf + used,
+                              MAXBUF - used)) > 0) {
+        rc = head_line(&req->head, req->head_buf + used, n);
+        used += n;
+    }
+    if (rc < 0 || (rc == 0 && used >= MAXBUF - 1))
+        return -1;
+    req->keep_alive = req->head.keep_alive;
+    req->head.identity = cache->compress;
+    /* Fetch the whole object for a range that can lie in a cacheable one */
+    req->head.slice = (req->head.ranged &&
+                       req->head.range_first <= (long)cache->max_object);
+    if (req->head.local)
+        return 2;
+    if (head_host(&req->head, req->hostname, req->host_port) < 0 ||
+        head_cache_id(&req->head, req->cache_id) < 0)
         return -1;
+    stats_phase(PHASE_PARSE, req->start);
+    stats_add(STAT_REQUESTS, 1);
 
-    /* Compose forwarding request line */
-    strcpy(forward_buf, method);
-    strcat(forward_buf, " ");
-    strcat(forward_buf, filename);
-    strcat(forward_buf, " ");
-    strcat(forward_buf, http_version);
-    /* Read client headers and compose forwarding buffer headers */
-    while (Rio_readlineb(&rio_client, buf, MAXLINE)) {
-        if (!strcmp(buf, "\r\n")) {
-            break;
-        } else if (strstr(buf, "User-Agent:") != NULL) {
-            strcat(forward_buf, user_agent_hdr); 
-        } else if (strstr(buf, "Connection:") != NULL) {
-            strcat(forward_buf, connection_hdr);
-        } else if (strstr(buf, "Proxy-Connection:") != NULL) {
-            strcat(forward_buf, proxy_connection_hdr);
-        } else if (strstr(buf, "Host:") != NULL) {
-            if (strlen(host_hdr) > 0)
-                strcat(forward_buf, host_hdr);        
-            else
-                strcat(forward_buf, buf);
-        } else {
-            strcat(forward_buf, buf); /* Forward any other headers */
+    /* From here until the response is done the request uses the cache, and
+     * holds up shutdown. An idle client waiting above doesn't.
+     */
+    enter_cache(cache);
+    req->in_cache = 1;
+
+    /* Search the cache for an object matching the cache_id.
+     * If a fresh hit is found, the pinned object is handed back to the job
+     * handler.
+     */
+    lookup = stats_clock();
+    *hit = search_cache(cache, req->cache_id);
+    stats_phase(PHASE_LOOKUP, lookup);
+    if (*hit != NULL) {
+        if (object_fresh(*hit, time(NULL))) {
+            stats_add(STAT_HITS, 1);
+            return 1;
         }
+        /* Serve a stale object still in its window, refreshed behind it */
+        if (refresh_stale(refreshes, *hit, req->cache_id, req->head_buf, used,
+                          time(NULL))) {
+            stats_add(STAT_HITS, 1);
+            stats_add(STAT_STALE, 1);
+            return 1;
+        }
+        req->stale = *hit;
     }
-    strcat(forward_buf, "\r\n"); /* Don't forget to add final line */
-    /* Compose cache_id from request */
-    strcpy(cache_id, method);
-    strcat(cache_id, " ");
-    strcat(cache_id, hostname);
-    strcat(cache_id, ":");
-    strcat(cache_id, host_port); 
-    strcat(cache_id, " ");
-    strcat(cache_id, filename);
-    /* Search the cache for an object matching the cache_id.
-     * If a hit is found, cache_object and cache_length will be filled before
-     * returning to the job handler.
+
+    /* Only one of several concurrent misses on an object goes to the host.
+     * The others wait for it, and stream its response if it streams a
+     * complete or still growing one, or else try the cache again. Either
+     * way the cache is searched once more, since the object may have been
+     * added or refreshed since the first search.
      */
-    if (search_cache(cache, cache_id, cache_object, cache_length) != -1) {
-        return 1;
+    req->flight = flight_join(flights, req->cache_id, &leader);
+    if (!leader) {
+        rc = flight_wait(flights, req->flight, &filled);
+        if (rc >= 0 && req->flight->data != NULL &&
+            (rc == 1 || filled == req->flight->total)) {
+            req->follow = req->flight;
+            req->flight = NULL;
+            stats_add(STAT_HITS, 1);
+            return 3;
+        }
+        flight_leave(flights, req->flight);
+        req->flight = NULL;
+    }
+    if ((*hit = search_cache(cache, req->cache_id)) != NULL) {
+        if (req->stale != NULL)
+            release_object(req->stale);
+        req->stale = NULL;
+        if (object_fresh(*hit, time(NULL))) {
+            stats_add(STAT_HITS, 1);
+            return 1;
+        }
+        req->stale = *hit;
+    }
+
+    /* Ask the host to confirm the stale copy rather than send it again */
+    if (req->stale != NULL &&
+        head_validators(&req->head, req->stale->data,
+                        req->stale->hdr_length ? req->stale->hdr_length
+                                               : req->stale->length) == 0) {
+        release_object(req->stale);
+        req->stale = NULL;
     }
 
     /* Forward request from client to host */
-    *serverfd = open_clientfd(hostname, host_port);
-    if (*serverfd < 0) {
-        return -1;
+    stats_add(STAT_MISSES, 1);
+    return send_request(req, req->head.http11);
+}
+
+/*
+ * send_request - Write the rewritten request to the host with one writev, on
+ *                a pooled connection if allow_reuse is set and one is idle.
+ *                A write that fails on a pooled connection is retried once
+ *                on a fresh connection, since the host may have closed it.
+ *                Only an HTTP/1.1 client's request is sent as HTTP/1.1 and
+ *                asks the host to persist, since only such a client can
+ *                read the chunked body the host may then send.
+ */
+int send_request(request *req, int allow_reuse) {
+    struct iovec iov[HEAD_IOV_MAX];
+    long start = stats_clock();
+    int n;
+
+    if (allow_reuse)
+        req->serverfd = pool_get(upstream_pool, req->hostname,
+                                 req->host_port, &req->reused);
+    else {
+        req->serverfd = dns_connect(dns, req->hostname, req->host_port);
+        req->reused = 0;
     }
-    if (Rio_writen(*serverfd, forward_buf, strlen(forward_buf)) == -1)
+    if (req->serverfd < 0)
         return -1;
+    stats_phase(PHASE_CONNECT, start);
+
+    /* Only pooled connections are asked to persist */
+    n = head_iov(&req->head, iov,
+                 upstream_pool->max_idle > 0 && req->head.http11);
+    if (writev_full(req->serverfd, iov, n) < 0) {
+        Close(req->serverfd);
+        req->serverfd = -1;
+        return req->reused ? send_request(req, 0) : -1;
+    }
+    req->sent = stats_clock();
     return 0;
 }
 
-/* forward_cache_response - Write the data from an object in the cache
- *                          directly to the client.
+/* forward_cache_response - Write the data from a pinned object in the cache
+ *                          directly to the client, without copying it out
+ *                          of the cache first. Our Connection header goes
+ *                          in front of the blank line ending the headers.
+ *                          An object without a known header end is written
+ *                          as is, and the connection closed afterwards. A
+ *                          packed object is sent gzipped if the client
+ *                          accepts it, or else inflated (see gzip.c). A
+ *                          request for a byte range of any other object
+ *                          gets a 206 with that slice of its body, and a
+ *                          conditional request the object still matches a
+ *                          304 without one.
  */
-int forward_cache_response(int clientfd, void *cache_object, 
-                           unsigned int cache_length) {
-    if (Rio_writen(clientfd, cache_object, cache_length) == -1)
+int forward_cache_response(int clientfd, cache_object *object,
+                           request *req) {
+    struct iovec iov[GZIP_IOV_MAX];
+    char hdrs[GZIP_HDRS_MAX], head[MAXBUF];
+    char *data = object->data, *body;
+    const char *conn_hdr = req->keep_alive ? keep_alive_hdr : close_hdr;
+    size_t blank, first, count;
+    ssize_t written;
+    int n;
+
+    if (object->hdr_length == 0) {
+        req->keep_alive = 0;
+        if (Rio_writen(clientfd, data, object->length) == -1)
+            return -1;
+        stats_add(STAT_BYTES_CACHE, object->length);
+        return 0;
+    }
+
+    blank = (data[object->hdr_length] == '\r') ? 2 : 1;
+    if ((n = head_not_modified(&req->head, data, object->hdr_length,
+                               conn_hdr, head, sizeof(head))) >= 0) {
+        iov[0].iov_base = head;
+        iov[0].iov_len = n;
+        written = writev_full(clientfd, iov, 1);
+    } else if (object->identity_length > 0) {
+        if ((n = gzip_iov(object, req->head.accept_gzip, conn_hdr, hdrs,
+                          &body, iov)) < 0)
+            return -1;
+        written = writev_full(clientfd, iov, n);
+        if (body != NULL)
+            Free(body);
+    } else if (req->head.ranged &&
+               (n = head_slice(&req->head, data, object->hdr_length,
+                               object->length - object->hdr_length - blank,
+                               conn_hdr, head, sizeof(head), &first,
+                               &count)) >= 0) {
+        iov[0].iov_base = head;
+        iov[0].iov_len = n;
+        iov[1].iov_base = data + object->hdr_length + blank + first;
+        iov[1].iov_len = count;
+        written = writev_full(clientfd, iov, 2);
+    } else {
+        iov[0].iov_base = data;
+        iov[0].iov_len = object->hdr_length;
+        iov[1].iov_base = (void *)conn_hdr;
+        iov[1].iov_len = strlen(conn_hdr);
+        iov[2].iov_base = data + object->hdr_length;
+        iov[2].iov_len = object->length - object->hdr_length;
+        written = writev_full(clientfd, iov, 3);
+    }
+    if (written < 0)
         return -1;
+    stats_add(STAT_BYTES_CACHE, written);
     return 0;
-} 
+}
 
 /*
  * forward_server_response - Pass a request response from a host back to the
  *                    requesting client. The returned data is also loaded into
- *                    the cache, evicting objects if necessary. The headers and 
- *                    response body are simply written back to the client in 
- *                    buffer lines of size MAXLINE.
+ *                    the cache, evicting objects if necessary. The object is
+ *                    collected in a heap buffer that only lives for the
+ *                    duration of the miss. A 304 answer to a revalidation
+ *                    refreshes the stale cached copy instead, which is then
+ *                    served. If the response was framed and the host agreed
+ *                    to keep the connection open, the connection is given
+ *                    back to the pool.
  */
-int forward_server_response(int clientfd, int serverfd, char *cache_id, 
-                            void *cache_buf) {
-    unsigned int nbytes = 0, obj_size = 0;
+int forward_server_response(int clientfd, request *req) {
     char buf[MAXLINE];
     rio_t rio_server;
-    int valid_size = 1;
-    unsigned int cache_length = 0;
+    cachebuf_t cb;
+    int reusable = 0;
+    int rc, status = 0;
 
-    Rio_readinitb(&rio_server, serverfd);
-    /* Read the response line from the host */
-    if (!Rio_readlineb(&rio_server, buf, MAXLINE))
-        return -1; 
+    Rio_readinitb(&rio_server, req->serverfd);
+    /* Read the response line from the host. A pooled connection that was
+     * closed just before we used it gives EOF, so try again on a fresh one.
+     */
+    if (Rio_readlineb(&rio_server, buf, MAXLINE) <= 0) {
+        if (!req->reused)
+            return -1;
+        Close(req->serverfd);
+        req->serverfd = -1;
+        if (send_request(req, 0) < 0)
+            return -1;
+        Rio_readinitb(&rio_server, req->serverfd);
+        if (Rio_readlineb(&rio_server, buf, MAXLINE) <= 0)
+            return -1;
+    }
+    stats_phase(PHASE_FIRST_BYTE, req->sent);
+
+    /* The stale copy is still valid */
+    sscanf(buf, "%*s %d", &status);
+    if (req->stale != NULL && status == 304) {
+        stats_add(STAT_REVALIDATED, 1);
+        rc = refresh_cache_response(clientfd, req, &rio_server, buf,
+                                    &reusable);
+    } else {
+        /* Only misses need a buffer to collect the object for the cache */
+        cb.data = NULL;
+        cb.length = cb.capacity = 0;
+        cb.hdr_length = 0;
+        cb.valid = 1;
+        cb.stream = NULL;
+        cb.skip = 0;
+        cb.left = -1;
+        rc = relay_server_response(clientfd, req, &rio_server, buf, &cb,
+                                   &reusable);
+
+        /* If the response is cacheable and the cache buf is the right
+         * size, add it to the cache
+         */
+        if (rc == 0 && cb.valid)
+            if (add_to_cache(cache, req->cache_id, cb.data, cb.length,
+                             cb.hdr_length, cb.expires) == -1)
+                rc = -1;
+        if (cb.data != NULL && cb.stream == NULL)
+            Free(cb.data);
+    }
+
+    /* Keep the connection only if nothing past the response was read */
+    if (rc == 0 && reusable && rio_server.rio_cnt == 0) {
+        pool_put(upstream_pool, req->hostname, req->host_port,
+                 req->serverfd);
+        req->serverfd = -1;
+    }
+    return rc;
+}
+
+/*
+ * forward_local_response - Answer a request made to the proxy itself rather
+ *                          than to a host: the statistics at STATS_PATH, or
+ *                          a 404 (see stats.c).
+ */
+int forward_local_response(int clientfd, request *req) {
+    char *buf = (char *)Malloc(STATS_RESPONSE_MAX);
+    ssize_t n;
+    int rc = 0;
+
+    n = stats_response(req->head.path.iov_base, req->head.path.iov_len,
+                       req->keep_alive ? keep_alive_hdr : close_hdr, buf,
+                       STATS_RESPONSE_MAX);
+    if (n < 0 || Rio_writen(clientfd, buf, n) == -1)
+        rc = -1;
+    Free(buf);
+    return rc;
+}
+
+/*
+ * forward_flight_response - Serve a request from the response another
+ *                    request is fetching for the same object (see
+ *                    flight.c), writing each piece to the client as soon as
+ *                    the leader has it. Like a hit, the response gets our
+ *                    own Connection header in front of the blank line, or
+ *                    is cut down to a 206 for a byte range. A response the
+ *                    leader didn't get all of fails here too.
+ */
+int forward_flight_response(int clientfd, request *req) {
+    flight *f = req->follow;
+    const char *conn_hdr = req->keep_alive ? keep_alive_hdr : close_hdr;
+    char head[MAXBUF];
+    struct iovec iov[2];
+    size_t sent, end, filled = 0, blank, first, count;
+    ssize_t n;
+    int rc;
+
+    /* The whole head is in as soon as the response streams */
+    if ((rc = flight_wait(flights, f, &filled)) < 0)
+        return -1;
+    blank = (f->data[f->hdr_length] == '\r') ? 2 : 1;
+    if (req->head.ranged &&
+        (n = head_slice(&req->head, f->data, f->hdr_length,
+                        f->total - f->hdr_length - blank, conn_hdr, head,
+                        sizeof(head), &first, &count)) >= 0) {
+        iov[0].iov_base = head;
+        iov[0].iov_len = n;
+        iov[1].iov_len = 0;
+        sent = f->hdr_length + blank + first;
+        end = sent + count;
+    } else {
+        iov[0].iov_base = f->data;
+        iov[0].iov_len = f->hdr_length;
+        iov[1].iov_base = (void *)conn_hdr;
+        iov[1].iov_len = strlen(conn_hdr);
+        sent = f->hdr_length;
+        end = f->total;
+    }
+    if ((n = writev_full(clientfd, iov, 2)) < 0)
+        return -1;
+    stats_add(STAT_BYTES_CACHE, n);
+
+    /* Then whatever part of the body the client wants, as it arrives */
+    while (1) {
+        if (filled > sent) {
+            n = ((filled < end) ? filled : end) - sent;
+            if (Rio_writen(clientfd, f->data + sent, n) == -1)
+                return -1;
+            stats_add(STAT_BYTES_CACHE, n);
+            sent += n;
+        }
+        if (sent == end)
+            return 0;
+        if (rc == 0) /* Finished short of the end */
+            return -1;
+        if ((rc = flight_wait(flights, f, &filled)) < 0)
+            return -1;
+    }
+}
+
+/*
+ * refresh_cache_response - Finish reading a 304 response to a revalidation,
+ *                    whose status line is in buf, then move the stale
+ *                    object's expiry on and serve it from the cache. The
+ *                    new expiry comes from the stored headers updated with
+ *                    those of the 304, since a 304 needn't repeat them all.
+ *                    The stored headers themselves are left as they were.
+ */
+int refresh_cache_response(int clientfd, request *req, rio_t *rio_server,
+                           char *buf, int *reusable) {
+    cache_object *object = req->stale;
+    freshness f;
+    time_t expires;
+    int keep_alive = request_keep_alive(buf);
+
+    freshness_scan(&f, object->data,
+                   object->hdr_length ? object->hdr_length : object->length);
+    f.age = 0;
+    while (1) {
+        if (Rio_readlineb(rio_server, buf, MAXLINE) <= 0)
+            return -1;
+        if (!strcmp(buf, "\r\n") || !strcmp(buf, "\n"))
+            break;
+        keep_alive = connection_keep_alive(buf, keep_alive);
+        freshness_header(&f, buf);
+    }
+    if ((expires = freshness_expiry(&f, time(NULL))) >= 0)
+        refresh_object(object, expires);
 
-    /* Append response line from host to cache buffer */
-    if (valid_size)
-        valid_size = cachebuf_append(cache_buf, &cache_length, buf,
-                                     strlen(buf)); 
+    *reusable = keep_alive;
+    return forward_cache_response(clientfd, object, req);
+}
+
+/*
+ * relay_server_response - Copy the response that starts with the status line
+ *                    in buf from the host to the client, appending it to
+ *                    the cache buffer while it still fits. Every byte goes
+ *                    through the response parser (see parser.c), which
+ *                    finds where the response ends: no body for 1xx, 204
+ *                    and 304 responses, chunked transfer coding,
+ *                    Content-Length, or else everything up to EOF. The
+ *                    hop-by-hop Connection, Keep-Alive and Proxy-Connection
+ *                    headers are dropped, and the client gets our own
+ *                    Connection header instead, which says close if the
+ *                    response is framed by EOF. The response is only
+ *                    collected for the cache if its status and headers allow
+ *                    it, until the expiry they give. Requests waiting for
+ *                    this one to fetch the object stream it as it arrives
+ *                    if its length is known. A request for a byte range of
+ *                    the object holds the head back until it is complete,
+ *                    and gets a 206 with only the range of the body if the
+ *                    response is a 200 of known length. *reusable is set if
+ *                    the host connection can carry another request
+ *                    afterwards.
+ */
+int relay_server_response(int clientfd, request *req, rio_t *rio_server,
+                          char *buf, cachebuf_t *cb, int *reusable) {
+    http_parser parser;
+    const char *conn_hdr;
+    freshness f;
+    char head[MAXBUF];
+    char *data;
+    size_t total, first, count;
+    int headfd = req->head.slice ? -1 : clientfd;
+    ssize_t n;
+
+    parser_init(&parser, PARSE_RESPONSE);
+    parser_execute(&parser, buf, strlen(buf));
+    if (parser.state != PARSE_HEADER)
+        return -1;
+    freshness_init(&f, parser.status);
 
     /* Write response line to client */
-    if (Rio_writen(clientfd, buf, strlen(buf)) == -1)
+    if (relay_bytes(headfd, buf, strlen(buf), cb) < 0)
         return -1;
 
-    /* Read and forward response headers from the host */
-    while (strcmp(buf, "\r\n") && strlen(buf) > 0) {
-        if (!Rio_readlineb(&rio_server, buf, MAXLINE))
+    /* Read and forward response headers from the host, until the parser
+     * has seen the blank line
+     */
+    while (1) {
+        if ((n = Rio_readlineb(rio_server, buf, MAXLINE)) <= 0)
             return -1; 
+        parser_execute(&parser, buf, n);
+        if (parser.state == PARSE_ERROR)
+            return -1;
+        if (parser.state != PARSE_HEADER)
+            break;
 
-        /* Read the object size from the response headers */
-        if (strstr(buf, "Content-Length") != NULL) {
-            sscanf(buf, "Content-Length: %d", &obj_size);
-        }
-
-        /* Append header line from host to cache buffer */
-        if (valid_size)
-            valid_size = cachebuf_append(cache_buf, &cache_length, buf,
-                                         strlen(buf)); 
+        if (!strncasecmp(buf, "Connection:", 11) ||
+            !strncasecmp(buf, "Keep-Alive:", 11) ||
+            !strncasecmp(buf, "Proxy-Connection:", 17))
+            continue;
+        freshness_header(&f, buf);
 
-        /* Write header line to client */
-        if (Rio_writen(clientfd, buf, strlen(buf)) == -1)
+        if (relay_bytes(headfd, buf, strlen(buf), cb) < 0)
             return -1;
     }
 
-    /* Read and forward response body from the host */
-    if (obj_size > 0) {
-	while (obj_size > 0) {
-	    if (obj_size >= MAXLINE) {
-		if ((nbytes = Rio_readnb(&rio_server, buf, MAXLINE)) < 0)
-		    return -1; 
+    /* The client connection can only persist if the body has an end */
+    if (!parser.framed)
+        req->keep_alive = 0;
+    conn_hdr = req->keep_alive ? keep_alive_hdr : close_hdr;
+    cb->hdr_length = cb->length;
 
-                if (valid_size)
-                    valid_size = cachebuf_append(cache_buf, &cache_length,
-                                                 buf, nbytes); 
+    /* A held back head is only complete in the cache buffer, which always
+     * takes it unless it is huge. Send it cut down for the range, or whole.
+     */
+    if (headfd < 0) {
+        if (!cb->valid)
+            return -1;
+        if (!parser.chunked && parser.content_length >= 0 &&
+            (n = head_slice(&req->head, cb->data, cb->hdr_length,
+                            parser.content_length, conn_hdr, head,
+                            sizeof(head), &first, &count)) >= 0) {
+            if (Rio_writen(clientfd, head, n) == -1)
+                return -1;
+            cb->skip = strlen(buf) + first;
+            cb->left = count;
+        } else if (Rio_writen(clientfd, cb->data, cb->hdr_length) == -1)
+            return -1;
+    }
+    if (cb->left < 0 &&
+        Rio_writen(clientfd, (void *)conn_hdr, strlen(conn_hdr)) == -1)
+        return -1;
+    if (relay_bytes(clientfd, buf, strlen(buf), cb) < 0)
+        return -1;
 
-                if (Rio_writen(clientfd, buf, nbytes) == -1)
-                    return -1;
+    /* Don't collect a response that may not be cached, or that is too
+     * large for the cache, so the body can skip the buffer
+     */
+    if ((cb->expires = freshness_expiry(&f, time(NULL))) < 0 ||
+        (!parser.chunked && parser.content_length >= 0 &&
+         (size_t)parser.content_length > cache->max_object))
+        cachebuf_drop(cb);
 
-		obj_size -= MAXLINE;
-	    } else {
-		if ((nbytes = Rio_readnb(&rio_server, buf, obj_size)) < 0)
-		    return -1; 
+    /* Requests waiting for this fetch can stream a cacheable response of
+     * known length while it arrives, out of a buffer of its full length
+     */
+    if (req->flight != NULL && cb->valid && !parser.chunked &&
+        parser.content_length >= 0 &&
+        cb->length + parser.content_length <= cache->max_object) {
+        total = cb->length + parser.content_length;
+        data = flight_stream(flights, req->flight, cb->data, cb->length,
+                             cb->hdr_length, total);
+        Free(cb->data);
+        cb->data = data;
+        cb->capacity = total;
+        cb->stream = req->flight;
+    }
 
-                if (valid_size)
-                    valid_size = cachebuf_append(cache_buf, &cache_length,
-                                                 buf, nbytes); 
+    /* Read and forward response body from the host. Once the range has
+     * been sent, the rest of an object that won't be cached isn't read.
+     */
+    if ((n = relay_body(clientfd, rio_server, &parser, cb)) < 0)
+        return -1;
+    if (n > 0) {
+        *reusable = 0;
+        return 0;
+    }
 
-                if (Rio_writen(clientfd, buf, nbytes) == -1)
-                    return -1;
+    /* Give the cached copy a length so hits can keep the client, and a
+     * plain body that an HTTP/1.0 client can read too
+     */
+    if (!parser.framed)
+        cachebuf_frame(cb);
+    else if (parser.chunked)
+        cachebuf_dechunk(cb);
 
-                obj_size = 0;
-	    }
-	}
-    /* If response header had no size line */
-    } else {
-        while ((nbytes = Rio_readnb(&rio_server, buf, MAXLINE)) > 0) {
+    *reusable = parser.keep_alive;
+    return 0;
+}
 
-            if (valid_size)
-                valid_size = cachebuf_append(cache_buf, &cache_length,
-                                             buf, nbytes); 
+/*
+ * relay_body - Relay the body of a response straight out of the Rio buffer,
+ *              feeding it to the parser, until the parser finds the end of
+ *              the response. A host that closes the connection early
+ *              produced a truncated object, which is reported as an error
+ *              so it never reaches the cache. Once the object is known not
+ *              to fit in the cache, body bytes that the parser needn't see,
+ *              such as the data of a chunk, are spliced from socket to
+ *              socket whenever the Rio buffer is empty, unless the client
+ *              only gets a range of them. Returns 1 if it stops early,
+ *              with the range sent and no need to read the rest.
+ */
+int relay_body(int clientfd, rio_t *rio_server, http_parser *parser,
+               cachebuf_t *cb) {
+    ssize_t n;
+    long left, moved;
 
-            if (Rio_writen(clientfd, buf, nbytes) == -1)
+    while (parser->state != PARSE_DONE) {
+        if (cb->left == 0 && !cb->valid)
+            return 1;
+        if (rio_server->rio_cnt <= 0) {
+            left = parser_body_left(parser);
+            if (!cb->valid && cb->left < 0 && left != 0) {
+                moved = zcopy_stream(rio_server->rio_fd, clientfd, left);
+                if (moved < 0 || (left > 0 && moved != left))
+                    return -1;
+                stats_add(STAT_BYTES_ORIGIN, moved);
+                if (left < 0) /* EOF */
+                    return parser_finish(parser);
+                parser_skip(parser, moved);
+                continue;
+            }
+            if ((n = Rio_fill(rio_server)) < 0)
                 return -1;
+            if (n == 0) /* EOF */
+                return parser_finish(parser);
         }
-    }
 
-    /* If the cache buf is the right size, add it to the cache */
-    if (valid_size)
-        if (add_to_cache(cache, cache_id, cache_buf, cache_length) == -1)
+        n = parser_execute(parser, rio_server->rio_bufptr,
+                           rio_server->rio_cnt);
+        if (parser->state == PARSE_ERROR)
             return -1;
-
+        if (relay_bytes(clientfd, rio_server->rio_bufptr, n, cb) < 0)
+            return -1;
+        rio_server->rio_bufptr += n;
+        rio_server->rio_cnt -= n;
+    }
     return 0;
 }
 
-/* cachebuf_append - Append data to the cache object buffer, returning 1 if
- *                   the total size is less than MAX_OBJECT_SIZE and 0
- *                   otherwise. This is an ugly bit of code, but needed because
- *                   cache_buffer is a void buffer due to the need to use
- *                   memcpy.
- */ 
-int cachebuf_append(void *cache_buffer, unsigned int *cachebuf_length,
-                    char *buf, unsigned int buf_length) {
+/*
+ * relay_bytes - Write part of a response to the client and append it to the
+ *               cache buffer, publishing it first to any requests streaming
+ *               the response. Only the window of the response the client
+ *               asked for is written, and nothing if clientfd is -1.
+ */
+int relay_bytes(int clientfd, char *buf, size_t n, cachebuf_t *cb) {
+    size_t k;
 
-    if ((*cachebuf_length + buf_length) > MAX_OBJECT_SIZE)
+    cachebuf_append(cb, buf, n);
+    if (clientfd < 0)
         return 0;
-    void *tmp = (void *)((char *)cache_buffer + *cachebuf_length);
-    memcpy(tmp, buf, buf_length);
-    *cachebuf_length = *cachebuf_length + buf_length; 
-    return 1;
+    k = (cb->skip < n) ? cb->skip : n;
+    cb->skip -= k;
+    buf += k;
+    n -= k;
+    if (cb->left >= 0) {
+        if (n > (size_t)cb->left)
+            n = cb->left;
+        cb->left -= n;
+    }
+    if (n > 0 && Rio_writen(clientfd, buf, n) == -1)
+        return -1;
+    stats_add(STAT_BYTES_ORIGIN, n);
+    return 0;
 }
 
-/*
- * parse_request - splits a request line into method, url, and version.
- *                 The url is further split into the protocol, hostname,
- *                 and filename (requested resource). Back in the caller,
- *                 the hostname will be further parsed to see if it contains
- *                 a port number.
+/* cachebuf_reserve - Make room for n more bytes in the cache buffer, doubling
+ *                    it as needed. Once the object would be larger than the
+ *                    cache's max_object it can't be cached, so the buffer is
+ *                    dropped and -1 returned.
  */
-int parse_request(char *buf, char *method, char *version,
-                  char *protocol, char *hostname, char *filename) {
+int cachebuf_reserve(cachebuf_t *cb, size_t n) {
+    if (!cb->valid)
+        return -1;
+    if (cb->length + n > cache->max_object ||
+        (cb->stream != NULL && cb->length + n > cb->capacity)) {
+        cachebuf_drop(cb);
+        return -1;
+    }
+    if (cb->length + n > cb->capacity) {
+        if (cb->capacity == 0)
+            cb->capacity = CACHEBUF_INIT;
+        while (cb->capacity < cb->length + n)
+            cb->capacity *= 2;
+        if (cb->capacity > cache->max_object)
+            cb->capacity = cache->max_object;
+        cb->data = (char *)Realloc(cb->data, cb->capacity);
+    }
+    return 0;
+}
 
-    char url[MAXLINE];
+/* cachebuf_append - Append data to the cache buffer while it is valid. */
+void cachebuf_append(cachebuf_t *cb, char *buf, size_t n) {
+    if (cachebuf_reserve(cb, n) < 0)
+        return;
+    memcpy(cb->data + cb->length, buf, n);
+    cb->length += n;
+    if (cb->stream != NULL)
+        flight_fill(flights, cb->stream, cb->length);
+}
 
-    /* Set requested filename to '/' by default */
-    strcpy(filename, "/");
+/* cachebuf_drop - Give up on caching the response and free the buffer,
+ *                 unless it belongs to the fetch being streamed.
+ */
+void cachebuf_drop(cachebuf_t *cb) {
+    cb->valid = 0;
+    if (cb->data != NULL && cb->stream == NULL)
+        Free(cb->data);
+    cb->data = NULL;
+}
 
-    sscanf(buf, "%s %s %s", method, url, version);
-    sscanf(url, "%[^:]://%[^/]%s", protocol, hostname, filename); 
-    return 0;
+/* cachebuf_frame - Insert a Content-Length header in front of the blank line
+ *                  of a complete response whose body was ended by EOF.
+ */
+void cachebuf_frame(cachebuf_t *cb) {
+    char hdr[64];
+    char *data;
+    size_t hdr_end = cb->hdr_length;
+    size_t blank, n;
+
+    if (!cb->valid)
+        return;
+    blank = (cb->data[hdr_end] == '\r') ? 2 : 1;
+    n = sprintf(hdr, "Content-Length: %zu\r\n",
+                cb->length - hdr_end - blank);
+    if (cachebuf_reserve(cb, n) < 0)
+        return;
+    data = cb->data;
+    memmove(data + hdr_end + n, data + hdr_end, cb->length - hdr_end);
+    memcpy(data + hdr_end, hdr, n);
+    cb->length += n;
+    cb->hdr_length += n;
+}
+
+/* cachebuf_dechunk - Decode the chunked body of a complete response in the
+ *                    cache buffer and replace its Transfer-Encoding header
+ *                    by a Content-Length. A response with any other transfer
+ *                    coding, or a malformed body, isn't cached.
+ */
+void cachebuf_dechunk(cachebuf_t *cb) {
+    char *data = cb->data, *p, *nl, *value;
+    size_t hdr_end = cb->hdr_length, blank, n;
+    long length;
+
+    if (!cb->valid)
+        return;
+
+    /* Drop the Transfer-Encoding header, which must say chunked alone */
+    for (p = data; p < data + hdr_end &&
+         (nl = memchr(p, '\n', data + hdr_end - p)) != NULL; ) {
+        if (strncasecmp(p, "Transfer-Encoding:", 18)) {
+            p = nl + 1;
+            continue;
+        }
+        for (value = p + 18; *value == ' ' || *value == '\t'; value++)
+            ;
+        if (strncasecmp(value, "chunked", 7) ||
+            strspn(value + 7, " \t\r") != (size_t)(nl - (value + 7))) {
+            cachebuf_drop(cb);
+            return;
+        }
+        n = nl + 1 - p;
+        memmove(p, nl + 1, cb->length - (nl + 1 - data));
+        cb->length -= n;
+        hdr_end -= n;
+    }
+    cb->hdr_length = hdr_end;
+
+    blank = (data[hdr_end] == '\r') ? 2 : 1;
+    if ((length = parser_dechunk(data + hdr_end + blank,
+                                 cb->length - hdr_end - blank)) < 0) {
+        cachebuf_drop(cb);
+        return;
+    }
+    cb->length = hdr_end + blank + length;
+    cachebuf_frame(cb);
+}
+
+/*
+ * writev_full - writev that keeps going after short writes, like rio_writen.
+ *               The iovec array is used up in the process.
+ */
+ssize_t writev_full(int fd, struct iovec *iov, int iovcnt) {
+    ssize_t n, total = 0;
+
+    while (iovcnt > 0) {
+        if ((n = writev(fd, iov, iovcnt)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        total += n;
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return total;
 }
 
 /*
@@ -392,13 +1340,113 @@ void close_openfds(int *clientfd, int *serverfd) {
         Close(*serverfd);
 }
 
-/* 
- * sigint_handler - The kernel sends a SIGINT to the shell whenver the
- *                  user types ctrl-c at the keyboard. We need to free 
- *                  the cache if this happens to avoid a memory leak.  
+/*
+ * parse_size - Parse a byte count with an optional K, M or G suffix, e.g.
+ *              "64M". Returns 0 if the argument isn't a valid size, is
+ *              negative, or doesn't fit in a size_t once scaled.
  */
-void sigint_handler(int sig) 
+size_t parse_size(char *arg) {
+    char *end;
+    unsigned long long size;
+    int shift = 0;
+
+    errno = 0;
+    size = strtoull(arg, &end, 10);
+    switch (toupper(*end)) {
+    case 'G':
+        shift += 10;
+        /* Fall through */
+    case 'M':
+        shift += 10;
+        /* Fall through */
+    case 'K':
+        shift += 10;
+        end++;
+        break;
+    }
+    if (end == arg || *end != '\0' || errno == ERANGE ||
+        strchr(arg, '-') != NULL || size > SIZE_MAX >> shift)
+        return 0;
+    return (size_t)size << shift;
+}
+
+/*
+ * usage - Print a help message and exit.
+ */
+void usage(char *prog)
 {
-    destroy_cache(cache);
+    printf("Usage: %s [-h] [-m thread|event] [-t workers] [-q depth] "
+           "[-n loops]\n       [-l n] [-s shards] [-e lru|clock|gdsf] "
+           "[-a all|tinylfu]\n       [-c bytes] [-o bytes] [-p idle] "
+           "[-H hosts] [-d file] [-D bytes] [-w secs]\n       [-z] <port>\n",
+           prog);
+    printf("   -h          print this message\n");
+    printf("   -m engine   worker thread pool (default) or epoll event "
+           "loops\n");
+    printf("   -t workers  number of prethreaded workers (default %d)\n",
+           DEF_WORKERS);
+    printf("   -q depth    connection queue depth (default %d)\n",
+           DEF_QUEUE_DEPTH);
+    printf("   -n loops    number of event loops (default one per core)\n");
+    printf("   -l n        listen on n SO_REUSEPORT sockets, each with its own "
+           "accept loop\n               (default %d)\n", DEF_ACCEPTORS);
+    printf("   -s shards   split the cache into independently locked shards\n");
+    printf("   -e policy   eviction policy, exact lru (default), clock or "
+           "gdsf\n");
+    printf("   -a filter   admission filter, all (default) or tinylfu\n");
+    printf("   -c bytes    cache capacity, with an optional K, M or G suffix "
+           "(default %d)\n", MAX_CACHE_SIZE);
+    printf("   -o bytes    largest object cached, no larger than the capacity "
+           "(default %d)\n", MAX_OBJECT_SIZE);
+    printf("   -p idle     idle keep-alive connections kept per origin "
+           "(default %d, 0 disables)\n", DEF_POOL_IDLE);
+    printf("   -H hosts    hosts file to resolve names from before DNS\n");
+    printf("   -d file     keep evicted objects in a disk cache in file, "
+           "kept across restarts\n");
+    printf("   -D bytes    size of a new disk cache (default %d)\n",
+           DISK_DEF_SIZE);
+    printf("   -w secs     serve stale objects for up to secs past expiry "
+           "while they are\n               refreshed in the background "
+           "(default 0, only as\n               stale-while-revalidate "
+           "allows)\n");
+    printf("   -z          store text objects gzipped, and serve them gzipped "
+           "to clients\n               that accept it\n");
+    exit(1);
+}
+
+/*
+ * shutdown_thread - Wait for the SIGINT that the user sends with ctrl-c,
+ *                   which every other thread blocks, then shut down in
+ *                   order: stop the accept loops, wait for the requests
+ *                   using the cache to finish, and save and free the cache
+ *                   and the connection pool. The event loops simply stop at
+ *                   their next batch. A request still running after
+ *                   SHUTDOWN_TIMEOUT seconds is abandoned; the cache is
+ *                   then saved but not freed, since it may still be in use.
+ */
+void *shutdown_thread(void *vargp)
+{
+    sigset_t mask;
+    int i, sig;
+
+    Pthread_detach(Pthread_self());
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGINT);
+    while (sigwait(&mask, &sig) != 0)
+        ;
+    printf("SIGINT caught, shutting down...\n");
+
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    for (i = 0; i < naccept_fds; i++)
+        shutdown(accept_fds[i], SHUT_RDWR);
+
+    if (close_cache(cache, SHUTDOWN_TIMEOUT) == 0) {
+        destroy_pool(upstream_pool);
+        destroy_cache(cache);
+    } else {
+        printf("Requests still running after %ds, saving the cache "
+               "without freeing it\n", SHUTDOWN_TIMEOUT);
+        save_cache(cache);
+    }
     exit(0);
 }
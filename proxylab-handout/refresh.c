@@ -0,0 +1,298 @@
+/* Background refresh for Proxylab, CMU 15-213/513, Fall 2015
+ * Author: Aleksander Bapst (abapst)
+ *
+ * A request that finds its object stale needn't wait for the host. While
+ * the object is within its stale window, the seconds its
+ * stale-while-revalidate directive gives or else the proxy's default (-w),
+ * the request is answered from it at once and a refresh of the object is
+ * queued for one of REFRESH_THREADS background threads. Objects that say
+ * must-revalidate or no-cache are never served stale.
+ *
+ * The refresh sends the request that found the object stale again, in full
+ * and with the object's validators, on a connection of its own. A 304 moves
+ * the object's expiry on, and a new cacheable response replaces the object
+ * with add_to_cache, which swaps it in under the shard's writer lock, so a
+ * reader sees either the old object or the new one. Readers still holding
+ * the old one keep it pinned until they are done with it. The new copy is
+ * admitted even when the shard is full and takes over the old one's place
+ * in the eviction order, so refreshing a hot object never evicts it.
+ *
+ * A refresh leads a fetch of the object in the flight table (see
+ * flight.c), so an object is refreshed once however many requests find it
+ * stale, and requests that find it past its window wait for the refresh
+ * instead of fetching it again. A refresh that doesn't fit in the queue is
+ * dropped; the object is revalidated in line once its window is over.
+ */
+
+#include "refresh.h"
+#include "http.h"
+#include "parser.h"
+#include "stats.h"
+
+static void *refresh_thread(void *vargp);
+static void run_refresh(refresh_queue *q, refresh_job *job);
+static void fetch_object(refresh_queue *q, request_head *head, char *hostname,
+                         char *port, char *id, cache_object *stale);
+static int append(char **data, size_t *length, size_t *capacity, char *buf,
+                  size_t n, size_t max);
+
+/* init_refresh - Make the queue of refreshes and start its threads. */
+refresh_queue *init_refresh(cache_list *cache, dns_cache *dns,
+                            flight_table *flights, long window) {
+    refresh_queue *q = (refresh_queue *)Malloc(sizeof(refresh_queue));
+    pthread_t tid;
+    int i;
+
+    q->first = q->last = NULL;
+    q->count = 0;
+    q->window = window;
+    q->cache = cache;
+    q->dns = dns;
+    q->flights = flights;
+    Sem_init(&q->mutex, 0, 1);
+    Sem_init(&q->items, 0, 0);
+    for (i = 0; i < REFRESH_THREADS; i++)
+        Pthread_create(&tid, NULL, refresh_thread, q);
+    return q;
+}
+
+/*
+ * refresh_stale - Decide whether the stale object, pinned by the caller,
+ *                 may be served at time now, and queue a refresh of it if
+ *                 none is under way. head is the request that found it
+ *                 stale, head_length bytes, which is copied. Returns 1 if
+ *                 the object may be served, or 0 if it must be revalidated
+ *                 first.
+ */
+int refresh_stale(refresh_queue *q, cache_object *object, char *id,
+                  char *head, size_t head_length, time_t now) {
+    time_t expires = __atomic_load_n(&object->expires, __ATOMIC_RELAXED);
+    refresh_job *job;
+    freshness f;
+    flight *fl;
+
+    freshness_scan(&f, object->data,
+                   object->hdr_length ? object->hdr_length : object->length);
+    if (now >= expires + freshness_stale_window(&f, q->window))
+        return 0;
+
+    /* Someone is fetching it already */
+    if ((fl = flight_lead(q->flights, id)) == NULL)
+        return 1;
+
+    job = (refresh_job *)Malloc(sizeof(refresh_job));
+    job->id = (char *)Malloc(strlen(id) + 1);
+    strcpy(job->id, id);
+    job->head = (char *)Malloc(head_length);
+    memcpy(job->head, head, head_length);
+    job->head_length = head_length;
+    job->flight = fl;
+    job->next = NULL;
+
+    P(&q->mutex);
+    if (q->count == REFRESH_QUEUE_MAX) {
+        V(&q->mutex);
+        flight_finish(q->flights, fl);
+        Free(job->head);
+        Free(job->id);
+        Free(job);
+        return 1;
+    }
+    if (q->last != NULL)
+        q->last->next = job;
+    else
+        q->first = job;
+    q->last = job;
+    q->count++;
+    V(&q->mutex);
+    V(&q->items);
+    return 1;
+}
+
+/* refresh_thread - Run queued refreshes, oldest first, forever. */
+static void *refresh_thread(void *vargp) {
+    refresh_queue *q = (refresh_queue *)vargp;
+    refresh_job *job;
+
+    Pthread_detach(Pthread_self());
+    while (1) {
+        P(&q->items);
+        P(&q->mutex);
+        job = q->first;
+        q->first = job->next;
+        if (q->first == NULL)
+            q->last = NULL;
+        q->count--;
+        V(&q->mutex);
+
+        enter_cache(q->cache);
+        run_refresh(q, job);
+        flight_finish(q->flights, job->flight);
+        leave_cache(q->cache);
+        Free(job->head);
+        Free(job->id);
+        Free(job);
+    }
+    return NULL;
+}
+
+/*
+ * run_refresh - Tokenize the request of a job again, as a request for the
+ *               whole object, and fetch the object if it is still stale.
+ */
+static void run_refresh(refresh_queue *q, refresh_job *job) {
+    char hostname[MAXLINE], port[MAXLINE];
+    char *p = job->head, *end = job->head + job->head_length, *nl;
+    request_head head;
+    cache_object *stale;
+    int rc = 0;
+
+    head_init(&head);
+    while (rc == 0 && (nl = memchr(p, '\n', end - p)) != NULL) {
+        rc = head_line(&head, p, nl - p + 1);
+        p = nl + 1;
+    }
+    if (rc < 0 || head_host(&head, hostname, port) < 0)
+        return;
+    head.identity = q->cache->compress;
+    head.slice = 1;
+
+    /* The object may have been fetched again or evicted meanwhile */
+    if ((stale = search_cache(q->cache, job->id)) != NULL &&
+        object_fresh(stale, time(NULL))) {
+        release_object(stale);
+        return;
+    }
+    if (stale != NULL &&
+        head_validators(&head, stale->data,
+                        stale->hdr_length ? stale->hdr_length
+                                          : stale->length) == 0) {
+        release_object(stale);
+        stale = NULL;
+    }
+    fetch_object(q, &head, hostname, port, job->id, stale);
+    if (stale != NULL)
+        release_object(stale);
+}
+
+/*
+ * fetch_object - Send the request head to the host on a new connection and
+ *                read the response. A 304 moves the stale object's expiry
+ *                on, with its stored headers updated by those of the 304 as
+ *                in a revalidation in line. A complete, framed, cacheable
+ *                response no larger than the largest object replaces the
+ *                object, with the same hop-by-hop headers dropped as from a
+ *                relayed response. Anything else leaves the cache alone.
+ */
+static void fetch_object(refresh_queue *q, request_head *head, char *hostname,
+                         char *port, char *id, cache_object *stale) {
+    struct timeval timeout = { REFRESH_TIMEOUT, 0 };
+    char buf[MAXBUF];
+    char *data = NULL;
+    size_t length = 0, capacity = 0, hdr_length = 0;
+    size_t max = q->cache->max_object;
+    http_parser parser;
+    freshness f, updated;
+    time_t expires;
+    rio_t rio;
+    ssize_t n;
+    int fd, status = 0;
+
+    if ((n = head_compose(head, 0, buf, sizeof(buf))) < 0)
+        return;
+    if ((fd = dns_connect(q->dns, hostname, port)) < 0)
+        return;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (Rio_writen(fd, buf, n) == -1)
+        goto done;
+
+    /* Status line and headers */
+    Rio_readinitb(&rio, fd);
+    parser_init(&parser, PARSE_RESPONSE);
+    if ((n = Rio_readlineb(&rio, buf, MAXLINE)) <= 0)
+        goto done;
+    parser_execute(&parser, buf, n);
+    if (parser.state != PARSE_HEADER)
+        goto done;
+    sscanf(buf, "%*s %d", &status);
+    freshness_init(&f, parser.status);
+    if (stale != NULL && status == 304) {
+        freshness_scan(&updated, stale->data,
+                       stale->hdr_length ? stale->hdr_length : stale->length);
+        updated.age = 0;
+    }
+    if (append(&data, &length, &capacity, buf, n, max) < 0)
+        goto done;
+    while (1) {
+        if ((n = Rio_readlineb(&rio, buf, MAXLINE)) <= 0)
+            goto done;
+        parser_execute(&parser, buf, n);
+        if (parser.state == PARSE_ERROR)
+            goto done;
+        if (parser.state != PARSE_HEADER)
+            break;
+        if (!strncasecmp(buf, "Connection:", 11) ||
+            !strncasecmp(buf, "Keep-Alive:", 11) ||
+            !strncasecmp(buf, "Proxy-Connection:", 17))
+            continue;
+        freshness_header(&f, buf);
+        if (stale != NULL && status == 304)
+            freshness_header(&updated, buf);
+        if (append(&data, &length, &capacity, buf, n, max) < 0)
+            goto done;
+    }
+    hdr_length = length;
+    if (append(&data, &length, &capacity, buf, n, max) < 0)
+        goto done;
+
+    /* The stale copy is still valid */
+    if (stale != NULL && status == 304) {
+        if ((expires = freshness_expiry(&updated, time(NULL))) >= 0) {
+            refresh_object(stale, expires);
+            stats_add(STAT_REVALIDATED, 1);
+            stats_add(STAT_REFRESHES, 1);
+        }
+        goto done;
+    }
+    if ((expires = freshness_expiry(&f, time(NULL))) < 0 || !parser.framed)
+        goto done;
+
+    /* Body */
+    while (parser.state != PARSE_DONE) {
+        if (rio.rio_cnt <= 0 && (n = Rio_fill(&rio)) <= 0)
+            goto done;
+        n = parser_execute(&parser, rio.rio_bufptr, rio.rio_cnt);
+        if (parser.state == PARSE_ERROR ||
+            append(&data, &length, &capacity, rio.rio_bufptr, n, max) < 0)
+            goto done;
+        rio.rio_bufptr += n;
+        rio.rio_cnt -= n;
+    }
+    if (add_to_cache(q->cache, id, data, length, hdr_length, expires) == 0)
+        stats_add(STAT_REFRESHES, 1);
+
+done:
+    Close(fd);
+    if (data != NULL)
+        Free(data);
+}
+
+/* append - Append n bytes of buf to a growing buffer, unless that makes it
+ *          longer than max. Returns 0 on success or -1 if it doesn't fit.
+ */
+static int append(char **data, size_t *length, size_t *capacity, char *buf,
+                  size_t n, size_t max) {
+    size_t need = *length + n;
+
+    if (need > max)
+        return -1;
+    if (need > *capacity) {
+        *capacity = (*capacity * 2 > need) ? *capacity * 2 : need;
+        if (*capacity > max)
+            *capacity = max;
+        *data = (char *)Realloc(*data, *capacity);
+    }
+    memcpy(*data + *length, buf, n);
+    *length = need;
+    return 0;
+}
@@ -0,0 +1,47 @@
+/* Background refresh header file for refresh.c
+ * Author: Aleksander Bapst (abapst)
+ */
+
+#ifndef __REFRESH_H__
+#define __REFRESH_H__
+
+#include "csapp.h"
+#include "cache.h"
+#include "dnscache.h"
+#include "flight.h"
+
+#define REFRESH_THREADS 2     // threads refreshing stale objects
+#define REFRESH_QUEUE_MAX 64  // refreshes waiting for a thread
+#define REFRESH_TIMEOUT 30    // seconds a refresh waits for its host
+
+/* A stale object to fetch again */
+typedef struct refresh_job {
+
+    char *id; // cache id of the object
+    char *head; // the request head that found it stale, as read
+    size_t head_length;
+    flight *flight; // led by the refresh, finished once it is done
+    struct refresh_job *next;
+
+} refresh_job;
+
+typedef struct refresh_queue {
+
+    refresh_job *first, *last; // waiting refreshes, oldest first
+    unsigned int count;
+    long window; // seconds past expiry an object without its own
+                 // stale-while-revalidate may be served, 0 for none
+    cache_list *cache;
+    dns_cache *dns;
+    flight_table *flights;
+    sem_t mutex; // protects the queue
+    sem_t items; // counts waiting refreshes
+
+} refresh_queue;
+
+refresh_queue *init_refresh(cache_list *cache, dns_cache *dns,
+                            flight_table *flights, long window);
+int refresh_stale(refresh_queue *q, cache_object *object, char *id,
+                  char *head, size_t head_length, time_t now);
+
+#endif /* __REFRESH_H__ */
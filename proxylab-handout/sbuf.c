@@ -0,0 +1,50 @@
+/* Bounded connection queue for Proxylab, CMU 15-213/513, Fall 2015
+ * Author: Aleksander Bapst (abapst)
+ *
+ * A bounded producer/consumer buffer of connected descriptors, following the
+ * sbuf package from the CS:APP text. The accepting thread inserts new
+ * connections and the worker threads remove them. Inserting into a full
+ * buffer blocks, so when every worker is busy and the queue is full the
+ * proxy stops accepting and new clients wait in the kernel's listen backlog.
+ */
+
+#include "sbuf.h"
+
+/* sbuf_init - Create an empty, bounded, shared FIFO buffer with n slots. */
+void sbuf_init(sbuf_t *sp, int n) {
+    sp->buf = Calloc(n, sizeof(int));
+    sp->n = n;                  // buffer holds max of n items
+    sp->front = sp->rear = 0;   // empty buffer iff front == rear
+    Sem_init(&sp->mutex, 0, 1); // binary semaphore for locking
+    Sem_init(&sp->slots, 0, n); // initially, buf has n empty slots
+    Sem_init(&sp->items, 0, 0); // initially, buf has zero data items
+}
+
+/* sbuf_deinit - Clean up buffer sp. */
+void sbuf_deinit(sbuf_t *sp) {
+    Free(sp->buf);
+}
+
+/* sbuf_insert - Insert item onto the rear of shared buffer sp, waiting for
+ *               a free slot if the buffer is full.
+ */
+void sbuf_insert(sbuf_t *sp, int item) {
+    P(&sp->slots);                         // wait for available slot
+    P(&sp->mutex);                         // lock the buffer
+    sp->buf[(++sp->rear)%(sp->n)] = item;  // insert the item
+    V(&sp->mutex);                         // unlock the buffer
+    V(&sp->items);                         // announce available item
+}
+
+/* sbuf_remove - Remove and return the first item from buffer sp, waiting
+ *               for an item if the buffer is empty.
+ */
+int sbuf_remove(sbuf_t *sp) {
+    int item;
+    P(&sp->items);                         // wait for available item
+    P(&sp->mutex);                         // lock the buffer
+    item = sp->buf[(++sp->front)%(sp->n)]; // remove the item
+    V(&sp->mutex);                         // unlock the buffer
+    V(&sp->slots);                         // announce available slot
+    return item;
+}
@@ -0,0 +1,99 @@
+/* Frequency sketch for Proxylab, CMU 15-213/513, Fall 2015
+ * Author: Aleksander Bapst (abapst)
+ *
+ * A count-min sketch that estimates how often each cache id has been asked
+ * for recently, as used by the TinyLFU admission filter. Every id maps to
+ * one small counter in each of SKETCH_DEPTH rows, and its estimate is the
+ * smallest of those counters, so collisions can only make an id look more
+ * popular than it is. Counters saturate at SKETCH_MAX. After every
+ * SKETCH_SAMPLE * width additions all counters are halved, so the sketch
+ * forgets old popularity and follows changes in the workload.
+ *
+ * The sketch is updated on cache hits that only hold a reader lock,
+ * so counters are changed with relaxed atomics and no lock. Increments that
+ * race with each other or with a halving may be lost; the counts are
+ * estimates anyway.
+ */
+
+#include "sketch.h"
+
+/* Odd multipliers giving each row an independent index */
+static const unsigned int seeds[SKETCH_DEPTH] = {
+    0x9e3779b1u, 0x85ebca77u, 0xc2b2ae3du, 0x27d4eb2fu
+};
+
+static unsigned int sketch_index(sketch *s, unsigned int hash, int row);
+static void sketch_halve(sketch *s);
+
+/* init_sketch - Create a sketch with width counters per row. width is
+ *               rounded up to a power of two, at most SKETCH_MAX_WIDTH.
+ */
+sketch *init_sketch(unsigned int width) {
+    sketch *s = (sketch *)Malloc(sizeof(sketch));
+
+    s->width = 1;
+    while (s->width < width && s->width < SKETCH_MAX_WIDTH)
+        s->width <<= 1;
+    s->table = (unsigned char *)Calloc(SKETCH_DEPTH, s->width);
+    s->additions = 0;
+    s->sample = SKETCH_SAMPLE * s->width;
+    return s;
+}
+
+/* sketch_add - Count one more request for the id with the given hash. */
+void sketch_add(sketch *s, unsigned int hash) {
+    unsigned char *counter;
+    int row;
+
+    for (row = 0; row < SKETCH_DEPTH; row++) {
+        counter = &s->table[row * s->width + sketch_index(s, hash, row)];
+        if (__atomic_load_n(counter, __ATOMIC_RELAXED) < SKETCH_MAX)
+            __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+    }
+    if (__atomic_add_fetch(&s->additions, 1, __ATOMIC_RELAXED) == s->sample)
+        sketch_halve(s);
+}
+
+/* sketch_estimate - Estimated recent requests for the id with the given
+ *                   hash.
+ */
+unsigned int sketch_estimate(sketch *s, unsigned int hash) {
+    unsigned int min = SKETCH_MAX, count;
+    int row;
+
+    for (row = 0; row < SKETCH_DEPTH; row++) {
+        count = __atomic_load_n(&s->table[row * s->width +
+                                          sketch_index(s, hash, row)],
+                                __ATOMIC_RELAXED);
+        if (count < min)
+            min = count;
+    }
+    return min;
+}
+
+/* free_sketch - Free a sketch. */
+void free_sketch(sketch *s) {
+    Free(s->table);
+    Free(s);
+}
+
+/* sketch_index - Counter used by an id in a row. */
+static unsigned int sketch_index(sketch *s, unsigned int hash, int row) {
+    unsigned int h = hash * seeds[row];
+
+    return (h ^ (h >> 15)) & (s->width - 1);
+}
+
+/* sketch_halve - Age the sketch by halving every counter. Only the thread
+ *                whose addition completed the sample gets here.
+ */
+static void sketch_halve(sketch *s) {
+    unsigned int i;
+    unsigned char count;
+
+    for (i = 0; i < SKETCH_DEPTH * s->width; i++) {
+        count = __atomic_load_n(&s->table[i], __ATOMIC_RELAXED);
+        __atomic_store_n(&s->table[i], count >> 1, __ATOMIC_RELAXED);
+    }
+    __atomic_sub_fetch(&s->additions, s->sample, __ATOMIC_RELAXED);
+}
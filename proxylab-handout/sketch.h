@@ -0,0 +1,29 @@
+/* Frequency sketch header file for sketch.c
+ * Author: Aleksander Bapst (abapst)
+ */
+
+#ifndef __SKETCH_H__
+#define __SKETCH_H__
+
+#include "csapp.h"
+
+#define SKETCH_DEPTH 4     // rows, each indexed by a different hash
+#define SKETCH_MAX 15      // counters saturate here, as 4-bit counters would
+#define SKETCH_SAMPLE 10   // halve all counters after SAMPLE * width adds
+#define SKETCH_MAX_WIDTH (1 << 20) // counters per row, however big the cache
+
+typedef struct sketch {
+
+    unsigned char *table; // SKETCH_DEPTH rows of width counters
+    unsigned int width; // counters per row, a power of two
+    unsigned int additions; // adds since the counters were last halved
+    unsigned int sample; // adds between halvings
+
+} sketch;
+
+sketch *init_sketch(unsigned int width);
+void sketch_add(sketch *s, unsigned int hash);
+unsigned int sketch_estimate(sketch *s, unsigned int hash);
+void free_sketch(sketch *s);
+
+#endif /* __SKETCH_H__ */
@@ -0,0 +1,182 @@
+/* Slab allocator for Proxylab, CMU 15-213/513, Fall 2015
+ * Author: Aleksander Bapst (abapst)
+ *
+ * A size-classed allocator in the style of memcached, used for cache
+ * objects. Chunk sizes start at SLAB_MIN_CHUNK and grow by SLAB_GROWTH up to
+ * SLAB_PAGE_SIZE, so any request is rounded up by at most 25%. Memory is
+ * taken from malloc a page at a time and carved into chunks of one class;
+ * freed chunks go on their class's free list and are handed out again
+ * before anything new is carved. Pages are never returned to malloc while
+ * the allocator lives, so cache churn settles into reusing the same chunks
+ * instead of fragmenting the heap.
+ *
+ * Each class has its own semaphore, so threads freeing and allocating
+ * objects of different sizes don't contend, and none of them take the
+ * malloc lock once the pages exist. Requests larger than the largest class
+ * go straight to malloc.
+ *
+ * The caller passes the size of a chunk to slab_free again; the class is
+ * recomputed from it rather than stored in every chunk.
+ */
+
+#include "slab.h"
+
+static int slab_class_of(slab_allocator *slabs, size_t size);
+
+/* init_slabs - Create an allocator with every size class set up but no
+ *              memory taken yet.
+ */
+slab_allocator *init_slabs(void) {
+    slab_allocator *slabs = (slab_allocator *)Calloc(1, sizeof(slab_allocator));
+    size_t size = SLAB_MIN_CHUNK;
+    slab_class *class;
+
+    while (slabs->nclasses < SLAB_MAX_CLASSES) {
+        class = &slabs->classes[slabs->nclasses++];
+        class->size = size;
+        class->perpage = SLAB_PAGE_SIZE / size;
+        Sem_init(&class->mutex, 0, 1);
+        if (size == SLAB_PAGE_SIZE)
+            break;
+
+        /* Next size, rounded up to keep chunks 8-byte aligned */
+        size = ((size_t)(size * SLAB_GROWTH) + 7) & ~(size_t)7;
+        if (size > SLAB_PAGE_SIZE)
+            size = SLAB_PAGE_SIZE;
+    }
+    Sem_init(&slabs->large_mutex, 0, 1);
+    return slabs;
+}
+
+/*
+ * slab_alloc - Return a chunk of at least size bytes from the smallest class
+ *              that fits, taking a new page from malloc only when the class
+ *              has no free or uncarved chunks left.
+ */
+void *slab_alloc(slab_allocator *slabs, size_t size) {
+    int index = slab_class_of(slabs, size);
+    slab_class *class;
+    void *chunk;
+
+    if (index < 0) {
+        P(&slabs->large_mutex);
+        slabs->large_used++;
+        slabs->large_bytes += size;
+        V(&slabs->large_mutex);
+        return Malloc(size);
+    }
+
+    class = &slabs->classes[index];
+    P(&class->mutex);
+    if ((chunk = class->free_list) != NULL) {
+        class->free_list = *(void **)chunk;
+    } else {
+        if (class->carve_left == 0) {
+            class->pages = (void **)Realloc(class->pages,
+                                            (class->npages + 1) *
+                                            sizeof(void *));
+            class->next_chunk = (char *)Malloc(class->perpage * class->size);
+            class->pages[class->npages++] = class->next_chunk;
+            class->carve_left = class->perpage;
+        }
+        chunk = class->next_chunk;
+        class->next_chunk += class->size;
+        class->carve_left--;
+    }
+    class->used++;
+    class->requested += size;
+    V(&class->mutex);
+    return chunk;
+}
+
+/* slab_free - Give back a chunk that was allocated with the same size. */
+void slab_free(slab_allocator *slabs, void *ptr, size_t size) {
+    int index = slab_class_of(slabs, size);
+    slab_class *class;
+
+    if (index < 0) {
+        P(&slabs->large_mutex);
+        slabs->large_used--;
+        slabs->large_bytes -= size;
+        V(&slabs->large_mutex);
+        Free(ptr);
+        return;
+    }
+
+    class = &slabs->classes[index];
+    P(&class->mutex);
+    *(void **)ptr = class->free_list;
+    class->free_list = ptr;
+    class->used--;
+    class->requested -= size;
+    V(&class->mutex);
+}
+
+/*
+ * slab_report - Print how full each class in use is, and how much of the
+ *               memory handed out was actually asked for.
+ */
+void slab_report(slab_allocator *slabs, FILE *out) {
+    unsigned long total = 0, used = 0, requested = 0;
+    unsigned long chunks;
+    unsigned int i;
+    slab_class *class;
+
+    fprintf(out, "%8s %6s %8s %10s %7s\n",
+            "chunk", "pages", "used", "requested", "util");
+    for (i = 0; i < slabs->nclasses; i++) {
+        class = &slabs->classes[i];
+        P(&class->mutex);
+        if (class->npages > 0) {
+            chunks = (unsigned long)class->npages * class->perpage;
+            fprintf(out, "%8zu %6u %3lu/%-4lu %10lu %6.1f%%\n", class->size,
+                    class->npages, class->used, chunks, class->requested,
+                    class->used ? 100.0 * class->requested /
+                    (class->used * class->size) : 0.0);
+            total += chunks * class->size;
+            used += class->used * class->size;
+            requested += class->requested;
+        }
+        V(&class->mutex);
+    }
+    fprintf(out, "slabs: %lu bytes in pages, %lu in chunks in use, "
+            "%lu requested", total, used, requested);
+    if (used > 0)
+        fprintf(out, " (%.1f%% of chunk space)", 100.0 * requested / used);
+    fprintf(out, "\nlarge: %lu allocations, %lu bytes\n",
+            slabs->large_used, slabs->large_bytes);
+}
+
+/* destroy_slabs - Free every page. Chunks still in use become invalid. */
+void destroy_slabs(slab_allocator *slabs) {
+    unsigned int i, j;
+    slab_class *class;
+
+    for (i = 0; i < slabs->nclasses; i++) {
+        class = &slabs->classes[i];
+        for (j = 0; j < class->npages; j++)
+            Free(class->pages[j]);
+        if (class->pages != NULL)
+            Free(class->pages);
+        sem_destroy(&class->mutex);
+    }
+    Free(slabs);
+}
+
+/* slab_class_of - Index of the smallest class holding size bytes, found by
+ *                 binary search, or -1 if size is larger than every class.
+ */
+static int slab_class_of(slab_allocator *slabs, size_t size) {
+    int lo = 0, hi = slabs->nclasses - 1, mid;
+
+    if (size > slabs->classes[hi].size)
+        return -1;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (slabs->classes[mid].size < size)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
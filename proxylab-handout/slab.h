@@ -0,0 +1,46 @@
+/* Slab allocator header file for slab.c
+ * Author: Aleksander Bapst (abapst)
+ */
+
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include "csapp.h"
+
+#define SLAB_MIN_CHUNK 96        // smallest chunk, a multiple of 8
+#define SLAB_GROWTH 1.25         // ratio between neighbouring chunk sizes
+#define SLAB_PAGE_SIZE (1 << 18) // bytes carved into chunks at a time
+#define SLAB_MAX_CLASSES 64
+
+typedef struct slab_class {
+
+    size_t size; // chunk size
+    unsigned int perpage; // chunks carved from each page
+    void *free_list; // freed chunks, linked through their first word
+    char *next_chunk; // uncarved rest of the newest page
+    unsigned int carve_left; // chunks left to carve from it
+    void **pages; // every page, so they can be freed
+    unsigned int npages;
+    unsigned long used; // chunks handed out
+    unsigned long requested; // bytes asked for by the chunks handed out
+    sem_t mutex;
+
+} slab_class;
+
+typedef struct slab_allocator {
+
+    slab_class classes[SLAB_MAX_CLASSES];
+    unsigned int nclasses;
+    unsigned long large_used; // allocations above the largest chunk size,
+    unsigned long large_bytes; // which go to malloc instead
+    sem_t large_mutex;
+
+} slab_allocator;
+
+slab_allocator *init_slabs(void);
+void *slab_alloc(slab_allocator *slabs, size_t size);
+void slab_free(slab_allocator *slabs, void *ptr, size_t size);
+void slab_report(slab_allocator *slabs, FILE *out);
+void destroy_slabs(slab_allocator *slabs);
+
+#endif /* __SLAB_H__ */
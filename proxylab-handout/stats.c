@@ -0,0 +1,201 @@
+/* Proxy statistics for Proxylab, CMU 15-213/513, Fall 2015
+ * Author: Aleksander Bapst (abapst)
+ *
+ * Counters and latency histograms of the proxy, served at STATS_PATH to a
+ * client that sends the request to the proxy itself, as in
+ *
+ *     curl http://localhost:<port>/proxy-stats
+ *
+ * in the Prometheus text format. Every thread that records anything gets a
+ * block of its own the first time it does, linked into a global list. Only
+ * the owning thread writes a block, with plain relaxed stores, so counting
+ * never contends or bounces cache lines between threads; a report adds up
+ * all the blocks. A gauge such as the number of open connections may be
+ * raised by one thread and lowered by another, so a single block's value
+ * means nothing on its own, but the sum is right.
+ *
+ * Latencies are kept in microseconds in power-of-two buckets, so bucket i
+ * counts latencies below 2^i us and the last bucket everything longer.
+ */
+
+#include <time.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include "stats.h"
+
+static const char *counter_names[STAT_NCOUNTERS] = {
+    "proxy_requests_total", "proxy_cache_hits_total",
+    "proxy_cache_misses_total", "proxy_cache_revalidated_total",
+    "proxy_cache_evictions_total", "proxy_bytes_from_cache_total",
+    "proxy_bytes_from_origin_total", "proxy_connections_total",
+    "proxy_connections_active", "proxy_cache_stale_hits_total",
+    "proxy_cache_refreshes_total"
+};
+static const char *phase_names[PHASE_N] = {
+    "parse", "lookup", "connect", "first_byte", "total"
+};
+
+static stats_block *blocks = NULL; // every thread's block
+static sem_t blocks_mutex; // protects the list
+static __thread stats_block *my_block = NULL;
+
+static stats_block *get_block(void);
+static void block_add(uint64_t *p, uint64_t n);
+static size_t stats_report(char *buf, size_t size);
+static void appendf(char *buf, size_t size, size_t *len, const char *fmt,
+                    ...);
+
+/* init_stats - Get ready to count. Called once before any thread starts. */
+void init_stats(void) {
+    Sem_init(&blocks_mutex, 0, 1);
+}
+
+/* stats_add - Add n, which may be negative for a gauge, to a counter. */
+void stats_add(int counter, long n) {
+    block_add((uint64_t *)&get_block()->counters[counter], n);
+}
+
+/* stats_clock - Monotonic time in microseconds, for timing phases. */
+long stats_clock(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/* stats_phase - Record a phase that began at start, from stats_clock. */
+void stats_phase(int phase, long start) {
+    stats_block *b = get_block();
+    long us = stats_clock() - start;
+    int i = 0;
+
+    if (us < 0)
+        us = 0;
+    while (i < STATS_BUCKETS - 1 && us >= (1L << i))
+        i++;
+    block_add(&b->buckets[phase][i], 1);
+    block_add(&b->count[phase], 1);
+    block_add(&b->sum[phase], us);
+}
+
+/*
+ * stats_response - Write the whole response to a request the client sent to
+ *                  the proxy itself for path, path_len bytes, into buf: the
+ *                  statistics for STATS_PATH and a 404 for anything else.
+ *                  conn_hdr goes in front of the blank line. Returns the
+ *                  length of the response, or -1 if it doesn't fit.
+ */
+ssize_t stats_response(char *path, size_t path_len, const char *conn_hdr,
+                       char *buf, size_t size) {
+    char *body;
+    size_t body_len;
+    int found, n;
+
+    found = (path_len == strlen(STATS_PATH) &&
+             !memcmp(path, STATS_PATH, path_len));
+    body = (char *)Malloc(size);
+    if (found)
+        body_len = stats_report(body, size);
+    else
+        body_len = snprintf(body, size, "Not found\n");
+
+    n = snprintf(buf, size, "HTTP/1.0 %s\r\n"
+                 "Content-Type: text/plain; version=0.0.4\r\n"
+                 "Content-Length: %zu\r\n"
+                 "Cache-Control: no-store\r\n"
+                 "%s\r\n", found ? "200 OK" : "404 Not Found", body_len,
+                 conn_hdr);
+    if (n < 0 || n + body_len > size) {
+        Free(body);
+        return -1;
+    }
+    memcpy(buf + n, body, body_len);
+    Free(body);
+    return n + body_len;
+}
+
+/* get_block - The calling thread's block, made on its first use. */
+static stats_block *get_block(void) {
+    stats_block *b = my_block;
+
+    if (b == NULL) {
+        b = (stats_block *)Calloc(1, sizeof(stats_block));
+        P(&blocks_mutex);
+        b->next = blocks;
+        blocks = b;
+        V(&blocks_mutex);
+        my_block = b;
+    }
+    return b;
+}
+
+/* block_add - Add to a value of the calling thread's block. The add needn't
+ *             be atomic, since no other thread writes it, but the store
+ *             must be, for the sake of a concurrent report.
+ */
+static void block_add(uint64_t *p, uint64_t n) {
+    __atomic_store_n(p, *p + n, __ATOMIC_RELAXED);
+}
+
+/*
+ * stats_report - Add up every thread's block and write them into buf, at
+ *                most size bytes, in the Prometheus text format. Returns the
+ *                length written.
+ */
+static size_t stats_report(char *buf, size_t size) {
+    const char *hist = "proxy_latency_microseconds";
+    stats_block total, *b;
+    uint64_t *src, *dst, cumulative;
+    char le[24];
+    size_t i, len = 0;
+    int phase;
+
+    memset(&total, 0, sizeof(total));
+    /* Every field before next is a 64-bit count */
+    P(&blocks_mutex);
+    for (b = blocks; b != NULL; b = b->next) {
+        src = (uint64_t *)b;
+        dst = (uint64_t *)&total;
+        for (i = 0; i < offsetof(stats_block, next) / sizeof(uint64_t); i++)
+            dst[i] += __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+    V(&blocks_mutex);
+
+    for (i = 0; i < STAT_NCOUNTERS; i++)
+        appendf(buf, size, &len, "# TYPE %s %s\n%s %lld\n", counter_names[i],
+                (i == STAT_CONNS_ACTIVE) ? "gauge" : "counter",
+                counter_names[i], (long long)total.counters[i]);
+
+    appendf(buf, size, &len, "# TYPE %s histogram\n", hist);
+    for (phase = 0; phase < PHASE_N; phase++) {
+        cumulative = 0;
+        for (i = 0; i < STATS_BUCKETS; i++) {
+            cumulative += total.buckets[phase][i];
+            if (i < STATS_BUCKETS - 1)
+                snprintf(le, sizeof(le), "%lu", 1UL << i);
+            else
+                strcpy(le, "+Inf");
+            appendf(buf, size, &len, "%s_bucket{phase=\"%s\",le=\"%s\"} %llu\n",
+                    hist, phase_names[phase], le,
+                    (unsigned long long)cumulative);
+        }
+        appendf(buf, size, &len, "%s_sum{phase=\"%s\"} %llu\n", hist,
+                phase_names[phase], (unsigned long long)total.sum[phase]);
+        appendf(buf, size, &len, "%s_count{phase=\"%s\"} %llu\n", hist,
+                phase_names[phase], (unsigned long long)total.count[phase]);
+    }
+
+    return (len < size) ? len : size - 1;
+}
+
+/* appendf - printf at *len in buf, at most size bytes, moving *len on. */
+static void appendf(char *buf, size_t size, size_t *len, const char *fmt,
+                    ...) {
+    va_list ap;
+
+    if (*len >= size)
+        return;
+    va_start(ap, fmt);
+    *len += vsnprintf(buf + *len, size - *len, fmt, ap);
+    va_end(ap);
+}
@@ -0,0 +1,56 @@
+/* Proxy statistics header file for stats.c
+ * Author: Aleksander Bapst (abapst)
+ */
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdint.h>
+#include "csapp.h"
+
+#define STATS_PATH "/proxy-stats" // served by the proxy itself
+#define STATS_BUCKETS 24          // latency buckets, up to 2^23 us, then +Inf
+#define STATS_RESPONSE_MAX 32768  // room for the whole stats response
+
+/* Counters */
+#define STAT_REQUESTS     0 // requests parsed
+#define STAT_HITS         1 // served from the cache without the host
+#define STAT_MISSES       2 // sent to the host, revalidations included
+#define STAT_REVALIDATED  3 // stale objects the host confirmed with a 304
+#define STAT_EVICTIONS    4 // objects evicted from memory
+#define STAT_BYTES_CACHE  5 // bytes written to clients from the cache
+#define STAT_BYTES_ORIGIN 6 // bytes relayed to clients from hosts
+#define STAT_CONNS        7 // client connections accepted
+#define STAT_CONNS_ACTIVE 8 // client connections open, a gauge
+#define STAT_STALE        9 // stale objects served while being refreshed
+#define STAT_REFRESHES   10 // background refreshes that updated the cache
+#define STAT_NCOUNTERS   11
+
+/* Phases of a request, each with a latency histogram */
+#define PHASE_PARSE      0 // reading and tokenizing the request head
+#define PHASE_LOOKUP     1 // searching the cache
+#define PHASE_CONNECT    2 // getting a connection to the host
+#define PHASE_FIRST_BYTE 3 // from the request sent to the response's start
+#define PHASE_TOTAL      4 // from the request line to the response's end
+#define PHASE_N          5
+
+/* One thread's statistics, only ever written by that thread */
+typedef struct stats_block {
+
+    int64_t counters[STAT_NCOUNTERS];
+    uint64_t buckets[PHASE_N][STATS_BUCKETS]; // bucket i counts latencies
+                                              // below 2^i us
+    uint64_t count[PHASE_N];
+    uint64_t sum[PHASE_N]; // total microseconds
+    struct stats_block *next; // next thread's block
+
+} stats_block;
+
+void init_stats(void);
+void stats_add(int counter, long n);
+long stats_clock(void);
+void stats_phase(int phase, long start);
+ssize_t stats_response(char *path, size_t path_len, const char *conn_hdr,
+                       char *buf, size_t size);
+
+#endif /* __STATS_H__ */
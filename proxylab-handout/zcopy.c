@@ -0,0 +1,109 @@
+/* Zero-copy streaming for Proxylab, CMU 15-213/513, Fall 2015
+ * Author: Aleksander Bapst (abapst)
+ *
+ * Moves response bodies that are too large for the cache from the host
+ * socket to the client socket with splice(2), so the data never passes
+ * through a user space buffer. splice needs a pipe on one side, so each
+ * thread keeps a pipe of its own that sits between the two sockets. If the
+ * kernel refuses to splice a descriptor, the copy falls back to read and
+ * write.
+ *
+ * splice is a GNU extension, and csapp.h does not build with _GNU_SOURCE,
+ * so this file only uses the system headers.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include "zcopy.h"
+
+/* Pipe between the sockets, created on a thread's first use */
+static __thread int zpipe[2] = { -1, -1 };
+
+static long copy_stream(int infd, int outfd, long length);
+static void close_pipe(void);
+
+/*
+ * zcopy_stream - Move length bytes, or everything up to EOF if length is -1,
+ *                from infd to outfd. Returns the number of bytes moved,
+ *                which is less than length if infd reached EOF first, or -1
+ *                on an error.
+ */
+long zcopy_stream(int infd, int outfd, long length) {
+    long total = 0;
+    ssize_t n, m;
+    size_t want;
+
+    if (zpipe[0] < 0 && pipe2(zpipe, O_CLOEXEC) < 0)
+        return copy_stream(infd, outfd, length);
+
+    while (length < 0 || total < length) {
+        want = (length < 0 || length - total > ZCOPY_CHUNK) ?
+            ZCOPY_CHUNK : (size_t)(length - total);
+        n = splice(infd, NULL, zpipe[1], NULL, want,
+                   SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EINVAL && total == 0)
+                return copy_stream(infd, outfd, length);
+            return -1;
+        }
+        if (n == 0) /* EOF */
+            break;
+
+        /* Drain the pipe completely, or it can't be used again */
+        while (n > 0) {
+            m = splice(zpipe[0], NULL, outfd, NULL, n,
+                       SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (m < 0 && errno == EINTR)
+                continue;
+            if (m <= 0) {
+                close_pipe();
+                return -1;
+            }
+            n -= m;
+            total += m;
+        }
+    }
+    return total;
+}
+
+/* copy_stream - zcopy_stream through a user space buffer. */
+static long copy_stream(int infd, int outfd, long length) {
+    char buf[8192];
+    long total = 0;
+    ssize_t n, m, off;
+    size_t want;
+
+    while (length < 0 || total < length) {
+        want = (length < 0 || length - total > (long)sizeof(buf)) ?
+            sizeof(buf) : (size_t)(length - total);
+        if ((n = read(infd, buf, want)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0)
+            break;
+        for (off = 0; off < n; off += m) {
+            if ((m = write(outfd, buf + off, n - off)) < 0) {
+                if (errno == EINTR) {
+                    m = 0;
+                    continue;
+                }
+                return -1;
+            }
+        }
+        total += n;
+    }
+    return total;
+}
+
+/* close_pipe - Throw away a pipe that may still hold data. */
+static void close_pipe(void) {
+    close(zpipe[0]);
+    close(zpipe[1]);
+    zpipe[0] = zpipe[1] = -1;
+}
@@ -0,0 +1,14 @@
+/* Zero-copy streaming header file for zcopy.c
+ * Author: Aleksander Bapst (abapst)
+ */
+
+#ifndef __ZCOPY_H__
+#define __ZCOPY_H__
+
+#include <sys/types.h>
+
+#define ZCOPY_CHUNK 65536 // bytes moved through the pipe per splice call
+
+long zcopy_stream(int infd, int outfd, long length);
+
+#endif /* __ZCOPY_H__ */